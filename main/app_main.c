@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -12,6 +13,7 @@
 #include <sys/unistd.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 
 #include "esp_psram.h"
@@ -26,6 +28,7 @@
 #include "driver/gpio.h"
 #include "driver/sdmmc_host.h"
 #include "esp_camera.h"
+#include "img_converters.h"
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_http_client.h"
@@ -48,6 +51,7 @@
 #include "lwip/inet.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
+#include "capseq_files.h"
 
 #define IGNORE_SLAVE
 
@@ -73,6 +77,30 @@
 
 #define CAPTURE_TASK_STACK_SIZE 8192
 #define CAPTURE_TASK_PRIORITY 5
+#define STREAM_MAX_CLIENTS 4
+#define STREAM_TASK_STACK_SIZE 4096
+#define STREAM_TASK_PRIORITY 4
+#define STREAM_HEAD_MAX 256
+#define STREAM_PART_TAIL "\r\n"
+#define STREAM_CLIENT_STALL_MS 5000
+#define STREAM_SELECT_TIMEOUT_MS 10
+#define STREAM_MAX_FPS 60
+#define STREAM_WS_HEADER_VERSION 1
+#define STREAM_WS_CONTROL_MAX 125   /* payload limit of a WebSocket control frame */
+#define STREAM_PREVIEW_MAX_WIDTH 320
+#define STREAM_PREVIEW_MAX_HEIGHT 240
+#define STREAM_PREVIEW_QUALITY 40
+#define SNAPSHOT_MAX_AGE_MS 1000
+#define SNAPSHOT_WAIT_MS 1000
+#define FILE_SEND_BUF_SIZE (32 * 1024)
+#define FILE_SEND_BUF_MIN 4096
+#define FILES_PAGE_DEFAULT 100
+#define FILES_PAGE_MAX 500
+#define TAR_STREAM_BLOCK_SIZE (32 * 1024)
+#define TAR_STREAM_BLOCK_COUNT 3
+#define TAR_READER_TASK_STACK_SIZE 4096
+#define CAPTURE_QUEUE_LEN 2
+#define CAPTURE_JOB_HISTORY 4
 
 #ifndef HTTPD_409_CONFLICT
 #define HTTPD_409_CONFLICT 409
@@ -99,6 +127,9 @@
 #ifndef CONFIG_CAPSEQ_SYNC_UDP_PORT
 #define CONFIG_CAPSEQ_SYNC_UDP_PORT 65
 #endif
+#ifndef CONFIG_CAPSEQ_SYNC_GROUP_ADDR
+#define CONFIG_CAPSEQ_SYNC_GROUP_ADDR "239.255.0.65"
+#endif
 #ifndef CONFIG_CAPSEQ_ALLOW_SLAVE_MISSING
 #define CONFIG_CAPSEQ_ALLOW_SLAVE_MISSING 0
 #endif
@@ -114,6 +145,38 @@
 #ifndef CONFIG_CAPSEQ_SYNC_START_RETRY_DELAY_MS
 #define CONFIG_CAPSEQ_SYNC_START_RETRY_DELAY_MS 100
 #endif
+#ifndef CONFIG_CAPSEQ_SLAVE_IDS
+#define CONFIG_CAPSEQ_SLAVE_IDS ""
+#endif
+#ifndef CONFIG_CAPSEQ_MAX_SLAVES
+#define CONFIG_CAPSEQ_MAX_SLAVES 6
+#endif
+#ifndef CONFIG_CAPSEQ_SLAVE_MDNS_BROWSE
+#define CONFIG_CAPSEQ_SLAVE_MDNS_BROWSE 0
+#endif
+
+#ifndef CONFIG_CAPSEQ_PREPARE_OVER_UDP
+#define CONFIG_CAPSEQ_PREPARE_OVER_UDP 0
+#endif
+#ifndef CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES
+#define CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES 10
+#endif
+
+#ifndef CONFIG_STREAM_DEFAULT_FPS
+#define CONFIG_STREAM_DEFAULT_FPS 0
+#endif
+
+#ifndef CONFIG_STREAM_PREVIEW_EVERY_N
+#define CONFIG_STREAM_PREVIEW_EVERY_N 5
+#endif
+
+#define CAPSEQ_MDNS_BROWSE_MS 1000
+#define CAPSEQ_SLOT_MAX_REGRAB 3
+#define SLAVE_PREPARE_TASK_STACK_SIZE 6144
+#define COLLECT_TASK_STACK_SIZE 6144
+#define COLLECT_BLOCK_SIZE (32 * 1024)
+#define COLLECT_BLOCK_COUNT 3
+#define COLLECT_LIST_MAX (64 * 1024)
 
 #if defined(SLAVE_NOT_AVAILAVLE)
 #define CAPSEQ_SLAVE_MISSING_OK 1
@@ -131,10 +194,107 @@ static httpd_handle_t s_stream_httpd = NULL;
 static volatile bool s_stream_enabled = false;
 static volatile bool s_stream_in_progress = false;
 static volatile bool s_stream_stop_requested = false;
-static int s_stream_fd = -1;
+static volatile bool s_stream_paused = false;
+static volatile bool s_snapshot_wanted = false;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    uint32_t seq;
+    int64_t timestamp_us;
+    uint16_t width;
+    uint16_t height;
+    pixformat_t format;
+    int refs;               /* guarded by s_frame_lock */
+} stream_frame_t;
+
+/*
+ * Metadata in front of every /ws binary message, little endian. header_len
+ * lets a decoder skip fields a newer firmware appends.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t version;        /* STREAM_WS_HEADER_VERSION */
+    uint8_t format;         /* pixformat_t of the payload */
+    uint16_t header_len;
+    uint32_t seq;
+    int64_t timestamp_us;
+    uint16_t width;
+    uint16_t height;
+    uint32_t size;          /* payload bytes after the header */
+} stream_ws_header_t;
+
+typedef struct {
+    httpd_req_t *req;       /* /stream async copy; NULL for /ws */
+    int fd;                 /* -1 while the slot is free */
+    bool ws;                /* binary WebSocket messages instead of multipart parts */
+    bool headers_sent;
+    stream_frame_t *frame;  /* part in flight; NULL while idle */
+    uint32_t last_seq;
+    char head[STREAM_HEAD_MAX];
+    size_t head_len;
+    size_t cursor;          /* bytes of head + frame + tail already sent */
+    int64_t last_progress_us;
+    uint32_t period_us;     /* 0: every frame the broadcaster publishes */
+    int64_t next_due_us;
+    int64_t last_done_us;
+    uint32_t fps_x10;       /* achieved rate, smoothed */
+    uint32_t frames_sent;
+    uint32_t frames_skipped;
+    uint32_t send_calls;    /* sendmsg() calls, including would-block ones */
+    uint64_t bytes_sent;
+    uint8_t pong[2 + STREAM_WS_CONTROL_MAX];  /* /ws: PONG queued by the httpd task */
+    size_t pong_len;        /* 0: none queued */
+    size_t pong_sent;
+} stream_client_t;
+
+static stream_client_t s_stream_clients[STREAM_MAX_CLIENTS];
+static int s_stream_client_count = 0;
+static SemaphoreHandle_t s_stream_lock = NULL;
+static TaskHandle_t s_stream_task = NULL;
+static TaskHandle_t s_stream_sender_task = NULL;
+static stream_frame_t *s_latest_frame = NULL;
+static uint32_t s_frame_seq = 0;
+static uint32_t s_stream_fps_x10 = 0;
+
+typedef struct {
+    volatile bool pending;  /* set by the capture loop, cleared by the broadcaster */
+    stream_frame_t *jpeg;   /* JPEG capture: frame copy ready to publish */
+    uint8_t *raw;           /* other formats: decimated pixels to encode */
+    size_t raw_len;
+    int width;
+    int height;
+    pixformat_t format;
+    int64_t timestamp_us;
+} stream_preview_t;
+
+static stream_preview_t s_preview;
+static portMUX_TYPE s_frame_lock = portMUX_INITIALIZER_UNLOCKED;
 static EventGroupHandle_t s_wifi_event_group;
 static const int WIFI_CONNECTED_BIT = BIT0;
 static QueueHandle_t s_capture_queue = NULL;
+static uint32_t s_capseq_seq = 1;
+
+typedef enum {
+    CAPTURE_JOB_FREE = 0,
+    CAPTURE_JOB_QUEUED,
+    CAPTURE_JOB_RUNNING,
+    CAPTURE_JOB_DONE,
+    CAPTURE_JOB_FAILED,
+} capture_job_state_t;
+
+/* Written by the capture task under s_job_lock, read by /api/capture/<id>. */
+typedef struct {
+    uint32_t id;
+    capture_job_state_t state;
+    int frames_captured;
+    int frames_written;
+    int frames_dropped;
+    int errors;
+    uint64_t bytes_written;
+    int64_t queued_us;
+    int64_t started_us;
+    int64_t finished_us;
+} capture_progress_t;
 
 typedef struct {
     char session[32];
@@ -143,27 +303,147 @@ typedef struct {
     framesize_t fs;
     pixformat_t fmt;
     int64_t cpu_time_to_start_us;
+    int64_t interval_us;    /* schedule slot period, 0 = free-run */
+    int resync_every;       /* beacon every N slots */
     esp_err_t result;
     char err_msg[64];
-    SemaphoreHandle_t done;
+    capture_progress_t progress;
 } capture_request_t;
 
+/* Capture jobs live here from submission until a newer job recycles the slot,
+ * so their progress stays queryable after they finish. */
+static capture_request_t s_capture_jobs[CAPTURE_JOB_HISTORY];
+static uint32_t s_next_job_id = 1;
+static portMUX_TYPE s_job_lock = portMUX_INITIALIZER_UNLOCKED;
+
 typedef struct {
     int64_t trip_time_us;
     int64_t cpu_disparity_us;
 } capseq_sync_metrics_t;
 
+/*
+ * Master <-> slave sync protocol (UDP, CONFIG_CAPSEQ_SYNC_UDP_PORT).
+ * Every datagram is one capseq_msg_t. Replies echo the request seq, so a
+ * late reply can never be mistaken for the answer to a newer request.
+ */
+#define CAPSEQ_PROTO_MAGIC 0x5143
+#define CAPSEQ_PROTO_VERSION 3
+#define CAPSEQ_START_MAX_SLAVES 16
+
+typedef enum {
+    CAPSEQ_MSG_READY = 1,
+    CAPSEQ_MSG_READY_RESP = 2,
+    CAPSEQ_MSG_PING = 3,
+    CAPSEQ_MSG_PONG = 4,
+    CAPSEQ_MSG_START = 5,
+    CAPSEQ_MSG_START_ACK = 6,
+    CAPSEQ_MSG_BEACON = 7,
+    CAPSEQ_MSG_PREPARE = 8,
+    CAPSEQ_MSG_PREPARE_ACK = 9,
+    CAPSEQ_MSG_ERROR = 0x7f,
+} capseq_msg_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint32_t seq;
+    uint32_t sender_id;
+    int32_t status;
+    int64_t origin_us;  /* requester clock at transmit */
+    int64_t recv_us;    /* responder clock at receive */
+    int64_t xmit_us;    /* responder clock at transmit */
+    int64_t arg_us;     /* START: start time in the master clock; BEACON: slot */
+} capseq_msg_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t node_id;
+    int64_t disparity_us;   /* master clock - slave clock */
+    int64_t trip_us;        /* one-way trip, lets the slave refine disparity from beacons */
+} capseq_start_entry_t;
+
+/* START is one datagram for the whole rig (multicast, or unicast on retry).
+ * Only the first `count` entries are sent. */
+typedef struct __attribute__((packed)) {
+    capseq_msg_t hdr;
+    uint8_t count;
+    capseq_start_entry_t entries[CAPSEQ_START_MAX_SLAVES];
+} capseq_start_msg_t;
+
+#define CAPSEQ_START_MSG_LEN(count) \
+    (offsetof(capseq_start_msg_t, entries) + (size_t)(count) * sizeof(capseq_start_entry_t))
+
+/* Sensor overrides in PREPARE are (key id, value) pairs; the id is the index
+ * into this table. Append only, and keep it identical on master and slave. */
+static const char *const s_capseq_sensor_keys[] = {
+    "quality", "brightness", "contrast", "saturation", "gainceiling", "colorbar",
+    "awb", "awb_gain", "wb_mode", "aec2", "ae_level", "aec_value",
+    "agc", "agc_gain", "gain_ctrl", "bpc", "wpc", "raw_gma",
+    "lenc", "hmirror", "vflip", "dcw", "special_effect", "exposure_ctrl",
+};
+#define CAPSEQ_SENSOR_KEY_COUNT (sizeof(s_capseq_sensor_keys) / sizeof(s_capseq_sensor_keys[0]))
+
+typedef struct __attribute__((packed)) {
+    uint8_t key;
+    int16_t value;
+} capseq_sensor_kv_t;
+
+/* Capture descriptor; only the first `sensor_count` overrides are sent. */
+typedef struct __attribute__((packed)) {
+    capseq_msg_t hdr;
+    char session[32];
+    uint32_t frame_count;
+    uint8_t framesize;
+    uint8_t pixformat;
+    uint16_t resync_every;
+    int64_t interval_us;
+    uint8_t sensor_count;
+    capseq_sensor_kv_t sensors[CAPSEQ_SENSOR_KEY_COUNT];
+} capseq_prepare_msg_t;
+
+#define CAPSEQ_PREPARE_MSG_LEN(count) \
+    (offsetof(capseq_prepare_msg_t, sensors) + (size_t)(count) * sizeof(capseq_sensor_kv_t))
+
+/* How a schedule slot was served; recorded in the session metadata. */
+typedef enum {
+    CAPSEQ_SLOT_FREE = 0,       /* no schedule, free-running grab */
+    CAPSEQ_SLOT_ON_TIME,
+    CAPSEQ_SLOT_DELAYED,        /* stale buffered frame discarded, re-grabbed */
+    CAPSEQ_SLOT_DROPPED,        /* reached too late, slot skipped */
+} capseq_slot_action_t;
+
+/* Progress of one slave through a capture sequence; phases only move forward. */
+typedef enum {
+    CAPSEQ_SLAVE_OFFLINE = 0,
+    CAPSEQ_SLAVE_RESOLVED,
+    CAPSEQ_SLAVE_READY,
+    CAPSEQ_SLAVE_SYNCED,
+    CAPSEQ_SLAVE_STARTED,
+} capseq_slave_state_t;
+
+typedef struct {
+    char id[8];
+    uint32_t node_id;
+    struct sockaddr_in addr;    /* UDP sync endpoint */
+    bool browsed;               /* addr came from the mDNS browse */
+    capseq_slave_state_t state;
+    capseq_sync_metrics_t metrics;
+} capseq_slave_t;
+
+static capseq_slave_t s_slaves[CONFIG_CAPSEQ_MAX_SLAVES];
+static int s_slave_count = 0;
+
 static esp_err_t init_camera(void);
 static esp_err_t init_camera_with_format(framesize_t fs, pixformat_t pf);
 static esp_err_t init_capture_task(void);
 static void capture_task(void *arg);
 static esp_err_t run_capture_sequence(capture_request_t *req);
+static bool collect_active_locked(void);
 static esp_err_t send_slave_stream_cmd(const char *path);
-static esp_err_t udp_slave_wait_ready(int timeout_ms, int poll_ms);
-static esp_err_t udp_slave_start_with_retry(int64_t start_delay_us);
-static esp_err_t udp_slave_ready_check(void);
-static esp_err_t udp_sync_metrics(capseq_sync_metrics_t *metrics);
-static esp_err_t udp_slave_start_capture(int64_t start_delay_us);
+static esp_err_t capseq_registry_init(void);
+static int stream_clients_json(char *buf, size_t len);
+static void stream_set_enabled(bool enabled);
+static int64_t capseq_fb_time_us(const camera_fb_t *fb);
 
 static void camera_power_cycle(void)
 {
@@ -184,13 +464,16 @@ static void camera_power_cycle(void)
     vTaskDelay(pdMS_TO_TICKS(CAMERA_RESET_DELAY_MS));
 }
 
-static void stop_stream_and_wait(uint32_t timeout_ms)
+/*
+ * A capture takes the camera: the broadcaster stops grabbing, but viewers
+ * stay connected and are fed from the capture loop's preview tap until
+ * resume_stream().
+ */
+static void pause_stream_and_wait(uint32_t timeout_ms)
 {
-    s_stream_enabled = false;
-    s_stream_stop_requested = true;
-    if (s_stream_httpd != NULL && s_stream_fd >= 0) {
-        httpd_sess_trigger_close(s_stream_httpd, s_stream_fd);
-        s_stream_fd = -1;
+    s_stream_paused = true;
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
     }
     uint32_t waited_ms = 0;
     while (s_stream_in_progress && waited_ms < timeout_ms) {
@@ -199,6 +482,33 @@ static void stop_stream_and_wait(uint32_t timeout_ms)
     }
 }
 
+static void resume_stream(void)
+{
+    s_stream_paused = false;
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
+    }
+}
+
+/*
+ * Puts the camera back in its streaming mode after a capture, whichever way
+ * run_capture_sequence() left it: deinitialised, or in the capture's frame
+ * size and pixel format. The stream is only resumed once the camera is back.
+ */
+static void restore_stream_camera_and_resume(void)
+{
+    esp_camera_deinit();
+    gpio_uninstall_isr_service();
+    camera_power_cycle();
+    vTaskDelay(pdMS_TO_TICKS(200));
+    esp_err_t err = init_camera();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Restore camera init failed: %s", esp_err_to_name(err));
+        return;
+    }
+    resume_stream();
+}
+
 static void init_delay_ms(uint32_t ms)
 {
     vTaskDelay(pdMS_TO_TICKS(ms));
@@ -498,29 +808,32 @@ static esp_err_t home_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-static esp_err_t stream_start_handler(httpd_req_t *req)
+/* Shared by the HTTP start/stop endpoints and the /ws control messages. */
+static void stream_set_enabled(bool enabled)
 {
-    s_stream_enabled = true;
-    esp_err_t err = send_slave_stream_cmd("/api/stream/start");
+    s_stream_enabled = enabled;
+    if (!enabled) {
+        s_stream_stop_requested = true;
+    }
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
+    }
+    esp_err_t err = send_slave_stream_cmd(enabled ? "/api/stream/start" : "/api/stream/stop");
     if (err != ESP_OK) {
-        ESP_LOGW(TAG, "Slave stream start failed: %s", esp_err_to_name(err));
+        ESP_LOGW(TAG, "Slave stream %s failed: %s", enabled ? "start" : "stop", esp_err_to_name(err));
     }
+}
+
+static esp_err_t stream_start_handler(httpd_req_t *req)
+{
+    stream_set_enabled(true);
     httpd_resp_sendstr(req, "OK");
     return ESP_OK;
 }
 
 static esp_err_t stream_stop_handler(httpd_req_t *req)
 {
-    s_stream_enabled = false;
-    s_stream_stop_requested = true;
-    if (s_stream_httpd != NULL && s_stream_fd >= 0) {
-        httpd_sess_trigger_close(s_stream_httpd, s_stream_fd);
-        s_stream_fd = -1;
-    }
-    esp_err_t err = send_slave_stream_cmd("/api/stream/stop");
-    if (err != ESP_OK) {
-        ESP_LOGW(TAG, "Slave stream stop failed: %s", esp_err_to_name(err));
-    }
+    stream_set_enabled(false);
     httpd_resp_sendstr(req, "OK");
     return ESP_OK;
 }
@@ -529,350 +842,2081 @@ static esp_err_t status_handler(httpd_req_t *req)
 {
     int64_t uptime_ms = esp_timer_get_time() / 1000;
     uint32_t free_heap = esp_get_free_heap_size();
-    char response[320];
-    snprintf(response, sizeof(response),
-             "{\"stream_enabled\":%s,\"stream_active\":%s,\"uptime_ms\":%lld,\"free_heap\":%" PRIu32
-             ",\"slave_id\":\"%s\",\"master_id\":\"%s\"}",
-             s_stream_enabled ? "true" : "false",
-             s_stream_in_progress ? "true" : "false",
-             uptime_ms,
-             free_heap,
-             CONFIG_SLAVE_ID,
-             CONFIG_MASTER_ID);
+    char response[1024];
+    int used = snprintf(response, sizeof(response),
+                        "{\"stream_enabled\":%s,\"stream_active\":%s,\"stream_clients\":%d,"
+                        "\"uptime_ms\":%lld,\"free_heap\":%" PRIu32
+                        ",\"slave_id\":\"%s\",\"slave_count\":%d,\"master_id\":\"%s\"",
+                        s_stream_enabled ? "true" : "false",
+                        s_stream_in_progress ? "true" : "false",
+                        s_stream_client_count,
+                        uptime_ms,
+                        free_heap,
+                        CONFIG_SLAVE_ID,
+                        s_slave_count,
+                        CONFIG_MASTER_ID);
+    used += stream_clients_json(response + used, sizeof(response) - used - 1);
+    snprintf(response + used, sizeof(response) - used, "}");
     httpd_resp_set_type(req, "application/json");
     httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req)
+/*
+ * MJPEG fan-out: the broadcaster task grabs each frame once, copies it out of
+ * the driver buffer into a reference-counted PSRAM frame and publishes it as
+ * the latest frame. The sender task drives every /stream client's socket
+ * without blocking: each client has a cursor into the part it is sending and,
+ * once that part is out, jumps to whatever frame is newest, counting the ones
+ * it skipped. A slow viewer therefore only lowers its own frame rate and
+ * never holds a camera driver buffer. Clients are async copies of their
+ * requests (httpd_req_async_handler_begin), so the stream server's worker is
+ * free again as soon as a viewer subscribes.
+ */
+static void stream_frame_ref(stream_frame_t *frame)
 {
-    if (!s_stream_enabled) {
-        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream disabled");
-        return ESP_FAIL;
+    portENTER_CRITICAL(&s_frame_lock);
+    frame->refs++;
+    portEXIT_CRITICAL(&s_frame_lock);
+}
+
+static void stream_frame_unref(stream_frame_t *frame)
+{
+    if (!frame) {
+        return;
     }
-    if (s_stream_in_progress) {
-        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream already active");
-        return ESP_FAIL;
+    portENTER_CRITICAL(&s_frame_lock);
+    bool last = --frame->refs == 0;
+    portEXIT_CRITICAL(&s_frame_lock);
+    if (last) {
+        free(frame->buf);
+        free(frame);
     }
+}
 
-    s_stream_in_progress = true;
-    s_stream_fd = httpd_req_to_sockfd(req);
-    httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
-    char part_buf[128];
-
-    sensor_t *sensor = esp_camera_sensor_get();
-    if (sensor) {
-        sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+/* Returns a reference to the latest published frame, or NULL. */
+static stream_frame_t *stream_frame_latest(void)
+{
+    portENTER_CRITICAL(&s_frame_lock);
+    stream_frame_t *frame = s_latest_frame;
+    if (frame) {
+        frame->refs++;
     }
+    portEXIT_CRITICAL(&s_frame_lock);
+    return frame;
+}
 
-    while (s_stream_enabled) {
-        if (s_stream_stop_requested) {
-            break;
-        }
-        camera_fb_t *fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGW(TAG, "Camera capture failed");
-            continue;
-        }
-
-        int header_len = snprintf(part_buf, sizeof(part_buf),
-                                  "--" STREAM_BOUNDARY "\r\n"
-                                  "Content-Type: image/jpeg\r\n"
-                                  "Content-Length: %u\r\n\r\n",
-                                  fb->len);
-        if (httpd_resp_send_chunk(req, part_buf, header_len) != ESP_OK ||
-            httpd_resp_send_chunk(req, (const char *)fb->buf, fb->len) != ESP_OK ||
-            httpd_resp_send_chunk(req, "\r\n", 2) != ESP_OK) {
-            esp_camera_fb_return(fb);
-            break;
-        }
-
-        esp_camera_fb_return(fb);
-        vTaskDelay(pdMS_TO_TICKS(20));
+static stream_frame_t *stream_frame_from_fb(const camera_fb_t *fb)
+{
+    stream_frame_t *frame = calloc(1, sizeof(*frame));
+    if (!frame) {
+        return NULL;
     }
-
-    s_stream_in_progress = false;
-    s_stream_stop_requested = false;
-    if (s_stream_fd == httpd_req_to_sockfd(req)) {
-        s_stream_fd = -1;
+    frame->buf = heap_caps_malloc(fb->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!frame->buf) {
+        free(frame);
+        return NULL;
     }
-    httpd_resp_sendstr_chunk(req, NULL);
-    return ESP_OK;
+    memcpy(frame->buf, fb->buf, fb->len);
+    frame->len = fb->len;
+    frame->timestamp_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->format = fb->format;
+    frame->refs = 1;
+    return frame;
 }
 
-static esp_err_t sensor_handler(httpd_req_t *req)
+/* Makes frame the latest one; takes over the caller's reference. */
+static void stream_frame_publish(stream_frame_t *frame)
 {
-    char content[512] = {0};
-    if (read_body(req, content, sizeof(content)) != ESP_OK) {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid body");
-        return ESP_FAIL;
+    portENTER_CRITICAL(&s_frame_lock);
+    frame->seq = ++s_frame_seq;
+    stream_frame_t *old = s_latest_frame;
+    s_latest_frame = frame;
+    portEXIT_CRITICAL(&s_frame_lock);
+    stream_frame_unref(old);
+    if (s_stream_sender_task) {
+        xTaskNotifyGive(s_stream_sender_task);
     }
+}
 
-    sensor_t *sensor = esp_camera_sensor_get();
-    if (!sensor) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor not ready");
-        return ESP_FAIL;
-    }
+static void stream_client_release(stream_client_t *client)
+{
+    stream_frame_unref(client->frame);
+    ESP_LOGI(TAG, "Stream client %d left: %" PRIu32 " frames sent, %" PRIu32 " skipped, %" PRIu32
+             " send calls", client->fd, client->frames_sent, client->frames_skipped, client->send_calls);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+    s_stream_client_count--;
+}
 
-    char type_buf[64] = {0};
-    const char *content_type = type_buf;
-    if (httpd_req_get_hdr_value_len(req, "Content-Type") > 0) {
-        if (httpd_req_get_hdr_value_str(req, "Content-Type", type_buf, sizeof(type_buf)) == ESP_OK) {
-            content_type = type_buf;
-        }
+static void stream_client_drop(stream_client_t *client)
+{
+    if (client->req) {
+        httpd_req_async_handler_complete(client->req);
+    }
+    if (s_stream_httpd) {
+        httpd_sess_trigger_close(s_stream_httpd, client->fd);
     }
+    stream_client_release(client);
+}
 
-    if (strstr(content_type, "application/json") != NULL) {
-        apply_sensor_settings_from_json(sensor, content);
+/* Unmasked binary WebSocket frame header plus stream_ws_header_t. */
+static size_t stream_ws_head(char *head, const stream_frame_t *frame)
+{
+    stream_ws_header_t meta = {
+        .version = STREAM_WS_HEADER_VERSION,
+        .format = frame->format,
+        .header_len = sizeof(meta),
+        .seq = frame->seq,
+        .timestamp_us = frame->timestamp_us,
+        .width = frame->width,
+        .height = frame->height,
+        .size = frame->len,
+    };
+    uint64_t payload = sizeof(meta) + frame->len;
+    uint8_t *p = (uint8_t *)head;
+    size_t len = 0;
+    p[len++] = 0x82;        /* FIN, binary */
+    if (payload < 126) {
+        p[len++] = (uint8_t)payload;
+    } else if (payload <= 0xFFFF) {
+        p[len++] = 126;
+        p[len++] = (uint8_t)(payload >> 8);
+        p[len++] = (uint8_t)payload;
     } else {
-        char *saveptr;
-        char *pair = strtok_r(content, "&", &saveptr);
-        while (pair) {
-            char *eq = strchr(pair, '=');
-            if (eq) {
-                *eq = '\0';
-                const char *key = pair;
-                const char *value = eq + 1;
-                if (strcmp(key, "framesize") == 0) {
-                    framesize_t fs = parse_framesize(value);
-                    apply_sensor_setting(sensor, "framesize", fs);
-                } else if (strcmp(key, "pixel_format") == 0) {
-                    sensor->set_pixformat(sensor, parse_pixformat(value));
-                } else {
-                    apply_sensor_setting(sensor, key, atoi(value));
-                }
-            }
-            pair = strtok_r(NULL, "&", &saveptr);
+        p[len++] = 127;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            p[len++] = (uint8_t)(payload >> shift);
         }
     }
-
-    httpd_resp_sendstr(req, "OK");
-    return ESP_OK;
+    memcpy(p + len, &meta, sizeof(meta));
+    return len + sizeof(meta);
 }
 
-typedef struct {
-    int sock;
-    struct sockaddr_storage addr;
-    socklen_t addrlen;
-} udp_slave_ctx_t;
+static void stream_client_part_head(stream_client_t *client, const stream_frame_t *frame)
+{
+    char part[96];
+    int part_len = snprintf(part, sizeof(part),
+                            "--" STREAM_BOUNDARY "\r\n"
+                            "Content-Type: image/jpeg\r\n"
+                            "Content-Length: %u\r\n\r\n",
+                            (unsigned)frame->len);
+    int len = 0;
+    if (!client->headers_sent) {
+        len = snprintf(client->head, sizeof(client->head),
+                       "HTTP/1.1 200 OK\r\nContent-Type: " STREAM_CONTENT_TYPE "\r\n"
+                       "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+        client->headers_sent = true;
+    }
+    memcpy(client->head + len, part, part_len);
+    client->head_len = len + part_len;
+}
 
-static bool parse_int64_payload(const char *buf, int64_t *out_value)
+/*
+ * Lays out the next part: on the first one the HTTP response header, then
+ * the multipart header. The JPEG and the trailing CRLF are sent straight from
+ * the frame and STREAM_PART_TAIL. The body is not chunk-encoded; it ends when
+ * the connection closes, which is how a multipart stream ends anyway. A /ws
+ * viewer gets a WebSocket frame header and no tail instead.
+ */
+static void stream_client_start(stream_client_t *client, stream_frame_t *frame)
 {
-    if (!buf || !out_value) {
-        return false;
+    if (client->ws) {
+        client->head_len = stream_ws_head(client->head, frame);
+    } else {
+        stream_client_part_head(client, frame);
     }
-    char *end = NULL;
-    errno = 0;
-    int64_t value = strtoll(buf, &end, 10);
-    if (errno != 0 || end == buf) {
-        return false;
+    client->cursor = 0;
+    if (client->last_seq && frame->seq > client->last_seq + 1) {
+        client->frames_skipped += frame->seq - client->last_seq - 1;
     }
-    *out_value = value;
-    return true;
+    client->last_seq = frame->seq;
+    stream_frame_ref(frame);
+    client->frame = frame;
 }
 
-static esp_err_t udp_open_slave_socket(udp_slave_ctx_t *ctx, int timeout_ms)
+/* Smoothed frames per second (x10) from the interval since the previous frame. */
+static uint32_t stream_fps_update(uint32_t fps_x10, int64_t *last_us, int64_t now_us)
 {
-    if (!ctx) {
-        return ESP_ERR_INVALID_ARG;
+    int64_t interval_us = now_us - *last_us;
+    bool first = *last_us == 0;
+    *last_us = now_us;
+    if (first || interval_us <= 0) {
+        return fps_x10;
     }
-    memset(ctx, 0, sizeof(*ctx));
-    ctx->sock = -1;
-
-    char host[64];
-    snprintf(host, sizeof(host), "slavecam-%s.local", CONFIG_SLAVE_ID);
-    char port[8];
-    snprintf(port, sizeof(port), "%d", CONFIG_CAPSEQ_SYNC_UDP_PORT);
+    uint32_t inst_x10 = (uint32_t)(10000000LL / interval_us);
+    return fps_x10 ? (fps_x10 * 7 + inst_x10) / 8 : inst_x10;
+}
 
-    struct addrinfo hints = {
-        .ai_family = AF_INET,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct addrinfo *res = NULL;
-    int err = getaddrinfo(host, port, &hints, &res);
-    if (err != 0 || !res) {
-        ESP_LOGW(TAG, "UDP resolve failed for %s:%s (%d)", host, port, err);
-        return ESP_FAIL;
+/*
+ * Sends as much of the current part as the socket takes without blocking.
+ * Header, JPEG and CRLF go out as one scatter/gather sendmsg() from the
+ * cursor on, so a frame normally costs a single lwIP write.
+ */
+static esp_err_t stream_client_pump(stream_client_t *client, int64_t now_us)
+{
+    static const char tail[] = STREAM_PART_TAIL;
+    const uint8_t *seg[3] = {(const uint8_t *)client->head, client->frame->buf, (const uint8_t *)tail};
+    size_t seg_len[3] = {client->head_len, client->frame->len, client->ws ? 0 : sizeof(tail) - 1};
+    size_t total = seg_len[0] + seg_len[1] + seg_len[2];
+    while (client->cursor < total) {
+        struct iovec iov[3];
+        int iov_count = 0;
+        size_t skip = client->cursor;
+        for (int i = 0; i < 3; ++i) {
+            if (skip >= seg_len[i]) {
+                skip -= seg_len[i];
+                continue;
+            }
+            iov[iov_count].iov_base = (void *)(seg[i] + skip);
+            iov[iov_count].iov_len = seg_len[i] - skip;
+            iov_count++;
+            skip = 0;
+        }
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iov_count,
+        };
+        ssize_t sent = sendmsg(client->fd, &msg, MSG_DONTWAIT);
+        client->send_calls++;
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+        }
+        client->cursor += sent;
+        client->bytes_sent += sent;
+        client->last_progress_us = now_us;
     }
+    client->frames_sent++;
+    client->fps_x10 = stream_fps_update(client->fps_x10, &client->last_done_us, now_us);
+    stream_frame_unref(client->frame);
+    client->frame = NULL;
+    return ESP_OK;
+}
 
-    ctx->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (ctx->sock < 0) {
-        ESP_LOGW(TAG, "UDP socket create failed (%d)", errno);
-        freeaddrinfo(res);
-        return ESP_FAIL;
+/* Sends the queued PONG without blocking; it stays queued until all of it is out. */
+static esp_err_t stream_client_pong(stream_client_t *client)
+{
+    while (client->pong_sent < client->pong_len) {
+        ssize_t sent = send(client->fd, client->pong + client->pong_sent,
+                            client->pong_len - client->pong_sent, MSG_DONTWAIT);
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+        }
+        client->pong_sent += sent;
     }
-
-    memcpy(&ctx->addr, res->ai_addr, res->ai_addrlen);
-    ctx->addrlen = res->ai_addrlen;
-    freeaddrinfo(res);
-
-    struct timeval tv = {
-        .tv_sec = timeout_ms / 1000,
-        .tv_usec = (timeout_ms % 1000) * 1000,
-    };
-    setsockopt(ctx->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(ctx->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    client->pong_len = 0;
+    client->pong_sent = 0;
     return ESP_OK;
 }
 
-static void udp_close_slave_socket(udp_slave_ctx_t *ctx)
+/* Ticks covering us, rounded up and at least one, so a short wait still
+ * blocks instead of returning at once and spinning until the deadline. */
+static TickType_t stream_wait_ticks(int64_t us)
 {
-    if (ctx && ctx->sock >= 0) {
-        close(ctx->sock);
-        ctx->sock = -1;
+    const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+    return (TickType_t)MAX((us + tick_us - 1) / tick_us, 1);
+}
+
+static void stream_sender_task(void *arg)
+{
+    (void)arg;
+    while (true) {
+        stream_frame_t *latest = stream_frame_latest();
+        int64_t now_us = esp_timer_get_time();
+        int64_t wake_us = now_us + 100 * 1000;
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        int max_fd = -1;
+
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        bool stop = !s_stream_enabled || s_stream_stop_requested;
+        for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            stream_client_t *client = &s_stream_clients[i];
+            if (client->fd < 0) {
+                continue;
+            }
+            if (stop && !client->ws) {
+                stream_client_drop(client);
+                continue;
+            }
+            /* A PONG goes out between two parts, never inside one. */
+            if (!client->frame && client->pong_len) {
+                if (stream_client_pong(client) != ESP_OK) {
+                    stream_client_drop(client);
+                    continue;
+                }
+                if (client->pong_len) {
+                    FD_SET(client->fd, &wfds);
+                    max_fd = MAX(max_fd, client->fd);
+                    continue;
+                }
+            }
+            if (!client->frame && latest && latest->seq != client->last_seq) {
+                if (now_us >= client->next_due_us) {
+                    stream_client_start(client, latest);
+                    /* Deadline pacing: the next part is due one period after
+                     * this one was, so send time does not stretch the period;
+                     * when already behind, restart from now and let the
+                     * frames in between go instead of bunching them up. */
+                    client->next_due_us = MAX(client->next_due_us + client->period_us, now_us);
+                } else {
+                    wake_us = MIN(wake_us, client->next_due_us);
+                }
+            }
+            if (client->frame && stream_client_pump(client, now_us) != ESP_OK) {
+                stream_client_drop(client);
+                continue;
+            }
+            if (client->frame) {
+                if (now_us - client->last_progress_us > (int64_t)STREAM_CLIENT_STALL_MS * 1000) {
+                    ESP_LOGW(TAG, "Stream client %d stalled", client->fd);
+                    stream_client_drop(client);
+                    continue;
+                }
+                FD_SET(client->fd, &wfds);
+                max_fd = MAX(max_fd, client->fd);
+            }
+        }
+        if (stop) {
+            s_stream_stop_requested = false;
+        }
+        xSemaphoreGive(s_stream_lock);
+        stream_frame_unref(latest);
+
+        if (max_fd >= 0) {
+            /* Some client is mid-part: come back when a socket drains. New
+             * frames for idle clients wait at most one select timeout. */
+            struct timeval tv = {.tv_sec = 0, .tv_usec = STREAM_SELECT_TIMEOUT_MS * 1000};
+            select(max_fd + 1, NULL, &wfds, NULL, &tv);
+        } else {
+            ulTaskNotifyTake(pdTRUE, stream_wait_ticks(wake_us - now_us));
+        }
     }
 }
 
-static esp_err_t udp_send_and_recv(udp_slave_ctx_t *ctx, const char *payload, int payload_len,
-                                   char *rx_buf, size_t rx_len, int *out_rx_len)
+/*
+ * Preview tap: while a capture owns the camera the broadcaster is paused, and
+ * the capture loop offers every STREAM_PREVIEW_EVERY_N-th frame it already
+ * grabbed. A JPEG frame is copied as is; other formats are decimated to at
+ * most STREAM_PREVIEW_MAX_WIDTH x STREAM_PREVIEW_MAX_HEIGHT and encoded to
+ * JPEG by the broadcaster, off the capture task. Only one preview is in
+ * flight at a time; an offer made while one is pending is dropped, so the
+ * capture loop pays at most one bounded copy per N frames.
+ */
+static bool stream_preview_decimate(const camera_fb_t *fb)
 {
-    if (!ctx || ctx->sock < 0 || !payload || payload_len <= 0 || !rx_buf || rx_len == 0) {
-        return ESP_ERR_INVALID_ARG;
+    size_t bpp;
+    if (fb->format == PIXFORMAT_GRAYSCALE) {
+        bpp = 1;
+    } else if (fb->format == PIXFORMAT_RGB565 || fb->format == PIXFORMAT_YUV422) {
+        bpp = 2;
+    } else {
+        return false;
     }
-    int sent = sendto(ctx->sock, payload, payload_len, 0,
-                      (struct sockaddr *)&ctx->addr, ctx->addrlen);
-    if (sent < 0) {
-        return ESP_FAIL;
+    if (!s_preview.raw) {
+        s_preview.raw = heap_caps_malloc(STREAM_PREVIEW_MAX_WIDTH * STREAM_PREVIEW_MAX_HEIGHT * 2,
+                                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!s_preview.raw) {
+            return false;
+        }
     }
-    struct sockaddr_storage from;
-    socklen_t from_len = sizeof(from);
-    int received = recvfrom(ctx->sock, rx_buf, rx_len - 1, 0,
-                            (struct sockaddr *)&from, &from_len);
-    if (received < 0) {
-        return ESP_ERR_TIMEOUT;
+    int step = MAX((fb->width + STREAM_PREVIEW_MAX_WIDTH - 1) / STREAM_PREVIEW_MAX_WIDTH,
+                   (fb->height + STREAM_PREVIEW_MAX_HEIGHT - 1) / STREAM_PREVIEW_MAX_HEIGHT);
+    bool yuv = fb->format == PIXFORMAT_YUV422;
+    if (yuv && step > 1) {
+        step = (step + 1) & ~1;     /* keep Y0 U Y1 V macropixels intact */
     }
-    rx_buf[received] = '\0';
-    if (out_rx_len) {
-        *out_rx_len = received;
+    int width = fb->width / step;
+    int height = fb->height / step;
+    if (yuv) {
+        width &= ~1;
     }
-    return ESP_OK;
+    uint8_t *dst = s_preview.raw;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = fb->buf + (size_t)y * step * fb->width * bpp;
+        if (yuv) {
+            for (int x = 0; x < width; x += 2, dst += 4) {
+                memcpy(dst, row + (size_t)x * step * 2, 4);
+            }
+        } else {
+            for (int x = 0; x < width; ++x, dst += bpp) {
+                memcpy(dst, row + (size_t)x * step * bpp, bpp);
+            }
+        }
+    }
+    s_preview.width = width;
+    s_preview.height = height;
+    s_preview.format = fb->format;
+    s_preview.raw_len = dst - s_preview.raw;
+    return true;
 }
 
-static esp_err_t udp_slave_ready_check(void)
+static void stream_preview_offer(const camera_fb_t *fb, int index)
 {
-    udp_slave_ctx_t ctx;
-    if (udp_open_slave_socket(&ctx, 300) != ESP_OK) {
-        return ESP_FAIL;
+    if (CONFIG_STREAM_PREVIEW_EVERY_N <= 0 || index % CONFIG_STREAM_PREVIEW_EVERY_N != 0 ||
+        !s_stream_enabled || s_stream_client_count == 0 || s_preview.pending) {
+        return;
     }
-
-    char rx_buf[64];
-    esp_err_t err = udp_send_and_recv(&ctx, "READY", 5, rx_buf, sizeof(rx_buf), NULL);
-    udp_close_slave_socket(&ctx);
-    if (err != ESP_OK) {
-        return err;
+    bool ready;
+    if (fb->format == PIXFORMAT_JPEG) {
+        s_preview.jpeg = stream_frame_from_fb(fb);
+        ready = s_preview.jpeg != NULL;
+    } else {
+        ready = stream_preview_decimate(fb);
     }
-    if (strncmp(rx_buf, "OK", 2) == 0) {
-        return ESP_OK;
+    if (ready) {
+        s_preview.timestamp_us = capseq_fb_time_us(fb);
+        s_preview.pending = true;
+        xTaskNotifyGive(s_stream_task);
     }
-    return ESP_FAIL;
 }
 
-static esp_err_t udp_slave_wait_ready(int timeout_ms, int poll_ms)
+/* Broadcaster side: publishes a pending preview, encoding it if needed. */
+static void stream_preview_publish(void)
 {
-    int elapsed = 0;
-    while (elapsed <= timeout_ms) {
-        esp_err_t err = udp_slave_ready_check();
-        if (err == ESP_OK) {
-            return ESP_OK;
+    if (!s_preview.pending) {
+        return;
+    }
+    stream_frame_t *frame = s_preview.jpeg;
+    s_preview.jpeg = NULL;
+    if (!frame) {
+        uint8_t *jpg = NULL;
+        size_t jpg_len = 0;
+        frame = calloc(1, sizeof(*frame));
+        if (frame && fmt2jpg(s_preview.raw, s_preview.raw_len, s_preview.width, s_preview.height,
+                             s_preview.format, STREAM_PREVIEW_QUALITY, &jpg, &jpg_len)) {
+            frame->buf = jpg;
+            frame->len = jpg_len;
+            frame->width = s_preview.width;
+            frame->height = s_preview.height;
+            frame->format = PIXFORMAT_JPEG;
+            frame->refs = 1;
+        } else {
+            free(jpg);
+            free(frame);
+            frame = NULL;
         }
-        vTaskDelay(pdMS_TO_TICKS(poll_ms));
-        elapsed += poll_ms;
     }
-    return ESP_ERR_TIMEOUT;
+    if (frame) {
+        frame->timestamp_us = s_preview.timestamp_us;
+    }
+    s_preview.pending = false;
+    if (frame) {
+        stream_frame_publish(frame);
+    }
 }
 
-static esp_err_t udp_sync_metrics(capseq_sync_metrics_t *metrics)
+/* Grab period for the fastest subscribed client; 0 means as fast as possible. */
+static int64_t stream_grab_period_us(void)
 {
-    if (!metrics) {
-        return ESP_ERR_INVALID_ARG;
-    }
-    metrics->trip_time_us = 0;
-    metrics->cpu_disparity_us = 0;
-
-    udp_slave_ctx_t ctx;
-    if (udp_open_slave_socket(&ctx, 300) != ESP_OK) {
-        return ESP_FAIL;
+    int64_t period_us = -1;
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        const stream_client_t *client = &s_stream_clients[i];
+        if (client->fd >= 0 && (period_us < 0 || client->period_us < period_us)) {
+            period_us = client->period_us;
+        }
     }
+    xSemaphoreGive(s_stream_lock);
+    return MAX(period_us, 0);
+}
 
-    int64_t rtt_sum = 0;
-    int64_t disparity_sum = 0;
-    int samples = 0;
-
-    for (int i = 0; i < CONFIG_CAPSEQ_SYNC_UDP_PINGS; ++i) {
-        int64_t send_time = esp_timer_get_time();
-        char payload[32];
-        int payload_len = snprintf(payload, sizeof(payload), "%lld", (long long)send_time);
-        char rx_buf[64];
-        esp_err_t err = udp_send_and_recv(&ctx, payload, payload_len, rx_buf, sizeof(rx_buf), NULL);
-        int64_t recv_time = esp_timer_get_time();
+static void stream_broadcast_task(void *arg)
+{
+    (void)arg;
+    int64_t next_grab_us = 0;
+    int64_t last_grab_us = 0;
+    while (true) {
+        if (!s_stream_enabled || s_stream_stop_requested || s_stream_paused ||
+            (s_stream_client_count == 0 && !s_snapshot_wanted)) {
+            s_stream_in_progress = false;
+            stream_preview_publish();
+            s_stream_fps_x10 = 0;
+            last_grab_us = 0;
+            next_grab_us = 0;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+            continue;
+        }
+        /* Sleep only for what is left of the period after the previous grab
+         * and publish; a late grab is not made up with a burst. */
+        int64_t period_us = stream_grab_period_us();
+        int64_t now_us = esp_timer_get_time();
+        if (next_grab_us == 0) {
+            next_grab_us = now_us;
+        }
+        if (period_us > 0 && next_grab_us > now_us) {
+            vTaskDelay(stream_wait_ticks(next_grab_us - now_us));
+        }
+        if (!s_stream_in_progress) {
+            sensor_t *sensor = esp_camera_sensor_get();
+            if (sensor) {
+                sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+            }
+            s_stream_in_progress = true;
+        }
+
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGW(TAG, "Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+        stream_frame_t *frame = stream_frame_from_fb(fb);
+        esp_camera_fb_return(fb);
+        if (!frame) {
+            ESP_LOGW(TAG, "Stream frame alloc failed");
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+        stream_frame_publish(frame);
+        s_snapshot_wanted = false;
+        now_us = esp_timer_get_time();
+        s_stream_fps_x10 = stream_fps_update(s_stream_fps_x10, &last_grab_us, now_us);
+        next_grab_us = MAX(next_grab_us + period_us, now_us);
+    }
+}
+
+/* ?fps=N from the request, clamped; STREAM_DEFAULT_FPS without it. */
+static int stream_query_fps(httpd_req_t *req)
+{
+    int fps = CONFIG_STREAM_DEFAULT_FPS;
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) {
+        fps = atoi(value);
+    }
+    return clamp_int(fps, 0, STREAM_MAX_FPS);
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    if (!s_stream_enabled) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream disabled");
+        return ESP_FAIL;
+    }
+    int fps = stream_query_fps(req);
+
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    stream_client_t *client = NULL;
+    for (int i = 0; i < STREAM_MAX_CLIENTS && !client; ++i) {
+        if (s_stream_clients[i].fd < 0) {
+            client = &s_stream_clients[i];
+        }
+    }
+    httpd_req_t *async_req = NULL;
+    if (client && httpd_req_async_handler_begin(req, &async_req) == ESP_OK) {
+        memset(client, 0, sizeof(*client));
+        client->req = async_req;
+        client->fd = httpd_req_to_sockfd(req);
+        client->last_progress_us = esp_timer_get_time();
+        client->period_us = fps ? 1000000 / fps : 0;
+        s_stream_client_count++;
+    }
+    xSemaphoreGive(s_stream_lock);
+    if (!async_req) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "too many stream clients");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Stream client %d joined (fps %d)", client->fd, fps);
+    xTaskNotifyGive(s_stream_task);
+    xTaskNotifyGive(s_stream_sender_task);
+    return ESP_OK;
+}
+
+/*
+ * Answers a PING from the httpd task. The sender task writes the PONG, since
+ * it owns the socket while the client streams. A PING that arrives while an
+ * earlier PONG is half sent goes unanswered; the next one is.
+ */
+static void stream_ws_queue_pong(int fd, const uint8_t *payload, size_t len)
+{
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        stream_client_t *client = &s_stream_clients[i];
+        if (client->ws && client->fd == fd && client->pong_sent == 0) {
+            client->pong[0] = 0x8A;     /* FIN, pong */
+            client->pong[1] = (uint8_t)len;
+            memcpy(client->pong + 2, payload, len);
+            client->pong_len = 2 + len;
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+    xTaskNotifyGive(s_stream_sender_task);
+}
+
+/*
+ * GET /ws (port 81): the same frames as /stream, one binary WebSocket message
+ * each (stream_ws_header_t + JPEG), written by the sender task like any
+ * other viewer. Text messages control the stream: "start", "stop" and
+ * "fps=N" for this socket. A /ws viewer survives a stream stop so it can
+ * start it again. Control frames are handled here too: PINGs get a PONG.
+ */
+static esp_err_t stream_ws_handler(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    if (req->method == HTTP_GET) {
+        int fps = stream_query_fps(req);
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        stream_client_t *client = NULL;
+        for (int i = 0; i < STREAM_MAX_CLIENTS && !client; ++i) {
+            if (s_stream_clients[i].fd < 0) {
+                client = &s_stream_clients[i];
+            }
+        }
+        if (client) {
+            memset(client, 0, sizeof(*client));
+            client->fd = fd;
+            client->ws = true;
+            client->last_progress_us = esp_timer_get_time();
+            client->period_us = fps ? 1000000 / fps : 0;
+            s_stream_client_count++;
+        }
+        xSemaphoreGive(s_stream_lock);
+        if (!client) {
+            ESP_LOGW(TAG, "WebSocket client %d refused: too many stream clients", fd);
+            return ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "WebSocket client %d joined (fps %d)", fd, fps);
+        xTaskNotifyGive(s_stream_task);
+        xTaskNotifyGive(s_stream_sender_task);
+        return ESP_OK;
+    }
+
+    char text[STREAM_WS_CONTROL_MAX + 1];
+    httpd_ws_frame_t pkt = {0};
+    if (httpd_ws_recv_frame(req, &pkt, 0) != ESP_OK || pkt.len >= sizeof(text)) {
+        return ESP_FAIL;
+    }
+    pkt.payload = (uint8_t *)text;
+    if (pkt.len && httpd_ws_recv_frame(req, &pkt, sizeof(text) - 1) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    text[pkt.len] = '\0';
+
+    if (pkt.type == HTTPD_WS_TYPE_CLOSE) {
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            if (s_stream_clients[i].ws && s_stream_clients[i].fd == fd) {
+                stream_client_drop(&s_stream_clients[i]);
+            }
+        }
+        xSemaphoreGive(s_stream_lock);
+    } else if (pkt.type == HTTPD_WS_TYPE_PING) {
+        stream_ws_queue_pong(fd, (const uint8_t *)text, pkt.len);
+    } else if (pkt.type == HTTPD_WS_TYPE_TEXT) {
+        if (strcmp(text, "start") == 0) {
+            stream_set_enabled(true);
+        } else if (strcmp(text, "stop") == 0) {
+            stream_set_enabled(false);
+        } else if (strncmp(text, "fps=", 4) == 0) {
+            int fps = clamp_int(atoi(text + 4), 0, STREAM_MAX_FPS);
+            xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+            for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+                if (s_stream_clients[i].ws && s_stream_clients[i].fd == fd) {
+                    s_stream_clients[i].period_us = fps ? 1000000 / fps : 0;
+                    s_stream_clients[i].next_due_us = 0;
+                }
+            }
+            xSemaphoreGive(s_stream_lock);
+            xTaskNotifyGive(s_stream_sender_task);
+        } else {
+            ESP_LOGW(TAG, "WebSocket client %d: unknown command '%s'", fd, text);
+        }
+    }
+    return ESP_OK;
+}
+
+/*
+ * Stream server close_fn. A /ws viewer holds no request, so httpd may close
+ * its socket at any time; forget it before the fd can be handed out again.
+ */
+static void stream_sess_close(httpd_handle_t hd, int sockfd)
+{
+    (void)hd;
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        if (s_stream_clients[i].ws && s_stream_clients[i].fd == sockfd) {
+            stream_client_release(&s_stream_clients[i]);
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+    close(sockfd);
+}
+
+/* Appends the broadcaster rate and ,"stream_viewers":[...] with each client's counters. */
+static int stream_clients_json(char *buf, size_t len)
+{
+    uint32_t fps_x10 = s_stream_fps_x10;
+    int used = snprintf(buf, len, ",\"stream_fps\":%" PRIu32 ".%" PRIu32 ",\"stream_viewers\":[",
+                        fps_x10 / 10, fps_x10 % 10);
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    bool first = true;
+    for (int i = 0; i < STREAM_MAX_CLIENTS && used < (int)len; ++i) {
+        const stream_client_t *client = &s_stream_clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        used += snprintf(buf + used, len - used,
+                         "%s{\"fd\":%d,\"transport\":\"%s\",\"target_fps\":%" PRIu32 ",\"fps\":%" PRIu32 ".%" PRIu32
+                         ",\"frames_sent\":%" PRIu32 ",\"frames_skipped\":%" PRIu32
+                         ",\"send_calls\":%" PRIu32 ",\"bytes_sent\":%llu}",
+                         first ? "" : ",", client->fd, client->ws ? "ws" : "mjpeg",
+                         client->period_us ? 1000000 / client->period_us : 0,
+                         client->fps_x10 / 10, client->fps_x10 % 10,
+                         client->frames_sent, client->frames_skipped,
+                         client->send_calls, (unsigned long long)client->bytes_sent);
+        first = false;
+    }
+    xSemaphoreGive(s_stream_lock);
+    if (used < (int)len) {
+        used += snprintf(buf + used, len - used, "]");
+    }
+    return MIN(used, (int)len - 1);
+}
+
+/*
+ * GET /snapshot.jpg: the newest frame the broadcaster (or the capture preview
+ * tap) already published, tagged with its sequence number. A frame older
+ * than SNAPSHOT_MAX_AGE_MS is refreshed with one broadcaster grab when the
+ * stream is enabled and the camera is not busy capturing; otherwise the
+ * cached frame is served as is.
+ */
+static bool snapshot_etag_matches(httpd_req_t *req, uint32_t seq)
+{
+    char value[32];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK) {
+        return false;
+    }
+    if (strcmp(value, "*") == 0) {
+        return true;
+    }
+    const char *p = value;
+    if (strncmp(p, "W/", 2) == 0) {
+        p += 2;
+    }
+    if (*p == '"') {
+        p++;
+    }
+    char *end = NULL;
+    unsigned long tag = strtoul(p, &end, 10);
+    return end != p && (*end == '"' || *end == '\0') && tag == seq;
+}
+
+static esp_err_t snapshot_handler(httpd_req_t *req)
+{
+    stream_frame_t *frame = stream_frame_latest();
+    bool stale = !frame || esp_timer_get_time() - frame->timestamp_us > SNAPSHOT_MAX_AGE_MS * 1000LL;
+    if (stale && s_stream_enabled && !s_stream_paused && s_stream_task) {
+        uint32_t seq = frame ? frame->seq : s_frame_seq;
+        s_snapshot_wanted = true;
+        xTaskNotifyGive(s_stream_task);
+        for (int waited_ms = 0; waited_ms < SNAPSHOT_WAIT_MS && s_frame_seq == seq; waited_ms += 10) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        if (s_frame_seq != seq) {
+            stream_frame_unref(frame);
+            frame = stream_frame_latest();
+        }
+    }
+    if (!frame) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT,
+                            s_stream_enabled ? "no frame yet" : "stream disabled");
+        return ESP_FAIL;
+    }
+
+    char etag[16];
+    char stamp[24];
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)frame->seq);
+    snprintf(stamp, sizeof(stamp), "%lld", (long long)frame->timestamp_us);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "X-Timestamp-Us", stamp);
+    esp_err_t err;
+    if (snapshot_etag_matches(req, frame->seq)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        err = httpd_resp_send(req, NULL, 0);
+    } else {
+        httpd_resp_set_type(req, "image/jpeg");
+        err = httpd_resp_send(req, (const char *)frame->buf, frame->len);
+    }
+    stream_frame_unref(frame);
+    return err;
+}
+
+static esp_err_t init_stream_broadcaster(void)
+{
+    s_stream_lock = xSemaphoreCreateMutex();
+    if (!s_stream_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        s_stream_clients[i].fd = -1;
+    }
+    if (xTaskCreatePinnedToCore(stream_sender_task, "stream_send", STREAM_TASK_STACK_SIZE, NULL,
+                                STREAM_TASK_PRIORITY, &s_stream_sender_task, NET_TASK_CORE) != pdPASS ||
+        xTaskCreatePinnedToCore(stream_broadcast_task, "stream_bcast", STREAM_TASK_STACK_SIZE, NULL,
+                                STREAM_TASK_PRIORITY, &s_stream_task, NET_TASK_CORE) != pdPASS) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sensor_handler(httpd_req_t *req)
+{
+    char content[512] = {0};
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid body");
+        return ESP_FAIL;
+    }
+
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (!sensor) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor not ready");
+        return ESP_FAIL;
+    }
+
+    char type_buf[64] = {0};
+    const char *content_type = type_buf;
+    if (httpd_req_get_hdr_value_len(req, "Content-Type") > 0) {
+        if (httpd_req_get_hdr_value_str(req, "Content-Type", type_buf, sizeof(type_buf)) == ESP_OK) {
+            content_type = type_buf;
+        }
+    }
+
+    if (strstr(content_type, "application/json") != NULL) {
+        apply_sensor_settings_from_json(sensor, content);
+    } else {
+        char *saveptr;
+        char *pair = strtok_r(content, "&", &saveptr);
+        while (pair) {
+            char *eq = strchr(pair, '=');
+            if (eq) {
+                *eq = '\0';
+                const char *key = pair;
+                const char *value = eq + 1;
+                if (strcmp(key, "framesize") == 0) {
+                    framesize_t fs = parse_framesize(value);
+                    apply_sensor_setting(sensor, "framesize", fs);
+                } else if (strcmp(key, "pixel_format") == 0) {
+                    sensor->set_pixformat(sensor, parse_pixformat(value));
+                } else {
+                    apply_sensor_setting(sensor, key, atoi(value));
+                }
+            }
+            pair = strtok_r(NULL, "&", &saveptr);
+        }
+    }
+
+    httpd_resp_sendstr(req, "OK");
+    return ESP_OK;
+}
+
+/*
+ * Session transfer: GET /api/session/<session> lists the files that belong
+ * to a capture session, one "<name> <size>" line each, and
+ * GET /api/session/<session>/<name> returns one of them. The file endpoint
+ * honours ?offset=N or "Range: bytes=N-" so an interrupted transfer resumes
+ * where the local copy ends.
+ */
+static bool capseq_safe_name(const char *name)
+{
+    if (!name || !name[0] || strstr(name, "..")) {
+        return false;
+    }
+    return strpbrk(name, "/\\") == NULL;
+}
+
+/* PSRAM when available: SD/eMMC and TCP both want large sequential blocks. */
+static uint8_t *alloc_io_buffer(size_t *size)
+{
+    uint8_t *buf = heap_caps_malloc(*size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buf) {
+        *size = FILE_SEND_BUF_MIN;
+        buf = malloc(*size);
+    }
+    return buf;
+}
+
+static esp_err_t httpd_send_all(httpd_req_t *req, const char *buf, size_t len)
+{
+    while (len > 0) {
+        int sent = httpd_send(req, buf, len);
+        if (sent <= 0) {
+            return ESP_FAIL;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Resolves the requested byte range of a file of `total` bytes from
+ * ?offset=N or a single "Range: bytes=a-b", "bytes=a-" or "bytes=-n".
+ * Returns 1 for a partial response, 0 for the whole file and -1 when the
+ * range is unsatisfiable. Malformed or multi-range headers get the whole
+ * file, which RFC 9110 allows.
+ */
+static int parse_byte_range(httpd_req_t *req, size_t total, size_t *start, size_t *end)
+{
+    char value[48];
+    char query[64];
+    *start = 0;
+    *end = total ? total - 1 : 0;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+        *start = (size_t)strtoul(value, NULL, 10);
+        if (*start == 0) {
+            return 0;
+        }
+        return *start < total ? 1 : -1;
+    }
+    if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK ||
+        strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return 0;
+    }
+    const char *spec = value + 6;
+    const char *dash = strchr(spec, '-');
+    if (!dash) {
+        return 0;
+    }
+    if (dash == spec) {
+        size_t suffix = (size_t)strtoul(dash + 1, NULL, 10);
+        if (suffix == 0 || total == 0) {
+            return -1;
+        }
+        *start = (suffix < total) ? total - suffix : 0;
+        return 1;
+    }
+    *start = (size_t)strtoul(spec, NULL, 10);
+    if (dash[1] != '\0') {
+        size_t last = (size_t)strtoul(dash + 1, NULL, 10);
+        if (last < *start) {
+            *start = 0;
+            return 0;
+        }
+        *end = MIN(last, *end);
+    }
+    return *start < total ? 1 : -1;
+}
+
+/*
+ * Writes the status line and headers by hand and pushes the file body with
+ * raw socket sends: the response has an exact Content-Length, so there is no
+ * chunked framing and every read is a FILE_SEND_BUF_SIZE block.
+ */
+static esp_err_t send_file_raw(httpd_req_t *req, const char *path, const char *type)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "file not found");
+        return ESP_FAIL;
+    }
+    size_t total = (size_t)st.st_size;
+    size_t start = 0;
+    size_t end = 0;
+    int ranged = parse_byte_range(req, total, &start, &end);
+    if (ranged < 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes */%u", (unsigned)total);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", range);
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "open failed");
+        return ESP_FAIL;
+    }
+    size_t buf_size = FILE_SEND_BUF_SIZE;
+    uint8_t *buf = alloc_io_buffer(&buf_size);
+    if (!buf) {
+        fclose(file);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no memory");
+        return ESP_FAIL;
+    }
+
+    size_t remaining = total ? end - start + 1 : 0;
+    char hdr[256];
+    int hdr_len;
+    if (ranged) {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                           "Content-Length: %u\r\nContent-Range: bytes %u-%u/%u\r\n"
+                           "Accept-Ranges: bytes\r\n\r\n",
+                           type, (unsigned)remaining, (unsigned)start, (unsigned)end,
+                           (unsigned)total);
+    } else {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n"
+                           "Accept-Ranges: bytes\r\n\r\n",
+                           type, (unsigned)remaining);
+    }
+
+    esp_err_t err = httpd_send_all(req, hdr, hdr_len);
+    if (err == ESP_OK && start > 0 && fseek(file, (long)start, SEEK_SET) != 0) {
+        err = ESP_FAIL;
+    }
+    while (err == ESP_OK && remaining > 0) {
+        size_t n = fread(buf, 1, MIN(buf_size, remaining), file);
+        if (n == 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        err = httpd_send_all(req, (const char *)buf, n);
+        remaining -= n;
+    }
+    free(buf);
+    fclose(file);
+    if (err != ESP_OK) {
+        /* Headers already went out; a short body must end the connection. */
+        ESP_LOGW(TAG, "Send of %s aborted with %u bytes left", path, (unsigned)remaining);
+    }
+    return err;
+}
+
+static const char *file_content_type(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext && strcmp(ext, ".jpg") == 0) {
+        return "image/jpeg";
+    }
+    if (ext && strcmp(ext, ".csv") == 0) {
+        return "text/csv";
+    }
+    return "application/octet-stream";
+}
+
+static esp_err_t session_list_send(httpd_req_t *req, const char *session)
+{
+    DIR *dir = opendir(CAPTURE_DIR);
+    if (!dir) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no captures");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    struct dirent *entry;
+    char line[300];
+    char path[300];
+    int count = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!capseq_session_file(session, entry->d_name)) {
+            continue;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        int len = snprintf(line, sizeof(line), "%s %ld\n", entry->d_name, (long)st.st_size);
+        if (httpd_resp_send_chunk(req, line, len) != ESP_OK) {
+            closedir(dir);
+            return ESP_FAIL;
+        }
+        count++;
+    }
+    closedir(dir);
+    ESP_LOGI(TAG, "Session %s: listed %d files", session, count);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/*
+ * Session archive: GET /api/session/<session>?format=tar streams every file
+ * of the session (on the master also the collected slave-<id>/ copies) as one
+ * store-only ustar archive. Sizes are known up front, so the response has an
+ * exact Content-Length and goes out with raw sends. A reader task fills PSRAM
+ * blocks with headers and file data while the HTTP task sends the previous
+ * block; nothing is staged on the card.
+ */
+#define TAR_BLOCK 512
+#define TAR_PAD(size) (((size) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+
+typedef struct __attribute__((packed)) {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+typedef struct {
+    char name[100];         /* archive path, relative to CAPTURE_DIR */
+    uint32_t size;
+    uint32_t mtime;
+} tar_entry_t;
+
+typedef struct {
+    uint8_t *data;          /* NULL: end of archive (or reader failure) */
+    size_t len;
+} tar_block_t;
+
+typedef struct {
+    const tar_entry_t *entries;
+    int count;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    uint8_t *cur;
+    size_t fill;
+    volatile bool abort;
+    bool failed;
+} tar_stream_t;
+
+static bool tar_entries_add(tar_entry_t **entries, int *count, int *cap, const char *dir_path,
+                            const char *prefix, const char *name)
+{
+    char path[320];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return true;
+    }
+    if (*count == *cap) {
+        int grow = *cap ? *cap * 2 : 64;
+        tar_entry_t *bigger = heap_caps_realloc(*entries, grow * sizeof(tar_entry_t),
+                                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!bigger) {
+            return false;
+        }
+        *entries = bigger;
+        *cap = grow;
+    }
+    tar_entry_t *e = &(*entries)[*count];
+    int len = snprintf(e->name, sizeof(e->name), "%s%s", prefix, name);
+    if (len >= (int)sizeof(e->name)) {
+        return true;        /* does not fit a plain ustar name */
+    }
+    e->size = (uint32_t)st.st_size;
+    e->mtime = (uint32_t)st.st_mtime;
+    (*count)++;
+    return true;
+}
+
+static tar_entry_t *tar_collect_entries(const char *session, int *count)
+{
+    tar_entry_t *entries = NULL;
+    int cap = 0;
+    *count = 0;
+    DIR *dir = opendir(CAPTURE_DIR);
+    if (!dir) {
+        return NULL;
+    }
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (capseq_session_file(session, entry->d_name)) {
+            ok = tar_entries_add(&entries, count, &cap, CAPTURE_DIR, "", entry->d_name);
+        } else if (strncmp(entry->d_name, "slave-", 6) == 0 && entry->d_type == DT_DIR) {
+            char sub_path[64];
+            char prefix[48];
+            snprintf(sub_path, sizeof(sub_path), "%s/%s", CAPTURE_DIR, entry->d_name);
+            snprintf(prefix, sizeof(prefix), "%s/", entry->d_name);
+            DIR *sub = opendir(sub_path);
+            struct dirent *sub_entry;
+            while (ok && sub && (sub_entry = readdir(sub)) != NULL) {
+                if (capseq_session_file(session, sub_entry->d_name)) {
+                    ok = tar_entries_add(&entries, count, &cap, sub_path, prefix, sub_entry->d_name);
+                }
+            }
+            if (sub) {
+                closedir(sub);
+            }
+        }
+    }
+    closedir(dir);
+    if (!ok) {
+        free(entries);
+        *count = 0;
+        return NULL;
+    }
+    return entries;
+}
+
+static void tar_header_fill(tar_header_t *hdr, const tar_entry_t *e)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->name, e->name, strnlen(e->name, sizeof(hdr->name)));
+    snprintf(hdr->mode, sizeof(hdr->mode), "%07o", 0644);
+    snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 0);
+    snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 0);
+    snprintf(hdr->size, sizeof(hdr->size), "%011" PRIo32, e->size);
+    snprintf(hdr->mtime, sizeof(hdr->mtime), "%011" PRIo32, e->mtime);
+    hdr->typeflag = '0';
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    uint32_t sum = 0;
+    const uint8_t *bytes = (const uint8_t *)hdr;
+    for (size_t i = 0; i < sizeof(*hdr); ++i) {
+        sum += bytes[i];
+    }
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06" PRIo32, sum);
+}
+
+/*
+ * Queues the current block once it is full (or, with flush, whatever it
+ * holds) and otherwise makes sure a block with free space is at hand.
+ */
+static bool tar_emit(tar_stream_t *ts, bool flush)
+{
+    if (ts->cur && (ts->fill == TAR_STREAM_BLOCK_SIZE || (flush && ts->fill > 0))) {
+        tar_block_t block = {.data = ts->cur, .len = ts->fill};
+        xQueueSend(ts->full_q, &block, portMAX_DELAY);
+        ts->cur = NULL;
+    }
+    if (flush) {
+        return true;
+    }
+    if (!ts->cur) {
+        if (ts->abort || xQueueReceive(ts->free_q, &ts->cur, portMAX_DELAY) != pdTRUE) {
+            return false;
+        }
+        ts->fill = 0;
+    }
+    return true;
+}
+
+static bool tar_put_zero(tar_stream_t *ts, size_t len)
+{
+    while (len > 0) {
+        if (!tar_emit(ts, false)) {
+            return false;
+        }
+        size_t n = MIN(len, TAR_STREAM_BLOCK_SIZE - ts->fill);
+        memset(ts->cur + ts->fill, 0, n);
+        ts->fill += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool tar_put_file(tar_stream_t *ts, const tar_entry_t *e)
+{
+    if (!tar_emit(ts, false)) {
+        return false;
+    }
+    /* TAR_STREAM_BLOCK_SIZE is a multiple of 512, so a header never splits. */
+    tar_header_fill((tar_header_t *)(ts->cur + ts->fill), e);
+    ts->fill += TAR_BLOCK;
+
+    char path[160];
+    snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, e->name);
+    FILE *file = fopen(path, "rb");
+    size_t left = e->size;
+    while (file && left > 0) {
+        if (!tar_emit(ts, false)) {
+            break;
+        }
+        size_t n = fread(ts->cur + ts->fill, 1, MIN(left, TAR_STREAM_BLOCK_SIZE - ts->fill), file);
+        if (n == 0) {
+            break;
+        }
+        ts->fill += n;
+        left -= n;
+    }
+    if (file) {
+        fclose(file);
+    }
+    if (left > 0) {
+        ESP_LOGW(TAG, "Archive: %s short by %u bytes", e->name, (unsigned)left);
+        return false;
+    }
+    return tar_put_zero(ts, TAR_PAD(e->size) - e->size);
+}
+
+static void tar_reader_task(void *arg)
+{
+    tar_stream_t *ts = (tar_stream_t *)arg;
+    bool ok = true;
+    for (int i = 0; ok && i < ts->count; ++i) {
+        ok = tar_put_file(ts, &ts->entries[i]);
+    }
+    ok = ok && tar_put_zero(ts, 2 * TAR_BLOCK) && tar_emit(ts, true);
+    if (ts->cur) {
+        xQueueSend(ts->free_q, &ts->cur, 0);
+    }
+    ts->failed = !ok;
+    tar_block_t end = {0};
+    xQueueSend(ts->full_q, &end, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t session_tar_send(httpd_req_t *req, const char *session)
+{
+    int count = 0;
+    tar_entry_t *entries = tar_collect_entries(session, &count);
+    if (!entries || count == 0) {
+        free(entries);
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "empty session");
+        return ESP_FAIL;
+    }
+    uint64_t total = 2 * TAR_BLOCK;
+    for (int i = 0; i < count; ++i) {
+        total += TAR_BLOCK + TAR_PAD((uint64_t)entries[i].size);
+    }
+
+    tar_stream_t ts = {
+        .entries = entries,
+        .count = count,
+        .free_q = xQueueCreate(TAR_STREAM_BLOCK_COUNT, sizeof(uint8_t *)),
+        .full_q = xQueueCreate(TAR_STREAM_BLOCK_COUNT + 1, sizeof(tar_block_t)),
+    };
+    uint8_t *blocks[TAR_STREAM_BLOCK_COUNT] = {0};
+    bool ok = ts.free_q && ts.full_q;
+    for (int i = 0; ok && i < TAR_STREAM_BLOCK_COUNT; ++i) {
+        blocks[i] = heap_caps_malloc(TAR_STREAM_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        ok = blocks[i] != NULL;
+        if (ok) {
+            xQueueSend(ts.free_q, &blocks[i], 0);
+        }
+    }
+    esp_err_t err = ESP_FAIL;
+    if (!ok) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no memory");
+    } else if (xTaskCreatePinnedToCore(tar_reader_task, "tar_rd", TAR_READER_TASK_STACK_SIZE, &ts,
+                                       CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE) != pdPASS) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "reader task create failed");
+    } else {
+        char hdr[192];
+        int hdr_len = snprintf(hdr, sizeof(hdr),
+                               "HTTP/1.1 200 OK\r\nContent-Type: application/x-tar\r\n"
+                               "Content-Length: %llu\r\n"
+                               "Content-Disposition: attachment; filename=\"%s.tar\"\r\n\r\n",
+                               (unsigned long long)total, session);
+        err = httpd_send_all(req, hdr, hdr_len);
         if (err != ESP_OK) {
+            ts.abort = true;
+        }
+        uint64_t sent = 0;
+        tar_block_t block;
+        /* Drain until the reader's end marker even after a send error, so
+         * it never blocks on a queue that nobody reads. */
+        while (xQueueReceive(ts.full_q, &block, portMAX_DELAY) == pdTRUE && block.data) {
+            if (!ts.abort) {
+                err = httpd_send_all(req, (const char *)block.data, block.len);
+                ts.abort = (err != ESP_OK);
+                sent += block.len;
+            }
+            xQueueSend(ts.free_q, &block.data, 0);
+        }
+        if (err == ESP_OK && (ts.failed || sent != total)) {
+            err = ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "Archive %s: %d files, %llu/%llu bytes%s", session, count,
+                 (unsigned long long)sent, (unsigned long long)total, err == ESP_OK ? "" : " (aborted)");
+    }
+
+    for (int i = 0; i < TAR_STREAM_BLOCK_COUNT; ++i) {
+        free(blocks[i]);
+    }
+    if (ts.free_q) vQueueDelete(ts.free_q);
+    if (ts.full_q) vQueueDelete(ts.full_q);
+    free(entries);
+    return err;
+}
+
+static esp_err_t session_handler(httpd_req_t *req)
+{
+    char session[32];
+    char name[96] = {0};
+    const char *rest = req->uri + strlen("/api/session/");
+    size_t len = strcspn(rest, "/?");
+    if (len == 0 || len >= sizeof(session)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid session");
+        return ESP_FAIL;
+    }
+    memcpy(session, rest, len);
+    session[len] = '\0';
+    if (rest[len] == '/') {
+        const char *file = rest + len + 1;
+        size_t name_len = strcspn(file, "?");
+        if (name_len >= sizeof(name)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid file");
+            return ESP_FAIL;
+        }
+        memcpy(name, file, name_len);
+    }
+    if (!capseq_safe_name(session) || (name[0] && !capseq_safe_name(name))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
+        return ESP_FAIL;
+    }
+    if (!name[0]) {
+        char query[32];
+        char format[8];
+        if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "format", format, sizeof(format)) == ESP_OK &&
+            strcmp(format, "tar") == 0) {
+            return session_tar_send(req, session);
+        }
+        return session_list_send(req, session);
+    }
+    if (!capseq_session_file(session, name)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "not in session");
+        return ESP_FAIL;
+    }
+
+    char path[160];
+    snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, name);
+    return send_file_raw(req, path, file_content_type(name));
+}
+
+/*
+ * GET /api/files?offset=N&limit=M[&dir=<sub>] pages through CAPTURE_DIR (or
+ * one subdirectory of it, e.g. collected slave-<id> frames) as JSON;
+ * GET /api/files/<name> or /api/files/<sub>/<name> downloads through
+ * send_file_raw() with Range support. Only the returned page is stat()ed, so
+ * a page costs the same regardless of where it sits in the directory.
+ */
+static esp_err_t files_list_send(httpd_req_t *req)
+{
+    char query[96] = {0};
+    char value[32];
+    char sub[32] = {0};
+    int offset = 0;
+    int limit = FILES_PAGE_DEFAULT;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+            offset = MAX(atoi(value), 0);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+            limit = clamp_int(atoi(value), 1, FILES_PAGE_MAX);
+        }
+        if (httpd_query_key_value(query, "dir", sub, sizeof(sub)) == ESP_OK && !capseq_safe_name(sub)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid dir");
+            return ESP_FAIL;
+        }
+    }
+
+    char dir_path[64];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%s", CAPTURE_DIR, sub[0] ? "/" : "", sub);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "directory not found");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    char line[320];
+    int len = snprintf(line, sizeof(line), "{\"dir\":\"%s\",\"offset\":%d,\"limit\":%d,\"files\":[",
+                       sub, offset, limit);
+    esp_err_t err = httpd_resp_send_chunk(req, line, len);
+
+    struct dirent *entry;
+    int index = 0;
+    int count = 0;
+    while (err == ESP_OK && (entry = readdir(dir)) != NULL) {
+        if (index++ < offset || count >= limit) {
             continue;
         }
+        char path[320];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) != 0) {
+            memset(&st, 0, sizeof(st));
+        }
+        len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"size\":%ld,\"mtime\":%lld,\"dir\":%s}",
+                       count ? "," : "", entry->d_name, (long)st.st_size, (long long)st.st_mtime,
+                       S_ISDIR(st.st_mode) ? "true" : "false");
+        err = httpd_resp_send_chunk(req, line, len);
+        count++;
+    }
+    closedir(dir);
+    if (err != ESP_OK) {
+        return err;
+    }
+    len = snprintf(line, sizeof(line), "],\"count\":%d,\"total\":%d}", count, index);
+    httpd_resp_send_chunk(req, line, len);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t files_handler(httpd_req_t *req)
+{
+    const char *rest = req->uri + strlen("/api/files");
+    if (*rest == '/') {
+        rest++;
+    }
+    size_t len = strcspn(rest, "?");
+    if (len == 0) {
+        return files_list_send(req);
+    }
+
+    char rel[128];
+    if (len >= sizeof(rel)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
+        return ESP_FAIL;
+    }
+    memcpy(rel, rest, len);
+    rel[len] = '\0';
+    char *name = strchr(rel, '/');
+    if (name) {
+        *name++ = '\0';
+    }
+    if (!capseq_safe_name(rel) || (name && !capseq_safe_name(name))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
+        return ESP_FAIL;
+    }
+
+    char path[192];
+    if (name) {
+        snprintf(path, sizeof(path), "%s/%s/%s", CAPTURE_DIR, rel, name);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, rel);
+    }
+    return send_file_raw(req, path, file_content_type(name ? name : rel));
+}
+
+typedef struct {
+    int sock;
+    struct sockaddr_in group;   /* CONFIG_CAPSEQ_SYNC_GROUP_ADDR */
+    bool has_group;
+} udp_slave_ctx_t;
+
+static uint32_t capseq_node_id(const char *id)
+{
+    return (uint32_t)strtoul(id, NULL, 16);
+}
+
+static uint32_t capseq_next_seq(uint32_t count)
+{
+    uint32_t seq = s_capseq_seq;
+    s_capseq_seq += count;
+    return seq;
+}
+
+static void capseq_msg_init(capseq_msg_t *msg, uint8_t type, uint32_t seq)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->magic = CAPSEQ_PROTO_MAGIC;
+    msg->version = CAPSEQ_PROTO_VERSION;
+    msg->type = type;
+    msg->seq = seq;
+    msg->sender_id = capseq_node_id(CONFIG_MASTER_ID);
+}
+
+static bool capseq_msg_valid(const capseq_msg_t *msg, int len)
+{
+    return len == (int)sizeof(*msg) && msg->magic == CAPSEQ_PROTO_MAGIC &&
+           msg->version == CAPSEQ_PROTO_VERSION;
+}
+
+static capseq_slave_t *capseq_slave_add(const char *id)
+{
+    if (!id || !id[0]) {
+        return NULL;
+    }
+    uint32_t node_id = capseq_node_id(id);
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].node_id == node_id) {
+            return &s_slaves[i];
+        }
+    }
+    if (s_slave_count >= CONFIG_CAPSEQ_MAX_SLAVES) {
+        ESP_LOGW(TAG, "Slave registry full, ignoring %s", id);
+        return NULL;
+    }
+    capseq_slave_t *slave = &s_slaves[s_slave_count++];
+    memset(slave, 0, sizeof(*slave));
+    snprintf(slave->id, sizeof(slave->id), "%s", id);
+    slave->node_id = node_id;
+    return slave;
+}
+
+/* Static registry: CONFIG_CAPSEQ_SLAVE_IDS, or CONFIG_SLAVE_ID when that is empty. */
+static esp_err_t capseq_registry_init(void)
+{
+    char ids[sizeof(CONFIG_CAPSEQ_SLAVE_IDS) + 1];
+    snprintf(ids, sizeof(ids), "%s", CONFIG_CAPSEQ_SLAVE_IDS);
+    char *save = NULL;
+    for (char *tok = strtok_r(ids, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        capseq_slave_add(tok);
+    }
+    if (s_slave_count == 0) {
+        capseq_slave_add(CONFIG_SLAVE_ID);
+    }
+    ESP_LOGI(TAG, "Slave registry: %d slave(s)", s_slave_count);
+    return ESP_OK;
+}
+
+#if CONFIG_CAPSEQ_SLAVE_MDNS_BROWSE
+/* Adds slaves advertising _capseq._udp; their TXT "id" names the slave. */
+static void capseq_registry_browse(void)
+{
+    mdns_result_t *results = NULL;
+    esp_err_t err = mdns_query_ptr("_capseq", "_udp", CAPSEQ_MDNS_BROWSE_MS,
+                                   CONFIG_CAPSEQ_MAX_SLAVES, &results);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "mDNS browse failed: %s", esp_err_to_name(err));
+        return;
+    }
+    for (mdns_result_t *r = results; r; r = r->next) {
+        const char *id = NULL;
+        for (size_t i = 0; i < r->txt_count; ++i) {
+            if (strcmp(r->txt[i].key, "id") == 0) {
+                id = r->txt[i].value;
+            }
+        }
+        capseq_slave_t *slave = capseq_slave_add(id);
+        if (!slave) {
+            continue;
+        }
+        for (mdns_ip_addr_t *a = r->addr; a; a = a->next) {
+            if (a->addr.type == ESP_IPADDR_TYPE_V4) {
+                slave->addr.sin_family = AF_INET;
+                slave->addr.sin_port = htons(r->port);
+                slave->addr.sin_addr.s_addr = a->addr.u_addr.ip4.addr;
+                slave->browsed = true;
+                break;
+            }
+        }
+    }
+    mdns_query_results_free(results);
+}
+#endif
 
-        int64_t slave_time = 0;
-        if (!parse_int64_payload(rx_buf, &slave_time)) {
-            continue;
+static esp_err_t capseq_slave_resolve(capseq_slave_t *slave)
+{
+    if (slave->browsed) {
+        return ESP_OK;
+    }
+    char host[64];
+    snprintf(host, sizeof(host), "slavecam-%s.local", slave->id);
+    char port[8];
+    snprintf(port, sizeof(port), "%d", CONFIG_CAPSEQ_SYNC_UDP_PORT);
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0 || !res) {
+        ESP_LOGW(TAG, "UDP resolve failed for %s:%s (%d)", host, port, err);
+        return ESP_FAIL;
+    }
+    memcpy(&slave->addr, res->ai_addr, sizeof(slave->addr));
+    freeaddrinfo(res);
+    return ESP_OK;
+}
+
+/* Slaves answering a phase in this sequence; the rest are dropped or fail it. */
+static int capseq_slaves_in_state(capseq_slave_state_t state)
+{
+    int count = 0;
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].state >= state) {
+            count++;
         }
+    }
+    return count;
+}
 
-        int64_t rtt_us = recv_time - send_time;
-        int64_t master_at_slave = send_time + rtt_us / 2;
-        int64_t disparity_us = master_at_slave - slave_time;
-        rtt_sum += rtt_us;
-        disparity_sum += disparity_us;
-        samples++;
+static const capseq_slave_t *capseq_first_slave_below(capseq_slave_state_t state)
+{
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].state < state) {
+            return &s_slaves[i];
+        }
     }
+    return NULL;
+}
 
-    udp_close_slave_socket(&ctx);
-    if (samples == 0) {
+static esp_err_t udp_open_slave_socket(udp_slave_ctx_t *ctx, int timeout_ms)
+{
+    if (!ctx) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ctx->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (ctx->sock < 0) {
+        ESP_LOGW(TAG, "UDP socket create failed (%d)", errno);
         return ESP_FAIL;
     }
 
-    int64_t avg_rtt = rtt_sum / samples;
-    metrics->trip_time_us = avg_rtt / 2;
-    metrics->cpu_disparity_us = disparity_sum / samples;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+    setsockopt(ctx->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(ctx->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    memset(&ctx->group, 0, sizeof(ctx->group));
+    ctx->group.sin_family = AF_INET;
+    ctx->group.sin_port = htons(CONFIG_CAPSEQ_SYNC_UDP_PORT);
+    ctx->has_group = inet_pton(AF_INET, CONFIG_CAPSEQ_SYNC_GROUP_ADDR, &ctx->group.sin_addr) == 1;
+    if (ctx->has_group) {
+        if (ctx->group.sin_addr.s_addr == htonl(INADDR_BROADCAST)) {
+            int on = 1;
+            setsockopt(ctx->sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        } else {
+            uint8_t ttl = 1;
+            setsockopt(ctx->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        }
+    }
     return ESP_OK;
 }
 
-static esp_err_t udp_slave_start_capture(int64_t start_delay_us)
+static void udp_close_slave_socket(udp_slave_ctx_t *ctx)
 {
-    udp_slave_ctx_t ctx;
-    if (udp_open_slave_socket(&ctx, 300) != ESP_OK) {
-        return ESP_FAIL;
+    if (ctx && ctx->sock >= 0) {
+        close(ctx->sock);
+        ctx->sock = -1;
     }
+}
 
-    char payload[64];
-    int payload_len = snprintf(payload, sizeof(payload), "START %lld", (long long)start_delay_us);
-    char rx_buf[32];
-    esp_err_t err = udp_send_and_recv(&ctx, payload, payload_len, rx_buf, sizeof(rx_buf), NULL);
-    udp_close_slave_socket(&ctx);
-    if (err != ESP_OK) {
-        return err;
+static esp_err_t udp_send_msg(udp_slave_ctx_t *ctx, const capseq_slave_t *slave, const capseq_msg_t *msg)
+{
+    int sent = sendto(ctx->sock, msg, sizeof(*msg), 0,
+                      (const struct sockaddr *)&slave->addr, sizeof(slave->addr));
+    return (sent == (int)sizeof(*msg)) ? ESP_OK : ESP_FAIL;
+}
+
+/* Waits for a reply of the given type (or an ERROR) whose seq falls in
+ * [seq_lo, seq_hi). Anything else belongs to an earlier exchange. */
+static esp_err_t udp_recv_msg(udp_slave_ctx_t *ctx, uint8_t type, uint32_t seq_lo, uint32_t seq_hi,
+                              int64_t deadline_us, capseq_msg_t *out, int64_t *out_rx_us)
+{
+    while (esp_timer_get_time() < deadline_us) {
+        capseq_msg_t msg;
+        int len = recvfrom(ctx->sock, &msg, sizeof(msg), 0, NULL, NULL);
+        int64_t rx_us = esp_timer_get_time();
+        if (len < 0) {
+            continue;
+        }
+        if (!capseq_msg_valid(&msg, len) || msg.seq - seq_lo >= seq_hi - seq_lo) {
+            continue;
+        }
+        if (msg.type != type && msg.type != CAPSEQ_MSG_ERROR) {
+            continue;
+        }
+        *out = msg;
+        if (out_rx_us) {
+            *out_rx_us = rx_us;
+        }
+        return (msg.type == CAPSEQ_MSG_ERROR) ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
     }
-    if (strncmp(rx_buf, "ACK", 3) == 0) {
-        return ESP_OK;
+    return ESP_ERR_TIMEOUT;
+}
+
+/* Maps a reply to the slave it was sent to; requests use seq base + index. */
+static capseq_slave_t *udp_reply_slave(const capseq_msg_t *msg, uint32_t base_seq, uint32_t per_slave)
+{
+    uint32_t idx = (msg->seq - base_seq) / per_slave;
+    if (idx >= (uint32_t)s_slave_count || s_slaves[idx].node_id != msg->sender_id) {
+        return NULL;
     }
-    return ESP_FAIL;
+    return &s_slaves[idx];
 }
 
-static esp_err_t udp_slave_start_with_retry(int64_t start_delay_us)
+/*
+ * Polls every resolved slave with READY until all of them report prepared or
+ * the timeout expires. Each poll round is one datagram per pending slave.
+ */
+static int udp_slaves_wait_ready(udp_slave_ctx_t *ctx, int timeout_ms, int poll_ms)
 {
-    for (int attempt = 0; attempt < CONFIG_CAPSEQ_SYNC_START_RETRIES; ++attempt) {
-        esp_err_t err = udp_slave_start_capture(start_delay_us);
-        if (err == ESP_OK) {
-            return ESP_OK;
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    int pending = capseq_slaves_in_state(CAPSEQ_SLAVE_RESOLVED) -
+                  capseq_slaves_in_state(CAPSEQ_SLAVE_READY);
+    while (pending > 0 && esp_timer_get_time() < deadline_us) {
+        uint32_t base_seq = capseq_next_seq(s_slave_count);
+        for (int i = 0; i < s_slave_count; ++i) {
+            if (s_slaves[i].state != CAPSEQ_SLAVE_RESOLVED) {
+                continue;
+            }
+            capseq_msg_t req;
+            capseq_msg_init(&req, CAPSEQ_MSG_READY, base_seq + i);
+            udp_send_msg(ctx, &s_slaves[i], &req);
+        }
+
+        int64_t poll_deadline_us = MIN(esp_timer_get_time() + (int64_t)poll_ms * 1000, deadline_us);
+        while (pending > 0) {
+            capseq_msg_t resp;
+            esp_err_t err = udp_recv_msg(ctx, CAPSEQ_MSG_READY_RESP, base_seq,
+                                         base_seq + s_slave_count, poll_deadline_us, &resp, NULL);
+            if (err == ESP_ERR_TIMEOUT) {
+                break;
+            }
+            capseq_slave_t *slave = udp_reply_slave(&resp, base_seq, 1);
+            if (err == ESP_OK && slave && slave->state == CAPSEQ_SLAVE_RESOLVED &&
+                resp.status == ESP_OK) {
+                slave->state = CAPSEQ_SLAVE_READY;
+                pending--;
+            }
+        }
+        while (pending > 0 && esp_timer_get_time() < poll_deadline_us) {
+            vTaskDelay(pdMS_TO_TICKS(10));
         }
-        vTaskDelay(pdMS_TO_TICKS(CONFIG_CAPSEQ_SYNC_START_RETRY_DELAY_MS));
     }
-    return ESP_FAIL;
+    return capseq_slaves_in_state(CAPSEQ_SLAVE_READY);
 }
 
-static esp_err_t send_slave_prepare(const char *query)
+/*
+ * Sends the ping bursts for all ready slaves back to back and matches PONGs by
+ * seq, so syncing N slaves costs about one round trip instead of N * pings of
+ * them. Each PONG carries the slave's receive and transmit times, which
+ * removes the slave's turnaround from the round trip. Queueing only ever
+ * lengthens an exchange, so per slave the sample with the shortest network
+ * delay is used.
+ */
+static int udp_slaves_sync(udp_slave_ctx_t *ctx)
 {
-    #ifdef IGNORE_SLAVE
-    return ESP_OK;
-    #endif
+    const uint32_t ping_count = CONFIG_CAPSEQ_SYNC_UDP_PINGS;
+    uint32_t base_seq = capseq_next_seq(ping_count * s_slave_count);
+    int64_t best_delay_us[CONFIG_CAPSEQ_MAX_SLAVES];
+    int samples[CONFIG_CAPSEQ_MAX_SLAVES] = {0};
+    int expected = 0;
+
+    for (int i = 0; i < s_slave_count; ++i) {
+        best_delay_us[i] = INT64_MAX;
+        if (s_slaves[i].state == CAPSEQ_SLAVE_READY) {
+            expected += ping_count;
+        }
+    }
+    for (uint32_t p = 0; p < ping_count; ++p) {
+        for (int i = 0; i < s_slave_count; ++i) {
+            if (s_slaves[i].state != CAPSEQ_SLAVE_READY) {
+                continue;
+            }
+            capseq_msg_t ping;
+            capseq_msg_init(&ping, CAPSEQ_MSG_PING, base_seq + i * ping_count + p);
+            ping.origin_us = esp_timer_get_time();
+            if (udp_send_msg(ctx, &s_slaves[i], &ping) != ESP_OK) {
+                ESP_LOGW(TAG, "UDP ping to %s send failed (%d)", s_slaves[i].id, errno);
+            }
+        }
+    }
+
+    int received = 0;
+    int64_t deadline_us = esp_timer_get_time() + 300 * 1000;
+    while (received < expected) {
+        capseq_msg_t pong;
+        int64_t rx_us = 0;
+        esp_err_t err = udp_recv_msg(ctx, CAPSEQ_MSG_PONG, base_seq,
+                                     base_seq + ping_count * s_slave_count, deadline_us, &pong, &rx_us);
+        if (err == ESP_ERR_TIMEOUT) {
+            break;
+        }
+        capseq_slave_t *slave = udp_reply_slave(&pong, base_seq, ping_count);
+        if (err != ESP_OK || !slave || slave->state != CAPSEQ_SLAVE_READY) {
+            continue;
+        }
+        int idx = slave - s_slaves;
+        int64_t delay_us = (rx_us - pong.origin_us) - (pong.xmit_us - pong.recv_us);
+        int64_t disparity_us = ((pong.origin_us - pong.recv_us) + (rx_us - pong.xmit_us)) / 2;
+        received++;
+        samples[idx]++;
+        if (delay_us >= 0 && delay_us < best_delay_us[idx]) {
+            best_delay_us[idx] = delay_us;
+            slave->metrics.trip_time_us = delay_us / 2;
+            slave->metrics.cpu_disparity_us = disparity_us;
+        }
+    }
+
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].state != CAPSEQ_SLAVE_READY || best_delay_us[i] == INT64_MAX) {
+            continue;
+        }
+        s_slaves[i].state = CAPSEQ_SLAVE_SYNCED;
+        ESP_LOGI(TAG, "UDP sync %s: %d/%" PRIu32 " pongs, best rtt=%lldus disparity=%lldus",
+                 s_slaves[i].id, samples[i], ping_count, (long long)best_delay_us[i],
+                 (long long)s_slaves[i].metrics.cpu_disparity_us);
+    }
+    return capseq_slaves_in_state(CAPSEQ_SLAVE_SYNCED);
+}
+
+static capseq_slave_t *capseq_slave_find(uint32_t node_id)
+{
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].node_id == node_id) {
+            return &s_slaves[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Group START: one datagram carries the start time in the master clock plus
+ * every synced slave's disparity, and goes to CONFIG_CAPSEQ_SYNC_GROUP_ADDR.
+ * Each slave converts the time with its own entry, so neither the send order
+ * nor the trip time skews the start. ACKs are collected as they arrive; the
+ * same datagram (same seq, so slaves dedupe it) is unicast to slaves that
+ * have not acknowledged. Without a group address every attempt is unicast.
+ */
+static int udp_slaves_start(udp_slave_ctx_t *ctx, int64_t start_time_us)
+{
+    capseq_start_msg_t start;
+    memset(&start, 0, sizeof(start));
+    capseq_msg_init(&start.hdr, CAPSEQ_MSG_START, capseq_next_seq(1));
+    start.hdr.arg_us = start_time_us;
+    for (int i = 0; i < s_slave_count && start.count < CAPSEQ_START_MAX_SLAVES; ++i) {
+        if (s_slaves[i].state != CAPSEQ_SLAVE_SYNCED) {
+            continue;
+        }
+        start.entries[start.count].node_id = s_slaves[i].node_id;
+        start.entries[start.count].disparity_us = s_slaves[i].metrics.cpu_disparity_us;
+        start.entries[start.count].trip_us = s_slaves[i].metrics.trip_time_us;
+        start.count++;
+    }
+    size_t len = CAPSEQ_START_MSG_LEN(start.count);
+
+    int pending = start.count;
+    for (int attempt = 0; attempt < CONFIG_CAPSEQ_SYNC_START_RETRIES && pending > 0; ++attempt) {
+        start.hdr.origin_us = esp_timer_get_time();
+        if (attempt == 0 && ctx->has_group) {
+            sendto(ctx->sock, &start, len, 0, (const struct sockaddr *)&ctx->group, sizeof(ctx->group));
+        } else {
+            for (int i = 0; i < s_slave_count; ++i) {
+                if (s_slaves[i].state == CAPSEQ_SLAVE_SYNCED) {
+                    sendto(ctx->sock, &start, len, 0, (const struct sockaddr *)&s_slaves[i].addr,
+                           sizeof(s_slaves[i].addr));
+                }
+            }
+        }
+
+        int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_CAPSEQ_SYNC_START_RETRY_DELAY_MS * 1000;
+        while (pending > 0) {
+            capseq_msg_t resp;
+            esp_err_t err = udp_recv_msg(ctx, CAPSEQ_MSG_START_ACK, start.hdr.seq,
+                                         start.hdr.seq + 1, deadline_us, &resp, NULL);
+            if (err == ESP_ERR_TIMEOUT) {
+                break;
+            }
+            capseq_slave_t *slave = capseq_slave_find(resp.sender_id);
+            if (!slave || slave->state != CAPSEQ_SLAVE_SYNCED) {
+                continue;
+            }
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "Slave %s rejected START: %s", slave->id,
+                         esp_err_to_name((esp_err_t)resp.status));
+                continue;
+            }
+            slave->state = CAPSEQ_SLAVE_STARTED;
+            pending--;
+        }
+    }
+    return capseq_slaves_in_state(CAPSEQ_SLAVE_STARTED);
+}
+
+/* Fire-and-forget clock beacon during a scheduled capture; slaves refine
+ * their disparity from it. Lost beacons only delay the next correction. */
+static void udp_slaves_beacon(udp_slave_ctx_t *ctx, int slot)
+{
+    capseq_msg_t beacon;
+    capseq_msg_init(&beacon, CAPSEQ_MSG_BEACON, capseq_next_seq(1));
+    beacon.arg_us = slot;
+    if (ctx->has_group) {
+        beacon.origin_us = esp_timer_get_time();
+        sendto(ctx->sock, &beacon, sizeof(beacon), 0, (const struct sockaddr *)&ctx->group,
+               sizeof(ctx->group));
+        return;
+    }
+    for (int i = 0; i < s_slave_count; ++i) {
+        if (s_slaves[i].state == CAPSEQ_SLAVE_STARTED) {
+            beacon.origin_us = esp_timer_get_time();
+            udp_send_msg(ctx, &s_slaves[i], &beacon);
+        }
+    }
+}
+
+static size_t capseq_prepare_build(capseq_prepare_msg_t *prep, const capture_request_t *req)
+{
+    memset(prep, 0, sizeof(*prep));
+    capseq_msg_init(&prep->hdr, CAPSEQ_MSG_PREPARE, capseq_next_seq(1));
+    snprintf(prep->session, sizeof(prep->session), "%s", req->session);
+    prep->frame_count = req->frame_count;
+    prep->framesize = req->fs;
+    prep->pixformat = req->fmt;
+    prep->resync_every = req->resync_every;
+    prep->interval_us = req->interval_us;
+
+    char query_copy[256];
+    snprintf(query_copy, sizeof(query_copy), "%s", req->query);
+    char *saveptr = NULL;
+    for (char *pair = strtok_r(query_copy, "&", &saveptr); pair; pair = strtok_r(NULL, "&", &saveptr)) {
+        char *eq = strchr(pair, '=');
+        if (!eq) {
+            continue;
+        }
+        *eq = '\0';
+        for (size_t k = 0; k < CAPSEQ_SENSOR_KEY_COUNT; ++k) {
+            if (strcmp(pair, s_capseq_sensor_keys[k]) == 0 && prep->sensor_count < CAPSEQ_SENSOR_KEY_COUNT) {
+                prep->sensors[prep->sensor_count].key = k;
+                prep->sensors[prep->sensor_count].value = atoi(eq + 1);
+                prep->sensor_count++;
+                break;
+            }
+        }
+    }
+    return CAPSEQ_PREPARE_MSG_LEN(prep->sensor_count);
+}
+
+/*
+ * Sends the capture descriptor to every resolved slave over the sync socket
+ * and retransmits to slaves that have not acknowledged. An ACK only means the
+ * slave accepted the job; READY polling reports when its camera is set up.
+ * Returns the number of slaves that acknowledged.
+ */
+static int udp_slaves_prepare(udp_slave_ctx_t *ctx, const capture_request_t *req)
+{
+    capseq_prepare_msg_t prep;
+    size_t len = capseq_prepare_build(&prep, req);
+    bool answered[CONFIG_CAPSEQ_MAX_SLAVES] = {0};
+    int pending = capseq_slaves_in_state(CAPSEQ_SLAVE_RESOLVED);
+    int acked = 0;
+
+    for (int attempt = 0; attempt < CONFIG_CAPSEQ_SYNC_START_RETRIES && pending > 0; ++attempt) {
+        prep.hdr.origin_us = esp_timer_get_time();
+        for (int i = 0; i < s_slave_count; ++i) {
+            if (s_slaves[i].state == CAPSEQ_SLAVE_RESOLVED && !answered[i]) {
+                sendto(ctx->sock, &prep, len, 0, (const struct sockaddr *)&s_slaves[i].addr,
+                       sizeof(s_slaves[i].addr));
+            }
+        }
+
+        int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_CAPSEQ_SYNC_START_RETRY_DELAY_MS * 1000;
+        while (pending > 0) {
+            capseq_msg_t resp;
+            esp_err_t err = udp_recv_msg(ctx, CAPSEQ_MSG_PREPARE_ACK, prep.hdr.seq, prep.hdr.seq + 1,
+                                         deadline_us, &resp, NULL);
+            if (err == ESP_ERR_TIMEOUT) {
+                break;
+            }
+            capseq_slave_t *slave = capseq_slave_find(resp.sender_id);
+            if (!slave || answered[slave - s_slaves]) {
+                continue;
+            }
+            answered[slave - s_slaves] = true;
+            pending--;
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "Slave %s rejected PREPARE: %s", slave->id,
+                         esp_err_to_name((esp_err_t)resp.status));
+                continue;
+            }
+            acked++;
+        }
+    }
+    return acked;
+}
+
+static esp_err_t send_slave_prepare(const capseq_slave_t *slave, const char *query)
+{
+    char ip[16];
+    inet_ntop(AF_INET, &slave->addr.sin_addr, ip, sizeof(ip));
     char url[128];
-    snprintf(url, sizeof(url), "http://slavecam-%s.local/api/capture", CONFIG_SLAVE_ID);
+    snprintf(url, sizeof(url), "http://%s/api/capture", ip);
 
     esp_http_client_config_t cfg = {
         .url = url,
@@ -890,23 +2934,275 @@ static esp_err_t send_slave_prepare(const char *query)
     return err;
 }
 
+typedef struct {
+    capseq_slave_t *slave;
+    const char *query;
+    bool http;              /* also send the HTTP prepare request */
+    SemaphoreHandle_t done;
+} slave_prepare_job_t;
+
+static void slave_prepare_task(void *arg)
+{
+    slave_prepare_job_t *job = (slave_prepare_job_t *)arg;
+    capseq_slave_t *slave = job->slave;
+    if (capseq_slave_resolve(slave) == ESP_OK) {
+        slave->state = CAPSEQ_SLAVE_RESOLVED;
+        esp_err_t err = job->http ? send_slave_prepare(slave, job->query) : ESP_OK;
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Slave %s prepare failed: %s", slave->id, esp_err_to_name(err));
+        }
+    }
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+/*
+ * Resolves (and, with http set, prepares) every registered slave
+ * concurrently, one short-lived task each, so the phase takes as long as the
+ * slowest slave. Both the resolver and the HTTP client time out on their own,
+ * so the wait is bounded.
+ */
+static int slaves_prepare_all(const char *query, bool http)
+{
+#if CONFIG_CAPSEQ_SLAVE_MDNS_BROWSE
+    capseq_registry_browse();
+#endif
+    slave_prepare_job_t jobs[CONFIG_CAPSEQ_MAX_SLAVES];
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(CONFIG_CAPSEQ_MAX_SLAVES, 0);
+    if (!done) {
+        return 0;
+    }
+    int started = 0;
+    for (int i = 0; i < s_slave_count; ++i) {
+        s_slaves[i].state = CAPSEQ_SLAVE_OFFLINE;
+        memset(&s_slaves[i].metrics, 0, sizeof(s_slaves[i].metrics));
+        jobs[i] = (slave_prepare_job_t){
+            .slave = &s_slaves[i],
+            .query = query,
+            .http = http,
+            .done = done,
+        };
+        if (xTaskCreatePinnedToCore(slave_prepare_task, "slave_prep", SLAVE_PREPARE_TASK_STACK_SIZE,
+                                    &jobs[i], CAPTURE_TASK_PRIORITY, NULL, NET_TASK_CORE) == pdPASS) {
+            started++;
+        } else {
+            ESP_LOGW(TAG, "Slave %s prepare task create failed", s_slaves[i].id);
+        }
+    }
+    for (int i = 0; i < started; ++i) {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    vSemaphoreDelete(done);
+    return capseq_slaves_in_state(CAPSEQ_SLAVE_RESOLVED);
+}
+
 static esp_err_t send_slave_stream_cmd(const char *path)
 {
     if (!path) {
         return ESP_ERR_INVALID_ARG;
     }
-    char url[128];
-    snprintf(url, sizeof(url), "http://slavecam-%s.local%s", CONFIG_SLAVE_ID, path);
+    esp_err_t result = ESP_OK;
+    for (int i = 0; i < s_slave_count; ++i) {
+        char url[128];
+        snprintf(url, sizeof(url), "http://slavecam-%s.local%s", s_slaves[i].id, path);
+
+        esp_http_client_config_t cfg = {
+            .url = url,
+            .timeout_ms = 1000,
+        };
+        esp_http_client_handle_t client = esp_http_client_init(&cfg);
+        esp_http_client_set_method(client, HTTP_METHOD_GET);
+        esp_err_t err = esp_http_client_perform(client);
+        esp_http_client_cleanup(client);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Slave %s %s failed: %s", s_slaves[i].id, path, esp_err_to_name(err));
+            result = err;
+        }
+    }
+    return result;
+}
 
-    esp_http_client_config_t cfg = {
-        .url = url,
-        .timeout_ms = 1000,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&cfg);
-    esp_http_client_set_method(client, HTTP_METHOD_GET);
-    esp_err_t err = esp_http_client_perform(client);
-    esp_http_client_cleanup(client);
-    return err;
+static void capseq_wait_until(int64_t target_us)
+{
+    while (true) {
+        int64_t remaining_us = target_us - esp_timer_get_time();
+        if (remaining_us <= 0) {
+            break;
+        }
+        if (remaining_us > 2000) {
+            vTaskDelay(pdMS_TO_TICKS(remaining_us / 1000));
+        } else {
+            esp_rom_delay_us(100);
+        }
+    }
+}
+
+static const char *capseq_slot_action_name(capseq_slot_action_t action)
+{
+    switch (action) {
+    case CAPSEQ_SLOT_ON_TIME: return "ok";
+    case CAPSEQ_SLOT_DELAYED: return "delayed";
+    case CAPSEQ_SLOT_DROPPED: return "dropped";
+    default: return "free";
+    }
+}
+
+static int64_t capseq_fb_time_us(const camera_fb_t *fb)
+{
+    return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+/*
+ * Grabs the frame for one schedule slot. A frame the driver buffered before
+ * the slot is returned and re-grabbed (a delayed grab); a slot we reach more
+ * than half an interval late is skipped entirely (a dropped frame), so slot
+ * indices stay paired across cameras.
+ */
+static camera_fb_t *capseq_grab_slot(int64_t slot_us, int64_t interval_us,
+                                     capseq_slot_action_t *action, int64_t *phase_err_us)
+{
+    *phase_err_us = esp_timer_get_time() - slot_us;
+    if (*phase_err_us > interval_us / 2) {
+        *action = CAPSEQ_SLOT_DROPPED;
+        return NULL;
+    }
+    capseq_wait_until(slot_us);
+
+    *action = CAPSEQ_SLOT_ON_TIME;
+    for (int attempt = 0; attempt <= CAPSEQ_SLOT_MAX_REGRAB; ++attempt) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            return NULL;
+        }
+        *phase_err_us = capseq_fb_time_us(fb) - slot_us;
+        if (*phase_err_us >= 0 || attempt == CAPSEQ_SLOT_MAX_REGRAB) {
+            return fb;
+        }
+        esp_camera_fb_return(fb);
+        *action = CAPSEQ_SLOT_DELAYED;
+    }
+    return NULL;
+}
+
+/* Per-session sidecar next to the frames. frame_us + offset_us is the frame
+ * time in the master clock, which is what pairs frames across cameras. */
+static FILE *capseq_meta_open(const char *session, const char *role, const char *id,
+                              int64_t interval_us, int resync_every)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.csv", CAPTURE_DIR, session);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        ESP_LOGW(TAG, "Failed to open %s", path);
+        return NULL;
+    }
+    fprintf(file, "# session=%s role=%s id=%s interval_us=%lld resync_every=%d\n",
+            session, role, id, (long long)interval_us, resync_every);
+    fprintf(file, "slot,frame_us,phase_err_us,offset_us,action,file\n");
+    return file;
+}
+
+static void capseq_meta_write(FILE *file, int slot, int64_t frame_us, int64_t phase_err_us,
+                              int64_t offset_us, capseq_slot_action_t action, const char *name)
+{
+    if (!file) {
+        return;
+    }
+    fprintf(file, "%d,%lld,%lld,%lld,%s,%s\n", slot, (long long)frame_us, (long long)phase_err_us,
+            (long long)offset_us, capseq_slot_action_name(action), name ? name : "");
+}
+
+static void capture_job_progress(capture_request_t *req, int captured, int written, int dropped,
+                                 int errors, size_t bytes)
+{
+    portENTER_CRITICAL(&s_job_lock);
+    req->progress.frames_captured += captured;
+    req->progress.frames_written += written;
+    req->progress.frames_dropped += dropped;
+    req->progress.errors += errors;
+    req->progress.bytes_written += bytes;
+    portEXIT_CRITICAL(&s_job_lock);
+}
+
+static void capture_job_set_state(capture_request_t *req, capture_job_state_t state)
+{
+    portENTER_CRITICAL(&s_job_lock);
+    req->progress.state = state;
+    if (state == CAPTURE_JOB_RUNNING) {
+        req->progress.started_us = esp_timer_get_time();
+    } else if (state == CAPTURE_JOB_DONE || state == CAPTURE_JOB_FAILED) {
+        req->progress.finished_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&s_job_lock);
+}
+
+/* Takes a free slot or recycles the oldest finished job; NULL when every
+ * slot is still queued or running, or while a collect uses the slaves and
+ * the SD card (*collecting is then set). */
+static capture_request_t *capture_job_alloc(bool *collecting)
+{
+    capture_request_t *job = NULL;
+    portENTER_CRITICAL(&s_job_lock);
+    *collecting = collect_active_locked();
+    for (int i = 0; i < CAPTURE_JOB_HISTORY && !*collecting; ++i) {
+        capture_request_t *cand = &s_capture_jobs[i];
+        capture_job_state_t state = cand->progress.state;
+        if (state == CAPTURE_JOB_QUEUED || state == CAPTURE_JOB_RUNNING) {
+            continue;
+        }
+        if (!job || state == CAPTURE_JOB_FREE || cand->progress.id < job->progress.id) {
+            job = cand;
+            if (state == CAPTURE_JOB_FREE) {
+                break;
+            }
+        }
+    }
+    if (job) {
+        memset(job, 0, sizeof(*job));
+        job->progress.id = s_next_job_id++;
+        job->progress.state = CAPTURE_JOB_QUEUED;
+        job->progress.queued_us = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&s_job_lock);
+    return job;
+}
+
+static void capture_job_release(capture_request_t *job)
+{
+    portENTER_CRITICAL(&s_job_lock);
+    job->progress.state = CAPTURE_JOB_FREE;
+    portEXIT_CRITICAL(&s_job_lock);
+}
+
+static bool capture_job_snapshot(uint32_t id, capture_request_t *out)
+{
+    bool found = false;
+    portENTER_CRITICAL(&s_job_lock);
+    for (int i = 0; i < CAPTURE_JOB_HISTORY; ++i) {
+        if (s_capture_jobs[i].progress.state != CAPTURE_JOB_FREE && s_capture_jobs[i].progress.id == id) {
+            *out = s_capture_jobs[i];
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_job_lock);
+    return found;
+}
+
+/* False when a slave missed the phase and missing slaves are not allowed. */
+static bool capseq_phase_check(capture_request_t *req, capseq_slave_state_t state, const char *what)
+{
+    const capseq_slave_t *missing = capseq_first_slave_below(state);
+    if (!missing) {
+        return true;
+    }
+    ESP_LOGW(TAG, "Slave %s %s (%d/%d ok)", missing->id, what,
+             capseq_slaves_in_state(state), s_slave_count);
+    if (CAPSEQ_SLAVE_MISSING_OK) {
+        return true;
+    }
+    snprintf(req->err_msg, sizeof(req->err_msg), "slave %s %s", missing->id, what);
+    return false;
 }
 
 static esp_err_t run_capture_sequence(capture_request_t *req)
@@ -916,16 +3212,29 @@ static esp_err_t run_capture_sequence(capture_request_t *req)
     }
 
     req->err_msg[0] = '\0';
-    stop_stream_and_wait(2000);
+    pause_stream_and_wait(2000);
 
-    esp_err_t err = send_slave_prepare(req->query[0] ? req->query : NULL);
-    if (err != ESP_OK) {
-        ESP_LOGW(TAG, "Slave prepare failed: %s", esp_err_to_name(err));
+    bool prepare_acked = false;
+    #ifndef IGNORE_SLAVE
+    udp_slave_ctx_t udp = { .sock = -1 };
+    if (s_slave_count > 0) {
+        udp_open_slave_socket(&udp, 50);
+    }
+    #if CONFIG_CAPSEQ_PREPARE_OVER_UDP
+    int resolved = slaves_prepare_all(NULL, false);
+    if (udp.sock >= 0 && resolved > 0) {
+        prepare_acked = udp_slaves_prepare(&udp, req) == resolved;
     }
+    #else
+    slaves_prepare_all(req->query[0] ? req->query : NULL, true);
+    #endif
+    #endif
 
-    vTaskDelay(pdMS_TO_TICKS(CONFIG_CAPSEQ_SLAVE_PREPARE_DELAY_MS));
+    /* An acknowledged PREPARE is tracked by READY polling instead. */
+    if (!prepare_acked) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_CAPSEQ_SLAVE_PREPARE_DELAY_MS));
+    }
 
-    bool need_reinit = true;
     esp_camera_deinit();
     gpio_uninstall_isr_service();
     camera_power_cycle();
@@ -934,6 +3243,9 @@ static esp_err_t run_capture_sequence(capture_request_t *req)
     if (init_err != ESP_OK) {
         ESP_LOGW(TAG, "Capture camera init failed: %s", esp_err_to_name(init_err));
         snprintf(req->err_msg, sizeof(req->err_msg), "camera init failed");
+        #ifndef IGNORE_SLAVE
+        udp_close_slave_socket(&udp);
+        #endif
         return ESP_FAIL;
     }
 
@@ -946,79 +3258,67 @@ static esp_err_t run_capture_sequence(capture_request_t *req)
         }
     }
 
-    bool slave_ready = true;
+    int64_t start_time_us = esp_timer_get_time();
     #ifndef IGNORE_SLAVE
-    esp_err_t sync_err = udp_slave_wait_ready(CONFIG_CAPSEQ_SLAVE_READY_TIMEOUT_MS,
-                                               CONFIG_CAPSEQ_SLAVE_READY_POLL_MS);
-    if (sync_err != ESP_OK) {
-        ESP_LOGW(TAG, "Slave ready check failed");
-        if (!CAPSEQ_SLAVE_MISSING_OK) {
-            snprintf(req->err_msg, sizeof(req->err_msg), "slave not ready");
-            return ESP_FAIL;
-        }
-        slave_ready = false;
+    if (udp.sock >= 0) {
+        udp_slaves_wait_ready(&udp, CONFIG_CAPSEQ_SLAVE_READY_TIMEOUT_MS,
+                              CONFIG_CAPSEQ_SLAVE_READY_POLL_MS);
     }
-
-    capseq_sync_metrics_t metrics = {0};
-    
-    if (slave_ready) {
-        sync_err = udp_sync_metrics(&metrics);
-        if (sync_err != ESP_OK) {
-            ESP_LOGW(TAG, "UDP sync failed");
-            if (!CAPSEQ_SLAVE_MISSING_OK) {
-                snprintf(req->err_msg, sizeof(req->err_msg), "udp sync failed");
-                return ESP_FAIL;
-            }
-            slave_ready = false;
-        }
+    if (!capseq_phase_check(req, CAPSEQ_SLAVE_READY, "not ready")) {
+        udp_close_slave_socket(&udp);
+        return ESP_FAIL;
+    }
+    if (udp.sock >= 0) {
+        udp_slaves_sync(&udp);
+    }
+    if (!capseq_phase_check(req, CAPSEQ_SLAVE_SYNCED, "udp sync failed")) {
+        udp_close_slave_socket(&udp);
+        return ESP_FAIL;
     }
-    
+
     int64_t safety_overhead_us = (req->cpu_time_to_start_us > 0)
                                      ? req->cpu_time_to_start_us
                                      : (int64_t)CONFIG_CAPSEQ_SYNC_SAFETY_MS * 1000;
-    int64_t trip_time_us = slave_ready ? metrics.trip_time_us : 0;
-    int64_t cpu_disparity_us = slave_ready ? metrics.cpu_disparity_us : 0;
-    int64_t slave_start_delay_us = safety_overhead_us;
-    int64_t master_start_delay_us = safety_overhead_us + trip_time_us + cpu_disparity_us;
-    if (master_start_delay_us < 0) {
-        master_start_delay_us = 0;
-    }
-    if (slave_ready) {
-        ESP_LOGI(TAG, "Sync: trip=%lldus disparity=%lldus", (long long)trip_time_us,
-                 (long long)cpu_disparity_us);
-        sync_err = udp_slave_start_with_retry(slave_start_delay_us);
-        if (sync_err != ESP_OK) {
-            ESP_LOGW(TAG, "Slave start notify failed");
-            if (!CAPSEQ_SLAVE_MISSING_OK) {
-                snprintf(req->err_msg, sizeof(req->err_msg), "slave start failed");
-                return ESP_FAIL;
-            }
-        }
+    /* Every slave is scheduled against this one master timestamp; the margin
+     * only has to cover the START round trips, not per-slave trip times. */
+    start_time_us = esp_timer_get_time() + safety_overhead_us;
+    if (udp.sock >= 0) {
+        udp_slaves_start(&udp, start_time_us);
     }
-    #endif
-    int64_t start_time_us = esp_timer_get_time();
-    #ifndef IGNORE_SLAVE
-    start_time_us+= master_start_delay_us;
-    #endif
-    while (true) {
-        int64_t now_us = esp_timer_get_time();
-        int64_t remaining_us = start_time_us - now_us;
-        if (remaining_us <= 0) {
-            break;
-        }
-        if (remaining_us > 2000) {
-            vTaskDelay(pdMS_TO_TICKS(remaining_us / 1000));
-        } else {
-            esp_rom_delay_us(100);
-        }
+    if (!capseq_phase_check(req, CAPSEQ_SLAVE_STARTED, "start failed")) {
+        udp_close_slave_socket(&udp);
+        return ESP_FAIL;
     }
+    #endif
+    capseq_wait_until(start_time_us);
 
+    FILE *meta = capseq_meta_open(req->session, "master", CONFIG_MASTER_ID, req->interval_us,
+                                  req->resync_every);
     int64_t prev_timestamp_ms = -1;
     for (int i = 0; i < req->frame_count; ++i) {
-
-        camera_fb_t *fb = esp_camera_fb_get();
+        capseq_slot_action_t action = CAPSEQ_SLOT_FREE;
+        int64_t phase_err_us = 0;
+        camera_fb_t *fb = NULL;
+        if (req->interval_us > 0) {
+            #ifndef IGNORE_SLAVE
+            if (udp.sock >= 0 && i % req->resync_every == 0) {
+                udp_slaves_beacon(&udp, i);
+            }
+            #endif
+            fb = capseq_grab_slot(start_time_us + i * req->interval_us, req->interval_us,
+                                  &action, &phase_err_us);
+        } else {
+            fb = esp_camera_fb_get();
+        }
         if (!fb) {
-            ESP_LOGW(TAG, "Frame capture failed (%d)", i);
+            if (action == CAPSEQ_SLOT_DROPPED) {
+                ESP_LOGW(TAG, "Slot %d dropped (%lldus late)", i, (long long)phase_err_us);
+                capseq_meta_write(meta, i, 0, phase_err_us, 0, action, NULL);
+                capture_job_progress(req, 0, 0, 1, 0, 0);
+            } else {
+                ESP_LOGW(TAG, "Frame capture failed (%d)", i);
+                capture_job_progress(req, 0, 0, 0, 1, 0);
+            }
             continue;
         }
 
@@ -1037,25 +3337,30 @@ static esp_err_t run_capture_sequence(capture_request_t *req)
         if (!file) {
             ESP_LOGW(TAG, "Failed to open %s", path);
             esp_camera_fb_return(fb);
+            capture_job_progress(req, 1, 0, 0, 1, 0);
             continue;
         }
-        fwrite(fb->buf, 1, fb->len, file);
-        fclose(file);
+        bool written = fwrite(fb->buf, 1, fb->len, file) == fb->len;
+        written = (fclose(file) == 0) && written;
+        if (written) {
+            capture_job_progress(req, 1, 1, 0, 0, fb->len);
+        } else {
+            ESP_LOGW(TAG, "Failed to write %s", path);
+            capture_job_progress(req, 1, 0, 0, 1, 0);
+        }
 
+        capseq_meta_write(meta, i, capseq_fb_time_us(fb), phase_err_us, 0, action,
+                          path + strlen(CAPTURE_DIR) + 1);
+        stream_preview_offer(fb, i);
         esp_camera_fb_return(fb);
         prev_timestamp_ms = timestamp_ms;
     }
-
-    if (need_reinit) {
-        esp_camera_deinit();
-        gpio_uninstall_isr_service();
-        camera_power_cycle();
-        vTaskDelay(pdMS_TO_TICKS(200));
-        esp_err_t init_err = init_camera();
-        if (init_err != ESP_OK) {
-            ESP_LOGW(TAG, "Restore camera init failed: %s", esp_err_to_name(init_err));
-        }
+    if (meta) {
+        fclose(meta);
     }
+    #ifndef IGNORE_SLAVE
+    udp_close_slave_socket(&udp);
+    #endif
 
     return ESP_OK;
 }
@@ -1066,17 +3371,17 @@ static void capture_task(void *arg)
     capture_request_t *req = NULL;
     for (;;) {
         if (xQueueReceive(s_capture_queue, &req, portMAX_DELAY) == pdTRUE && req) {
+            capture_job_set_state(req, CAPTURE_JOB_RUNNING);
             req->result = run_capture_sequence(req);
-            if (req->done) {
-                xSemaphoreGive(req->done);
-            }
+            restore_stream_camera_and_resume();
+            capture_job_set_state(req, (req->result == ESP_OK) ? CAPTURE_JOB_DONE : CAPTURE_JOB_FAILED);
         }
     }
 }
 
 static esp_err_t init_capture_task(void)
 {
-    s_capture_queue = xQueueCreate(2, sizeof(capture_request_t *));
+    s_capture_queue = xQueueCreate(CAPTURE_QUEUE_LEN, sizeof(capture_request_t *));
     if (!s_capture_queue) {
         return ESP_ERR_NO_MEM;
     }
@@ -1106,6 +3411,8 @@ static esp_err_t capture_handler(httpd_req_t *req)
     framesize_t fs = DEFAULT_FRAME_SIZE;
     pixformat_t fmt = DEFAULT_PIXEL_FORMAT;
     int64_t cpu_time_to_start_ms = -1;
+    int sync_interval_ms = 0;
+    int resync_every = CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES;
 
     if (httpd_query_key_value(query, "session", session, sizeof(session)) != ESP_OK) {
         strncpy(session, "session", sizeof(session) - 1);
@@ -1125,21 +3432,22 @@ static esp_err_t capture_handler(httpd_req_t *req)
     if (httpd_query_key_value(query, "cpu_time_to_start", value, sizeof(value)) == ESP_OK) {
         cpu_time_to_start_ms = atoll(value);
     }
+    if (httpd_query_key_value(query, "sync_interval_ms", value, sizeof(value)) == ESP_OK) {
+        sync_interval_ms = atoi(value);
+    }
+    if (httpd_query_key_value(query, "resync_every", value, sizeof(value)) == ESP_OK) {
+        resync_every = atoi(value);
+    }
 
     if (!s_capture_queue) {
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "capture task not ready");
         return ESP_FAIL;
     }
 
-    capture_request_t *cap = calloc(1, sizeof(*cap));
+    bool collecting = false;
+    capture_request_t *cap = capture_job_alloc(&collecting);
     if (!cap) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no mem");
-        return ESP_FAIL;
-    }
-    cap->done = xSemaphoreCreateBinary();
-    if (!cap->done) {
-        free(cap);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no mem");
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT, collecting ? "collect busy" : "capture busy");
         return ESP_FAIL;
     }
 
@@ -1151,32 +3459,550 @@ static esp_err_t capture_handler(httpd_req_t *req)
     if (cpu_time_to_start_ms > 0) {
         cap->cpu_time_to_start_us = cpu_time_to_start_ms * 1000;
     }
+    cap->interval_us = (sync_interval_ms > 0) ? (int64_t)sync_interval_ms * 1000 : 0;
+    cap->resync_every = (resync_every > 0) ? resync_every : CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES;
 
-    if (xQueueSend(s_capture_queue, &cap, pdMS_TO_TICKS(1000)) != pdTRUE) {
-        vSemaphoreDelete(cap->done);
-        free(cap);
+    if (xQueueSend(s_capture_queue, &cap, 0) != pdTRUE) {
+        capture_job_release(cap);
         httpd_resp_send_err(req, HTTPD_409_CONFLICT, "capture busy");
         return ESP_FAIL;
     }
 
-    if (xSemaphoreTake(cap->done, portMAX_DELAY) != pdTRUE) {
-        vSemaphoreDelete(cap->done);
-        free(cap);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "capture timeout");
+    /* The sequence runs on the capture task; the client polls for progress. */
+    char response[96];
+    snprintf(response, sizeof(response), "{\"job\":%" PRIu32 ",\"status\":\"/api/capture/%" PRIu32 "\"}",
+             cap->progress.id, cap->progress.id);
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+static const char *capture_job_state_name(capture_job_state_t state)
+{
+    switch (state) {
+    case CAPTURE_JOB_QUEUED: return "queued";
+    case CAPTURE_JOB_RUNNING: return "running";
+    case CAPTURE_JOB_DONE: return "done";
+    case CAPTURE_JOB_FAILED: return "failed";
+    default: return "unknown";
+    }
+}
+
+static esp_err_t capture_status_handler(httpd_req_t *req)
+{
+    const char *id_str = req->uri + strlen("/api/capture/");
+    char *end = NULL;
+    uint32_t id = (uint32_t)strtoul(id_str, &end, 10);
+    if (end == id_str || (*end != '\0' && *end != '?')) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid job id");
+        return ESP_FAIL;
+    }
+
+    capture_request_t job;
+    if (!capture_job_snapshot(id, &job)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "unknown job");
+        return ESP_FAIL;
+    }
+
+    const capture_progress_t *p = &job.progress;
+    int64_t end_us = p->finished_us ? p->finished_us : esp_timer_get_time();
+    int64_t elapsed_ms = p->started_us ? (end_us - p->started_us) / 1000 : 0;
+    const char *error = (p->state == CAPTURE_JOB_FAILED)
+                            ? (job.err_msg[0] ? job.err_msg : "capture failed")
+                            : "";
+    char response[384];
+    snprintf(response, sizeof(response),
+             "{\"job\":%" PRIu32 ",\"state\":\"%s\",\"session\":\"%s\",\"frame_count\":%d,"
+             "\"frames_captured\":%d,\"frames_written\":%d,\"frames_dropped\":%d,"
+             "\"bytes_written\":%llu,\"errors\":%d,\"elapsed_ms\":%lld,\"error\":\"%s\"}",
+             p->id, capture_job_state_name(p->state), job.session, job.frame_count,
+             p->frames_captured, p->frames_written, p->frames_dropped,
+             (unsigned long long)p->bytes_written, p->errors, (long long)elapsed_ms, error);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/*
+ * Paired dataset collection: after a capture, GET /api/collect?session=<s>
+ * pulls every slave's copy of the session into CAPTURE_DIR/slave-<id>/ and
+ * writes <session>.pairs.csv matching master and slave frames by their
+ * aligned master-clock timestamps. The fetch side fills PSRAM blocks straight
+ * from the socket and hands them to a writer task, so network reads and
+ * eMMC writes overlap.
+ */
+typedef struct {
+    uint8_t *data;          /* NULL: flush marker */
+    size_t len;
+    FILE *file;
+    bool close;             /* last block of the file */
+} collect_block_t;
+
+typedef struct {
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    SemaphoreHandle_t flushed;
+    volatile int write_errors;
+} collect_pipe_t;
+
+typedef struct {
+    char session[32];
+    capture_job_state_t state;
+    int files_total;
+    int files_done;
+    int files_skipped;
+    int pairs;
+    int errors;
+    uint64_t bytes;
+    int64_t started_us;
+    int64_t finished_us;
+    char err_msg[64];
+} collect_progress_t;
+
+static collect_progress_t s_collect;
+
+/* Caller holds s_job_lock. */
+static bool collect_active_locked(void)
+{
+    return s_collect.state == CAPTURE_JOB_QUEUED || s_collect.state == CAPTURE_JOB_RUNNING;
+}
+
+static void collect_update(int total, int done, int skipped, int errors, size_t bytes)
+{
+    portENTER_CRITICAL(&s_job_lock);
+    s_collect.files_total += total;
+    s_collect.files_done += done;
+    s_collect.files_skipped += skipped;
+    s_collect.errors += errors;
+    s_collect.bytes += bytes;
+    portEXIT_CRITICAL(&s_job_lock);
+}
+
+static void collect_writer_task(void *arg)
+{
+    collect_pipe_t *pipe = (collect_pipe_t *)arg;
+    collect_block_t block;
+    while (xQueueReceive(pipe->full_q, &block, portMAX_DELAY) == pdTRUE) {
+        if (!block.data) {
+            xSemaphoreGive(pipe->flushed);
+            continue;
+        }
+        if (block.file && block.len > 0 &&
+            fwrite(block.data, 1, block.len, block.file) != block.len) {
+            pipe->write_errors++;
+        }
+        if (block.file && block.close && fclose(block.file) != 0) {
+            pipe->write_errors++;
+        }
+        xQueueSend(pipe->free_q, &block.data, portMAX_DELAY);
+    }
+}
+
+static void collect_flush(collect_pipe_t *pipe)
+{
+    collect_block_t marker = {0};
+    xQueueSend(pipe->full_q, &marker, portMAX_DELAY);
+    xSemaphoreTake(pipe->flushed, portMAX_DELAY);
+}
+
+static esp_http_client_handle_t collect_open(const char *url, int64_t *content_length, int *status)
+{
+    esp_http_client_config_t cfg = {
+        .url = url,
+        .timeout_ms = 5000,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&cfg);
+    if (!client) {
+        return NULL;
+    }
+    if (esp_http_client_open(client, 0) != ESP_OK) {
+        esp_http_client_cleanup(client);
+        return NULL;
+    }
+    *content_length = esp_http_client_fetch_headers(client);
+    *status = esp_http_client_get_status_code(client);
+    return client;
+}
+
+/* Reads until buf is full or the body ends; returns bytes read or -1. */
+static int collect_read_block(esp_http_client_handle_t client, uint8_t *buf, size_t size)
+{
+    size_t filled = 0;
+    while (filled < size) {
+        int n = esp_http_client_read(client, (char *)buf + filled, size - filled);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    return (int)filled;
+}
+
+static esp_err_t collect_fetch_file(collect_pipe_t *pipe, const char *base_url, const char *session,
+                                    const char *dir, const char *name, size_t remote_size)
+{
+    char path[192];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    struct stat st;
+    size_t local_size = (stat(path, &st) == 0) ? (size_t)st.st_size : 0;
+    if (local_size == remote_size && remote_size > 0) {
+        collect_update(0, 0, 1, 0, 0);
+        return ESP_OK;
+    }
+    if (local_size > remote_size) {
+        local_size = 0;
+    }
+
+    char url[256];
+    snprintf(url, sizeof(url), "%s/api/session/%s/%s?offset=%u", base_url, session, name,
+             (unsigned)local_size);
+    int64_t content_length = 0;
+    int status = 0;
+    esp_http_client_handle_t client = collect_open(url, &content_length, &status);
+    if (!client) {
         return ESP_FAIL;
     }
+    if (status != (local_size ? 206 : 200)) {
+        ESP_LOGW(TAG, "Collect %s: HTTP %d", name, status);
+        esp_http_client_cleanup(client);
+        return ESP_FAIL;
+    }
+    FILE *file = fopen(path, local_size ? "ab" : "wb");
+    if (!file) {
+        ESP_LOGW(TAG, "Failed to open %s", path);
+        esp_http_client_cleanup(client);
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = ESP_OK;
+    size_t received = 0;
+    bool closed = false;
+    while (!closed) {
+        uint8_t *buf = NULL;
+        xQueueReceive(pipe->free_q, &buf, portMAX_DELAY);
+        int n = collect_read_block(client, buf, COLLECT_BLOCK_SIZE);
+        if (n < 0) {
+            err = ESP_FAIL;
+            n = 0;
+        }
+        received += n;
+        closed = (err != ESP_OK) || n < COLLECT_BLOCK_SIZE ||
+                 (content_length > 0 && received >= (size_t)content_length);
+        collect_block_t block = {
+            .data = buf,
+            .len = n,
+            .file = file,
+            .close = closed,
+        };
+        xQueueSend(pipe->full_q, &block, portMAX_DELAY);
+    }
+    esp_http_client_cleanup(client);
+    if (err == ESP_OK && local_size + received != remote_size) {
+        /* Keep the partial file; the next collect resumes from its size. */
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err == ESP_OK) {
+        collect_update(0, 1, 0, 0, received);
+    } else {
+        ESP_LOGW(TAG, "Collect %s incomplete (%u/%u bytes)", name,
+                 (unsigned)(local_size + received), (unsigned)remote_size);
+        collect_update(0, 0, 0, 0, received);
+    }
+    return err;
+}
 
-    esp_err_t result = cap->result;
-    const char *msg = cap->err_msg[0] ? cap->err_msg : "capture failed";
-    vSemaphoreDelete(cap->done);
-    free(cap);
+static esp_err_t collect_slave(collect_pipe_t *pipe, capseq_slave_t *slave, const char *session)
+{
+    if (capseq_slave_resolve(slave) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    char ip[16];
+    inet_ntop(AF_INET, &slave->addr.sin_addr, ip, sizeof(ip));
+    char base_url[32];
+    snprintf(base_url, sizeof(base_url), "http://%s", ip);
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/slave-%s", CAPTURE_DIR, slave->id);
+    if (ensure_dir(dir) != ESP_OK) {
+        return ESP_FAIL;
+    }
 
-    if (result != ESP_OK) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, msg);
+    char url[128];
+    snprintf(url, sizeof(url), "%s/api/session/%s", base_url, session);
+    int64_t content_length = 0;
+    int status = 0;
+    esp_http_client_handle_t client = collect_open(url, &content_length, &status);
+    if (!client) {
+        return ESP_FAIL;
+    }
+    size_t list_size = COLLECT_LIST_MAX;
+    char *list = (char *)alloc_io_buffer(&list_size);
+    int list_len = list ? collect_read_block(client, (uint8_t *)list, list_size - 1) : -1;
+    esp_http_client_cleanup(client);
+    if (status != 200 || list_len < 0) {
+        free(list);
         return ESP_FAIL;
     }
+    list[list_len] = '\0';
 
-    httpd_resp_sendstr(req, "OK");
+    esp_err_t result = ESP_OK;
+    char *saveptr = NULL;
+    for (char *line = strtok_r(list, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char name[96];
+        unsigned long size = 0;
+        if (sscanf(line, "%95s %lu", name, &size) != 2 || !capseq_safe_name(name)) {
+            continue;
+        }
+        collect_update(1, 0, 0, 0, 0);
+        if (collect_fetch_file(pipe, base_url, session, dir, name, size) != ESP_OK) {
+            collect_update(0, 0, 0, 1, 0);
+            result = ESP_FAIL;
+        }
+    }
+    free(list);
+    return result;
+}
+
+typedef struct {
+    int slot;
+    int64_t time_us;        /* frame time on the master clock */
+    char file[64];
+} collect_meta_row_t;
+
+/* Next captured row of a capture metadata CSV; dropped slots are skipped. */
+static bool collect_meta_next(FILE *file, collect_meta_row_t *row)
+{
+    char line[192];
+    while (fgets(line, sizeof(line), file)) {
+        long long frame_us = 0;
+        long long phase_us = 0;
+        long long offset_us = 0;
+        char action[16];
+        if (sscanf(line, "%d,%lld,%lld,%lld,%15[^,],%63s", &row->slot, &frame_us, &phase_us,
+                   &offset_us, action, row->file) == 6) {
+            row->time_us = frame_us + offset_us;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int64_t collect_meta_interval(FILE *file)
+{
+    char line[192];
+    long long interval_us = 0;
+    if (fgets(line, sizeof(line), file)) {
+        const char *p = strstr(line, "interval_us=");
+        if (p) {
+            interval_us = atoll(p + strlen("interval_us="));
+        }
+    }
+    return interval_us;
+}
+
+/*
+ * Both sides write rows in slot order, so frame times are monotonic and one
+ * pass with a single lookahead finds each master frame's nearest slave frame.
+ * With a fixed interval, matches further than half a slot apart are left
+ * unpaired instead of pairing a neighbouring frame.
+ */
+static int collect_pair_slave(FILE *out, const char *session, const capseq_slave_t *slave)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s.csv", CAPTURE_DIR, session);
+    FILE *master = fopen(path, "r");
+    snprintf(path, sizeof(path), "%s/slave-%s/%s.csv", CAPTURE_DIR, slave->id, session);
+    FILE *other = fopen(path, "r");
+    if (!master || !other) {
+        if (master) fclose(master);
+        if (other) fclose(other);
+        return 0;
+    }
+
+    int64_t interval_us = collect_meta_interval(master);
+    collect_meta_interval(other);
+    collect_meta_row_t m;
+    collect_meta_row_t cur;
+    collect_meta_row_t next;
+    bool have_cur = collect_meta_next(other, &cur);
+    bool have_next = have_cur && collect_meta_next(other, &next);
+    int pairs = 0;
+    while (collect_meta_next(master, &m)) {
+        while (have_next && llabs(next.time_us - m.time_us) <= llabs(cur.time_us - m.time_us)) {
+            cur = next;
+            have_next = collect_meta_next(other, &next);
+        }
+        int64_t skew_us = have_cur ? cur.time_us - m.time_us : 0;
+        bool matched = have_cur && (interval_us <= 0 || llabs(skew_us) <= interval_us / 2);
+        if (matched) {
+            fprintf(out, "%d,%s,%s,slave-%s/%s,%lld\n", m.slot, m.file, slave->id, slave->id,
+                    cur.file, (long long)skew_us);
+        } else {
+            fprintf(out, "%d,%s,%s,,\n", m.slot, m.file, slave->id);
+        }
+        pairs += matched;
+    }
+    fclose(master);
+    fclose(other);
+    return pairs;
+}
+
+static void collect_write_manifest(const char *session)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s.pairs.csv", CAPTURE_DIR, session);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        ESP_LOGW(TAG, "Failed to open %s", path);
+        return;
+    }
+    fprintf(out, "# session=%s master=%s\n", session, CONFIG_MASTER_ID);
+    fprintf(out, "slot,master_file,slave_id,slave_file,skew_us\n");
+    int pairs = 0;
+    for (int i = 0; i < s_slave_count; ++i) {
+        pairs += collect_pair_slave(out, session, &s_slaves[i]);
+    }
+    if (fclose(out) != 0) {
+        ESP_LOGW(TAG, "Failed to write %s", path);
+    }
+    portENTER_CRITICAL(&s_job_lock);
+    s_collect.pairs = pairs;
+    portEXIT_CRITICAL(&s_job_lock);
+    ESP_LOGI(TAG, "Session %s: %d frame pairs", session, pairs);
+}
+
+static void collect_task(void *arg)
+{
+    (void)arg;
+    char session[32];
+    portENTER_CRITICAL(&s_job_lock);
+    snprintf(session, sizeof(session), "%s", s_collect.session);
+    s_collect.state = CAPTURE_JOB_RUNNING;
+    s_collect.started_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&s_job_lock);
+
+    collect_pipe_t pipe = {
+        .free_q = xQueueCreate(COLLECT_BLOCK_COUNT, sizeof(uint8_t *)),
+        .full_q = xQueueCreate(COLLECT_BLOCK_COUNT + 1, sizeof(collect_block_t)),
+        .flushed = xSemaphoreCreateBinary(),
+    };
+    uint8_t *blocks[COLLECT_BLOCK_COUNT] = {0};
+    TaskHandle_t writer = NULL;
+    const char *err_msg = NULL;
+    bool ok = pipe.free_q && pipe.full_q && pipe.flushed;
+    for (int i = 0; ok && i < COLLECT_BLOCK_COUNT; ++i) {
+        blocks[i] = heap_caps_malloc(COLLECT_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        ok = blocks[i] != NULL;
+        if (ok) {
+            xQueueSend(pipe.free_q, &blocks[i], 0);
+        }
+    }
+    if (!ok) {
+        err_msg = "no memory";
+    } else if (xTaskCreatePinnedToCore(collect_writer_task, "collect_wr", COLLECT_TASK_STACK_SIZE,
+                                       &pipe, CAPTURE_TASK_PRIORITY, &writer,
+                                       CAPTURE_TASK_CORE) != pdPASS) {
+        err_msg = "writer task create failed";
+    } else {
+        for (int i = 0; i < s_slave_count; ++i) {
+            esp_err_t err = collect_slave(&pipe, &s_slaves[i], session);
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "Collect from slave %s failed: %s", s_slaves[i].id, esp_err_to_name(err));
+                err_msg = "slave transfer incomplete";
+            }
+        }
+        collect_flush(&pipe);
+        vTaskDelete(writer);
+        if (pipe.write_errors > 0) {
+            collect_update(0, 0, 0, pipe.write_errors, 0);
+            err_msg = "local write failed";
+        }
+        collect_write_manifest(session);
+    }
+
+    for (int i = 0; i < COLLECT_BLOCK_COUNT; ++i) {
+        free(blocks[i]);
+    }
+    if (pipe.free_q) vQueueDelete(pipe.free_q);
+    if (pipe.full_q) vQueueDelete(pipe.full_q);
+    if (pipe.flushed) vSemaphoreDelete(pipe.flushed);
+
+    portENTER_CRITICAL(&s_job_lock);
+    s_collect.state = err_msg ? CAPTURE_JOB_FAILED : CAPTURE_JOB_DONE;
+    s_collect.finished_us = esp_timer_get_time();
+    snprintf(s_collect.err_msg, sizeof(s_collect.err_msg), "%s", err_msg ? err_msg : "");
+    portEXIT_CRITICAL(&s_job_lock);
+    vTaskDelete(NULL);
+}
+
+static bool capture_job_active(void)
+{
+    bool active = false;
+    portENTER_CRITICAL(&s_job_lock);
+    for (int i = 0; i < CAPTURE_JOB_HISTORY; ++i) {
+        capture_job_state_t state = s_capture_jobs[i].progress.state;
+        if (s_capture_jobs[i].progress.id &&
+            (state == CAPTURE_JOB_QUEUED || state == CAPTURE_JOB_RUNNING)) {
+            active = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_job_lock);
+    return active;
+}
+
+static esp_err_t collect_handler(httpd_req_t *req)
+{
+    char query[96] = {0};
+    char session[32] = {0};
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "session", session, sizeof(session)) == ESP_OK) {
+        if (!capseq_safe_name(session)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid session");
+            return ESP_FAIL;
+        }
+        bool busy = capture_job_active();
+        portENTER_CRITICAL(&s_job_lock);
+        busy = busy || collect_active_locked();
+        if (!busy) {
+            memset(&s_collect, 0, sizeof(s_collect));
+            snprintf(s_collect.session, sizeof(s_collect.session), "%s", session);
+            s_collect.state = CAPTURE_JOB_QUEUED;
+        }
+        portEXIT_CRITICAL(&s_job_lock);
+        if (busy) {
+            httpd_resp_send_err(req, HTTPD_409_CONFLICT, "capture or collect busy");
+            return ESP_FAIL;
+        }
+        if (xTaskCreatePinnedToCore(collect_task, "collect", COLLECT_TASK_STACK_SIZE, NULL,
+                                    CAPTURE_TASK_PRIORITY, NULL, NET_TASK_CORE) != pdPASS) {
+            portENTER_CRITICAL(&s_job_lock);
+            s_collect.state = CAPTURE_JOB_FAILED;
+            portEXIT_CRITICAL(&s_job_lock);
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "collect task create failed");
+            return ESP_FAIL;
+        }
+        httpd_resp_set_status(req, "202 Accepted");
+    }
+
+    collect_progress_t p;
+    portENTER_CRITICAL(&s_job_lock);
+    p = s_collect;
+    portEXIT_CRITICAL(&s_job_lock);
+    int64_t end_us = p.finished_us ? p.finished_us : esp_timer_get_time();
+    int64_t elapsed_ms = p.started_us ? (end_us - p.started_us) / 1000 : 0;
+    char response[320];
+    snprintf(response, sizeof(response),
+             "{\"session\":\"%s\",\"state\":\"%s\",\"files_total\":%d,\"files_done\":%d,"
+             "\"files_skipped\":%d,\"pairs\":%d,\"bytes\":%llu,\"errors\":%d,"
+             "\"elapsed_ms\":%lld,\"error\":\"%s\"}",
+             p.session, p.session[0] ? capture_job_state_name(p.state) : "idle", p.files_total,
+             p.files_done, p.files_skipped, p.pairs, (unsigned long long)p.bytes, p.errors,
+             (long long)elapsed_ms, p.err_msg);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
 }
 
@@ -1397,8 +4223,9 @@ static esp_err_t init_mdns(void)
 static esp_err_t start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 9;
+    config.max_uri_handlers = 14;
     config.core_id = NET_TASK_CORE;
+    config.uri_match_fn = httpd_uri_match_wildcard;
 
     if (httpd_start(&s_httpd, &config) != ESP_OK) {
         return ESP_FAIL;
@@ -1416,6 +4243,12 @@ static esp_err_t start_webserver(void)
         .handler = capture_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t capture_status_uri = {
+        .uri = "/api/capture/*",
+        .method = HTTP_GET,
+        .handler = capture_status_handler,
+        .user_ctx = NULL,
+    };
     httpd_uri_t sensor_uri = {
         .uri = "/api/sensor",
         .method = HTTP_POST,
@@ -1434,19 +4267,55 @@ static esp_err_t start_webserver(void)
         .handler = stream_stop_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t snapshot_uri = {
+        .uri = "/snapshot.jpg",
+        .method = HTTP_GET,
+        .handler = snapshot_handler,
+        .user_ctx = NULL,
+    };
     httpd_uri_t status_uri = {
         .uri = "/api/status",
         .method = HTTP_GET,
         .handler = status_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t files_uri = {
+        .uri = "/api/files",
+        .method = HTTP_GET,
+        .handler = files_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t files_get_uri = {
+        .uri = "/api/files/*",
+        .method = HTTP_GET,
+        .handler = files_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t session_uri = {
+        .uri = "/api/session/*",
+        .method = HTTP_GET,
+        .handler = session_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t collect_uri = {
+        .uri = "/api/collect",
+        .method = HTTP_GET,
+        .handler = collect_handler,
+        .user_ctx = NULL,
+    };
 
     httpd_register_uri_handler(s_httpd, &home_uri);
     httpd_register_uri_handler(s_httpd, &capture_uri);
+    httpd_register_uri_handler(s_httpd, &capture_status_uri);
     httpd_register_uri_handler(s_httpd, &sensor_uri);
     httpd_register_uri_handler(s_httpd, &stream_start_uri);
     httpd_register_uri_handler(s_httpd, &stream_stop_uri);
     httpd_register_uri_handler(s_httpd, &status_uri);
+    httpd_register_uri_handler(s_httpd, &snapshot_uri);
+    httpd_register_uri_handler(s_httpd, &session_uri);
+    httpd_register_uri_handler(s_httpd, &files_uri);
+    httpd_register_uri_handler(s_httpd, &files_get_uri);
+    httpd_register_uri_handler(s_httpd, &collect_uri);
 
     return ESP_OK;
 }
@@ -1456,8 +4325,13 @@ static esp_err_t start_stream_server(void)
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = 81;
     config.ctrl_port = 32769;
-    config.max_uri_handlers = 1;
+    config.max_uri_handlers = 2;
     config.core_id = NET_TASK_CORE;
+    config.close_fn = stream_sess_close;
+
+    if (init_stream_broadcaster() != ESP_OK) {
+        return ESP_FAIL;
+    }
 
     if (httpd_start(&s_stream_httpd, &config) != ESP_OK) {
         return ESP_FAIL;
@@ -1470,7 +4344,17 @@ static esp_err_t start_stream_server(void)
         .user_ctx = NULL,
     };
 
+    httpd_uri_t ws_uri = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = stream_ws_handler,
+        .user_ctx = NULL,
+        .is_websocket = true,
+        .handle_ws_control_frames = true,
+    };
+
     httpd_register_uri_handler(s_stream_httpd, &stream_uri);
+    httpd_register_uri_handler(s_stream_httpd, &ws_uri);
     return ESP_OK;
 }
 
@@ -1506,6 +4390,7 @@ void app_main(void)
     ESP_ERROR_CHECK(mount_sdcard());
     check_heap_integrity("mount_sdcard");
     init_delay_ms(INIT_DELAY_MS);
+    ESP_ERROR_CHECK(capseq_registry_init());
     check_heap_integrity("before init_capture_task");
     ESP_ERROR_CHECK(init_capture_task());
     check_heap_integrity("init_capture_task");
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -12,6 +13,7 @@
 #include <sys/unistd.h>
 #include <sys/time.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 
 #include "esp_psram.h"
@@ -26,6 +28,7 @@
 #include "driver/gpio.h"
 #include "driver/sdmmc_host.h"
 #include "esp_camera.h"
+#include "img_converters.h"
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_http_client.h"
@@ -48,6 +51,7 @@
 #include "lwip/inet.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
+#include "capseq_files.h"
 
 #define TAG "slavecam"
 
@@ -61,12 +65,38 @@
 
 #if CONFIG_FREERTOS_UNICORE
 #define NET_TASK_CORE 0
+#define CAPTURE_TASK_CORE 0
 #else
 #define NET_TASK_CORE 0
+#define CAPTURE_TASK_CORE 1
 #endif
 
 #define UDP_TASK_STACK_SIZE 4096
 #define UDP_TASK_PRIORITY 5
+#define CAPTURE_TASK_STACK_SIZE 8192
+#define CAPTURE_TASK_PRIORITY 5
+#define STREAM_MAX_CLIENTS 4
+#define STREAM_TASK_STACK_SIZE 4096
+#define STREAM_TASK_PRIORITY 4
+#define STREAM_HEAD_MAX 256
+#define STREAM_PART_TAIL "\r\n"
+#define STREAM_CLIENT_STALL_MS 5000
+#define STREAM_SELECT_TIMEOUT_MS 10
+#define STREAM_MAX_FPS 60
+#define STREAM_WS_HEADER_VERSION 1
+#define STREAM_WS_CONTROL_MAX 125   /* payload limit of a WebSocket control frame */
+#define STREAM_PREVIEW_MAX_WIDTH 320
+#define STREAM_PREVIEW_MAX_HEIGHT 240
+#define STREAM_PREVIEW_QUALITY 40
+#define SNAPSHOT_MAX_AGE_MS 1000
+#define SNAPSHOT_WAIT_MS 1000
+#define FILE_SEND_BUF_SIZE (32 * 1024)
+#define FILE_SEND_BUF_MIN 4096
+#define FILES_PAGE_DEFAULT 100
+#define FILES_PAGE_MAX 500
+#define TAR_STREAM_BLOCK_SIZE (32 * 1024)
+#define TAR_STREAM_BLOCK_COUNT 3
+#define TAR_READER_TASK_STACK_SIZE 4096
 
 #ifndef HTTPD_409_CONFLICT
 #define HTTPD_409_CONFLICT 409
@@ -81,6 +111,24 @@
 #ifndef CONFIG_CAPSEQ_SYNC_UDP_PORT
 #define CONFIG_CAPSEQ_SYNC_UDP_PORT 65
 #endif
+#ifndef CONFIG_CAPSEQ_SYNC_GROUP_ADDR
+#define CONFIG_CAPSEQ_SYNC_GROUP_ADDR "239.255.0.65"
+#endif
+#ifndef CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES
+#define CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES 10
+#endif
+
+#ifndef CONFIG_STREAM_DEFAULT_FPS
+#define CONFIG_STREAM_DEFAULT_FPS 0
+#endif
+
+#ifndef CONFIG_STREAM_PREVIEW_EVERY_N
+#define CONFIG_STREAM_PREVIEW_EVERY_N 5
+#endif
+
+#define CAPSEQ_SLOT_MAX_REGRAB 3
+/* A beacon implying a larger disparity jump than this was queued on the way. */
+#define CAPSEQ_BEACON_MAX_STEP_US 2000
 
 #define INIT_DELAY_MS 200
 #define WIFI_POST_INIT_DELAY_MS 500
@@ -92,12 +140,92 @@ static httpd_handle_t s_stream_httpd = NULL;
 static volatile bool s_stream_enabled = false;
 static volatile bool s_stream_in_progress = false;
 static volatile bool s_stream_stop_requested = false;
-static int s_stream_fd = -1;
+static volatile bool s_stream_paused = false;
+static volatile bool s_snapshot_wanted = false;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    uint32_t seq;
+    int64_t timestamp_us;
+    uint16_t width;
+    uint16_t height;
+    pixformat_t format;
+    int refs;               /* guarded by s_frame_lock */
+} stream_frame_t;
+
+/*
+ * Metadata in front of every /ws binary message, little endian. header_len
+ * lets a decoder skip fields a newer firmware appends.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t version;        /* STREAM_WS_HEADER_VERSION */
+    uint8_t format;         /* pixformat_t of the payload */
+    uint16_t header_len;
+    uint32_t seq;
+    int64_t timestamp_us;
+    uint16_t width;
+    uint16_t height;
+    uint32_t size;          /* payload bytes after the header */
+} stream_ws_header_t;
+
+typedef struct {
+    httpd_req_t *req;       /* /stream async copy; NULL for /ws */
+    int fd;                 /* -1 while the slot is free */
+    bool ws;                /* binary WebSocket messages instead of multipart parts */
+    bool headers_sent;
+    stream_frame_t *frame;  /* part in flight; NULL while idle */
+    uint32_t last_seq;
+    char head[STREAM_HEAD_MAX];
+    size_t head_len;
+    size_t cursor;          /* bytes of head + frame + tail already sent */
+    int64_t last_progress_us;
+    uint32_t period_us;     /* 0: every frame the broadcaster publishes */
+    int64_t next_due_us;
+    int64_t last_done_us;
+    uint32_t fps_x10;       /* achieved rate, smoothed */
+    uint32_t frames_sent;
+    uint32_t frames_skipped;
+    uint32_t send_calls;    /* sendmsg() calls, including would-block ones */
+    uint64_t bytes_sent;
+    uint8_t pong[2 + STREAM_WS_CONTROL_MAX];  /* /ws: PONG queued by the httpd task */
+    size_t pong_len;        /* 0: none queued */
+    size_t pong_sent;
+} stream_client_t;
+
+static stream_client_t s_stream_clients[STREAM_MAX_CLIENTS];
+static int s_stream_client_count = 0;
+static SemaphoreHandle_t s_stream_lock = NULL;
+static TaskHandle_t s_stream_task = NULL;
+static TaskHandle_t s_stream_sender_task = NULL;
+static stream_frame_t *s_latest_frame = NULL;
+static uint32_t s_frame_seq = 0;
+static uint32_t s_stream_fps_x10 = 0;
+
+typedef struct {
+    volatile bool pending;  /* set by the capture loop, cleared by the broadcaster */
+    stream_frame_t *jpeg;   /* JPEG capture: frame copy ready to publish */
+    uint8_t *raw;           /* other formats: decimated pixels to encode */
+    size_t raw_len;
+    int width;
+    int height;
+    pixformat_t format;
+    int64_t timestamp_us;
+} stream_preview_t;
+
+static stream_preview_t s_preview;
+static portMUX_TYPE s_frame_lock = portMUX_INITIALIZER_UNLOCKED;
 static EventGroupHandle_t s_wifi_event_group;
 static const int WIFI_CONNECTED_BIT = BIT0;
 static SemaphoreHandle_t s_capture_mutex = NULL;
 static volatile bool s_capture_ready = false;
 static volatile bool s_capture_in_progress = false;
+static volatile bool s_prepare_pending = false;
+static QueueHandle_t s_capture_cmd_queue = NULL;
+/* Clock model of the running capture, refined by master beacons. */
+static portMUX_TYPE s_sync_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t s_sync_disparity_us = 0;
+static int64_t s_sync_trip_us = 0;
 
 typedef struct {
     char session[32];
@@ -105,18 +233,122 @@ typedef struct {
     int frame_count;
     framesize_t fs;
     pixformat_t fmt;
+    int64_t interval_us;    /* schedule slot period, 0 = free-run */
+    int resync_every;
     bool need_reinit;
 } slave_capture_request_t;
 
 static slave_capture_request_t s_capture_req;
 
+/*
+ * Master <-> slave sync protocol (UDP, CONFIG_CAPSEQ_SYNC_UDP_PORT).
+ * Must stay identical to the definition in app_main.c.
+ */
+#define CAPSEQ_PROTO_MAGIC 0x5143
+#define CAPSEQ_PROTO_VERSION 3
+#define CAPSEQ_START_MAX_SLAVES 16
+
+typedef enum {
+    CAPSEQ_MSG_READY = 1,
+    CAPSEQ_MSG_READY_RESP = 2,
+    CAPSEQ_MSG_PING = 3,
+    CAPSEQ_MSG_PONG = 4,
+    CAPSEQ_MSG_START = 5,
+    CAPSEQ_MSG_START_ACK = 6,
+    CAPSEQ_MSG_BEACON = 7,
+    CAPSEQ_MSG_PREPARE = 8,
+    CAPSEQ_MSG_PREPARE_ACK = 9,
+    CAPSEQ_MSG_ERROR = 0x7f,
+} capseq_msg_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint32_t seq;
+    uint32_t sender_id;
+    int32_t status;
+    int64_t origin_us;  /* requester clock at transmit */
+    int64_t recv_us;    /* responder clock at receive */
+    int64_t xmit_us;    /* responder clock at transmit */
+    int64_t arg_us;     /* START: start time in the master clock; BEACON: slot */
+} capseq_msg_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t node_id;
+    int64_t disparity_us;   /* master clock - slave clock */
+    int64_t trip_us;        /* one-way trip, lets the slave refine disparity from beacons */
+} capseq_start_entry_t;
+
+/* START is one datagram for the whole rig (multicast, or unicast on retry).
+ * Only the first `count` entries are sent. */
+typedef struct __attribute__((packed)) {
+    capseq_msg_t hdr;
+    uint8_t count;
+    capseq_start_entry_t entries[CAPSEQ_START_MAX_SLAVES];
+} capseq_start_msg_t;
+
+#define CAPSEQ_START_MSG_LEN(count) \
+    (offsetof(capseq_start_msg_t, entries) + (size_t)(count) * sizeof(capseq_start_entry_t))
+
+/* Sensor overrides in PREPARE are (key id, value) pairs; the id is the index
+ * into this table. Append only, and keep it identical on master and slave. */
+static const char *const s_capseq_sensor_keys[] = {
+    "quality", "brightness", "contrast", "saturation", "gainceiling", "colorbar",
+    "awb", "awb_gain", "wb_mode", "aec2", "ae_level", "aec_value",
+    "agc", "agc_gain", "gain_ctrl", "bpc", "wpc", "raw_gma",
+    "lenc", "hmirror", "vflip", "dcw", "special_effect", "exposure_ctrl",
+};
+#define CAPSEQ_SENSOR_KEY_COUNT (sizeof(s_capseq_sensor_keys) / sizeof(s_capseq_sensor_keys[0]))
+
+typedef struct __attribute__((packed)) {
+    uint8_t key;
+    int16_t value;
+} capseq_sensor_kv_t;
+
+/* Capture descriptor; only the first `sensor_count` overrides are sent. */
+typedef struct __attribute__((packed)) {
+    capseq_msg_t hdr;
+    char session[32];
+    uint32_t frame_count;
+    uint8_t framesize;
+    uint8_t pixformat;
+    uint16_t resync_every;
+    int64_t interval_us;
+    uint8_t sensor_count;
+    capseq_sensor_kv_t sensors[CAPSEQ_SENSOR_KEY_COUNT];
+} capseq_prepare_msg_t;
+
+#define CAPSEQ_PREPARE_MSG_LEN(count) \
+    (offsetof(capseq_prepare_msg_t, sensors) + (size_t)(count) * sizeof(capseq_sensor_kv_t))
+
+/* Work for the capture task: PREPARE carries the descriptor, START the time. */
+typedef struct {
+    uint8_t type;               /* CAPSEQ_MSG_PREPARE or CAPSEQ_MSG_START */
+    int64_t start_master_us;
+    capseq_prepare_msg_t prepare;
+} slave_capture_cmd_t;
+
+/* How a schedule slot was served; recorded in the session metadata. */
+typedef enum {
+    CAPSEQ_SLOT_FREE = 0,       /* no schedule, free-running grab */
+    CAPSEQ_SLOT_ON_TIME,
+    CAPSEQ_SLOT_DELAYED,        /* stale buffered frame discarded, re-grabbed */
+    CAPSEQ_SLOT_DROPPED,        /* reached too late, slot skipped */
+} capseq_slot_action_t;
+
 static esp_err_t init_camera(void);
 static esp_err_t init_camera_with_format(framesize_t fs, pixformat_t pf);
 static esp_err_t init_udp_sync_task(void);
 static esp_err_t prepare_slave_capture(const char *query, const char *session,
-                                       int frame_count, framesize_t fs, pixformat_t fmt);
-static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t start_delay_us);
-static bool start_slave_capture(int64_t start_delay_us);
+                                       int frame_count, framesize_t fs, pixformat_t fmt,
+                                       int64_t interval_us, int resync_every,
+                                       const capseq_sensor_kv_t *sensors, int sensor_count);
+static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t start_master_us);
+static bool start_slave_capture(int64_t start_master_us, const capseq_start_entry_t *entry);
+static int stream_clients_json(char *buf, size_t len);
+static void stream_set_enabled(bool enabled);
+static int64_t capseq_fb_time_us(const camera_fb_t *fb);
 
 static void camera_power_cycle(void)
 {
@@ -137,13 +369,16 @@ static void camera_power_cycle(void)
     vTaskDelay(pdMS_TO_TICKS(CAMERA_RESET_DELAY_MS));
 }
 
-static void stop_stream_and_wait(uint32_t timeout_ms)
+/*
+ * A capture takes the camera: the broadcaster stops grabbing, but viewers
+ * stay connected and are fed from the capture loop's preview tap until
+ * resume_stream().
+ */
+static void pause_stream_and_wait(uint32_t timeout_ms)
 {
-    s_stream_enabled = false;
-    s_stream_stop_requested = true;
-    if (s_stream_httpd != NULL && s_stream_fd >= 0) {
-        httpd_sess_trigger_close(s_stream_httpd, s_stream_fd);
-        s_stream_fd = -1;
+    s_stream_paused = true;
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
     }
     uint32_t waited_ms = 0;
     while (s_stream_in_progress && waited_ms < timeout_ms) {
@@ -152,6 +387,33 @@ static void stop_stream_and_wait(uint32_t timeout_ms)
     }
 }
 
+static void resume_stream(void)
+{
+    s_stream_paused = false;
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
+    }
+}
+
+/*
+ * Puts the camera back in its streaming mode after a prepare or capture,
+ * whichever way it ended: deinitialised, or in the capture's frame size and
+ * pixel format. The stream is only resumed once the camera is back.
+ */
+static void restore_stream_camera_and_resume(void)
+{
+    esp_camera_deinit();
+    gpio_uninstall_isr_service();
+    camera_power_cycle();
+    vTaskDelay(pdMS_TO_TICKS(500));
+    esp_err_t err = init_camera();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Restore camera init failed: %s", esp_err_to_name(err));
+        return;
+    }
+    resume_stream();
+}
+
 static void init_delay_ms(uint32_t ms)
 {
     vTaskDelay(pdMS_TO_TICKS(ms));
@@ -447,172 +709,1612 @@ static esp_err_t home_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Shared by the HTTP start/stop endpoints and the /ws control messages. */
+static void stream_set_enabled(bool enabled)
+{
+    s_stream_enabled = enabled;
+    if (!enabled) {
+        s_stream_stop_requested = true;
+    }
+    if (s_stream_task) {
+        xTaskNotifyGive(s_stream_task);
+    }
+}
+
 static esp_err_t stream_start_handler(httpd_req_t *req)
 {
-    s_stream_enabled = true;
+    stream_set_enabled(true);
     httpd_resp_sendstr(req, "OK");
     return ESP_OK;
 }
 
 static esp_err_t stream_stop_handler(httpd_req_t *req)
 {
-    s_stream_enabled = false;
-    s_stream_stop_requested = true;
-    if (s_stream_httpd != NULL && s_stream_fd >= 0) {
-        httpd_sess_trigger_close(s_stream_httpd, s_stream_fd);
-        s_stream_fd = -1;
+    stream_set_enabled(false);
+    httpd_resp_sendstr(req, "OK");
+    return ESP_OK;
+}
+
+static esp_err_t status_handler(httpd_req_t *req)
+{
+    int64_t uptime_ms = esp_timer_get_time() / 1000;
+    uint32_t free_heap = esp_get_free_heap_size();
+    bool capture_ready = s_capture_ready;
+    bool capture_active = s_capture_in_progress;
+    char response[1024];
+    int used = snprintf(response, sizeof(response),
+                        "{\"stream_enabled\":%s,\"stream_active\":%s,\"stream_clients\":%d,"
+                        "\"capture_ready\":%s,\"capture_active\":%s,"
+                        "\"uptime_ms\":%lld,\"free_heap\":%" PRIu32 ",\"slave_id\":\"%s\"",
+                        s_stream_enabled ? "true" : "false",
+                        s_stream_in_progress ? "true" : "false",
+                        s_stream_client_count,
+                        capture_ready ? "true" : "false",
+                        capture_active ? "true" : "false",
+                        uptime_ms,
+                        free_heap,
+                        CONFIG_SLAVE_ID);
+    used += stream_clients_json(response + used, sizeof(response) - used - 1);
+    snprintf(response + used, sizeof(response) - used, "}");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+}
+
+/*
+ * MJPEG fan-out: the broadcaster task grabs each frame once, copies it out of
+ * the driver buffer into a reference-counted PSRAM frame and publishes it as
+ * the latest frame. The sender task drives every /stream client's socket
+ * without blocking: each client has a cursor into the part it is sending and,
+ * once that part is out, jumps to whatever frame is newest, counting the ones
+ * it skipped. A slow viewer therefore only lowers its own frame rate and
+ * never holds a camera driver buffer. Clients are async copies of their
+ * requests (httpd_req_async_handler_begin), so the stream server's worker is
+ * free again as soon as a viewer subscribes.
+ */
+static void stream_frame_ref(stream_frame_t *frame)
+{
+    portENTER_CRITICAL(&s_frame_lock);
+    frame->refs++;
+    portEXIT_CRITICAL(&s_frame_lock);
+}
+
+static void stream_frame_unref(stream_frame_t *frame)
+{
+    if (!frame) {
+        return;
+    }
+    portENTER_CRITICAL(&s_frame_lock);
+    bool last = --frame->refs == 0;
+    portEXIT_CRITICAL(&s_frame_lock);
+    if (last) {
+        free(frame->buf);
+        free(frame);
+    }
+}
+
+/* Returns a reference to the latest published frame, or NULL. */
+static stream_frame_t *stream_frame_latest(void)
+{
+    portENTER_CRITICAL(&s_frame_lock);
+    stream_frame_t *frame = s_latest_frame;
+    if (frame) {
+        frame->refs++;
+    }
+    portEXIT_CRITICAL(&s_frame_lock);
+    return frame;
+}
+
+static stream_frame_t *stream_frame_from_fb(const camera_fb_t *fb)
+{
+    stream_frame_t *frame = calloc(1, sizeof(*frame));
+    if (!frame) {
+        return NULL;
+    }
+    frame->buf = heap_caps_malloc(fb->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!frame->buf) {
+        free(frame);
+        return NULL;
+    }
+    memcpy(frame->buf, fb->buf, fb->len);
+    frame->len = fb->len;
+    frame->timestamp_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->format = fb->format;
+    frame->refs = 1;
+    return frame;
+}
+
+/* Makes frame the latest one; takes over the caller's reference. */
+static void stream_frame_publish(stream_frame_t *frame)
+{
+    portENTER_CRITICAL(&s_frame_lock);
+    frame->seq = ++s_frame_seq;
+    stream_frame_t *old = s_latest_frame;
+    s_latest_frame = frame;
+    portEXIT_CRITICAL(&s_frame_lock);
+    stream_frame_unref(old);
+    if (s_stream_sender_task) {
+        xTaskNotifyGive(s_stream_sender_task);
+    }
+}
+
+static void stream_client_release(stream_client_t *client)
+{
+    stream_frame_unref(client->frame);
+    ESP_LOGI(TAG, "Stream client %d left: %" PRIu32 " frames sent, %" PRIu32 " skipped, %" PRIu32
+             " send calls", client->fd, client->frames_sent, client->frames_skipped, client->send_calls);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+    s_stream_client_count--;
+}
+
+static void stream_client_drop(stream_client_t *client)
+{
+    if (client->req) {
+        httpd_req_async_handler_complete(client->req);
+    }
+    if (s_stream_httpd) {
+        httpd_sess_trigger_close(s_stream_httpd, client->fd);
+    }
+    stream_client_release(client);
+}
+
+/* Unmasked binary WebSocket frame header plus stream_ws_header_t. */
+static size_t stream_ws_head(char *head, const stream_frame_t *frame)
+{
+    stream_ws_header_t meta = {
+        .version = STREAM_WS_HEADER_VERSION,
+        .format = frame->format,
+        .header_len = sizeof(meta),
+        .seq = frame->seq,
+        .timestamp_us = frame->timestamp_us,
+        .width = frame->width,
+        .height = frame->height,
+        .size = frame->len,
+    };
+    uint64_t payload = sizeof(meta) + frame->len;
+    uint8_t *p = (uint8_t *)head;
+    size_t len = 0;
+    p[len++] = 0x82;        /* FIN, binary */
+    if (payload < 126) {
+        p[len++] = (uint8_t)payload;
+    } else if (payload <= 0xFFFF) {
+        p[len++] = 126;
+        p[len++] = (uint8_t)(payload >> 8);
+        p[len++] = (uint8_t)payload;
+    } else {
+        p[len++] = 127;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            p[len++] = (uint8_t)(payload >> shift);
+        }
+    }
+    memcpy(p + len, &meta, sizeof(meta));
+    return len + sizeof(meta);
+}
+
+static void stream_client_part_head(stream_client_t *client, const stream_frame_t *frame)
+{
+    char part[96];
+    int part_len = snprintf(part, sizeof(part),
+                            "--" STREAM_BOUNDARY "\r\n"
+                            "Content-Type: image/jpeg\r\n"
+                            "Content-Length: %u\r\n\r\n",
+                            (unsigned)frame->len);
+    int len = 0;
+    if (!client->headers_sent) {
+        len = snprintf(client->head, sizeof(client->head),
+                       "HTTP/1.1 200 OK\r\nContent-Type: " STREAM_CONTENT_TYPE "\r\n"
+                       "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+        client->headers_sent = true;
+    }
+    memcpy(client->head + len, part, part_len);
+    client->head_len = len + part_len;
+}
+
+/*
+ * Lays out the next part: on the first one the HTTP response header, then
+ * the multipart header. The JPEG and the trailing CRLF are sent straight from
+ * the frame and STREAM_PART_TAIL. The body is not chunk-encoded; it ends when
+ * the connection closes, which is how a multipart stream ends anyway. A /ws
+ * viewer gets a WebSocket frame header and no tail instead.
+ */
+static void stream_client_start(stream_client_t *client, stream_frame_t *frame)
+{
+    if (client->ws) {
+        client->head_len = stream_ws_head(client->head, frame);
+    } else {
+        stream_client_part_head(client, frame);
+    }
+    client->cursor = 0;
+    if (client->last_seq && frame->seq > client->last_seq + 1) {
+        client->frames_skipped += frame->seq - client->last_seq - 1;
+    }
+    client->last_seq = frame->seq;
+    stream_frame_ref(frame);
+    client->frame = frame;
+}
+
+/* Smoothed frames per second (x10) from the interval since the previous frame. */
+static uint32_t stream_fps_update(uint32_t fps_x10, int64_t *last_us, int64_t now_us)
+{
+    int64_t interval_us = now_us - *last_us;
+    bool first = *last_us == 0;
+    *last_us = now_us;
+    if (first || interval_us <= 0) {
+        return fps_x10;
+    }
+    uint32_t inst_x10 = (uint32_t)(10000000LL / interval_us);
+    return fps_x10 ? (fps_x10 * 7 + inst_x10) / 8 : inst_x10;
+}
+
+/*
+ * Sends as much of the current part as the socket takes without blocking.
+ * Header, JPEG and CRLF go out as one scatter/gather sendmsg() from the
+ * cursor on, so a frame normally costs a single lwIP write.
+ */
+static esp_err_t stream_client_pump(stream_client_t *client, int64_t now_us)
+{
+    static const char tail[] = STREAM_PART_TAIL;
+    const uint8_t *seg[3] = {(const uint8_t *)client->head, client->frame->buf, (const uint8_t *)tail};
+    size_t seg_len[3] = {client->head_len, client->frame->len, client->ws ? 0 : sizeof(tail) - 1};
+    size_t total = seg_len[0] + seg_len[1] + seg_len[2];
+    while (client->cursor < total) {
+        struct iovec iov[3];
+        int iov_count = 0;
+        size_t skip = client->cursor;
+        for (int i = 0; i < 3; ++i) {
+            if (skip >= seg_len[i]) {
+                skip -= seg_len[i];
+                continue;
+            }
+            iov[iov_count].iov_base = (void *)(seg[i] + skip);
+            iov[iov_count].iov_len = seg_len[i] - skip;
+            iov_count++;
+            skip = 0;
+        }
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iov_count,
+        };
+        ssize_t sent = sendmsg(client->fd, &msg, MSG_DONTWAIT);
+        client->send_calls++;
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+        }
+        client->cursor += sent;
+        client->bytes_sent += sent;
+        client->last_progress_us = now_us;
+    }
+    client->frames_sent++;
+    client->fps_x10 = stream_fps_update(client->fps_x10, &client->last_done_us, now_us);
+    stream_frame_unref(client->frame);
+    client->frame = NULL;
+    return ESP_OK;
+}
+
+/* Sends the queued PONG without blocking; it stays queued until all of it is out. */
+static esp_err_t stream_client_pong(stream_client_t *client)
+{
+    while (client->pong_sent < client->pong_len) {
+        ssize_t sent = send(client->fd, client->pong + client->pong_sent,
+                            client->pong_len - client->pong_sent, MSG_DONTWAIT);
+        if (sent < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+        }
+        client->pong_sent += sent;
+    }
+    client->pong_len = 0;
+    client->pong_sent = 0;
+    return ESP_OK;
+}
+
+/* Ticks covering us, rounded up and at least one, so a short wait still
+ * blocks instead of returning at once and spinning until the deadline. */
+static TickType_t stream_wait_ticks(int64_t us)
+{
+    const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+    return (TickType_t)MAX((us + tick_us - 1) / tick_us, 1);
+}
+
+static void stream_sender_task(void *arg)
+{
+    (void)arg;
+    while (true) {
+        stream_frame_t *latest = stream_frame_latest();
+        int64_t now_us = esp_timer_get_time();
+        int64_t wake_us = now_us + 100 * 1000;
+        fd_set wfds;
+        FD_ZERO(&wfds);
+        int max_fd = -1;
+
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        bool stop = !s_stream_enabled || s_stream_stop_requested;
+        for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            stream_client_t *client = &s_stream_clients[i];
+            if (client->fd < 0) {
+                continue;
+            }
+            if (stop && !client->ws) {
+                stream_client_drop(client);
+                continue;
+            }
+            /* A PONG goes out between two parts, never inside one. */
+            if (!client->frame && client->pong_len) {
+                if (stream_client_pong(client) != ESP_OK) {
+                    stream_client_drop(client);
+                    continue;
+                }
+                if (client->pong_len) {
+                    FD_SET(client->fd, &wfds);
+                    max_fd = MAX(max_fd, client->fd);
+                    continue;
+                }
+            }
+            if (!client->frame && latest && latest->seq != client->last_seq) {
+                if (now_us >= client->next_due_us) {
+                    stream_client_start(client, latest);
+                    /* Deadline pacing: the next part is due one period after
+                     * this one was, so send time does not stretch the period;
+                     * when already behind, restart from now and let the
+                     * frames in between go instead of bunching them up. */
+                    client->next_due_us = MAX(client->next_due_us + client->period_us, now_us);
+                } else {
+                    wake_us = MIN(wake_us, client->next_due_us);
+                }
+            }
+            if (client->frame && stream_client_pump(client, now_us) != ESP_OK) {
+                stream_client_drop(client);
+                continue;
+            }
+            if (client->frame) {
+                if (now_us - client->last_progress_us > (int64_t)STREAM_CLIENT_STALL_MS * 1000) {
+                    ESP_LOGW(TAG, "Stream client %d stalled", client->fd);
+                    stream_client_drop(client);
+                    continue;
+                }
+                FD_SET(client->fd, &wfds);
+                max_fd = MAX(max_fd, client->fd);
+            }
+        }
+        if (stop) {
+            s_stream_stop_requested = false;
+        }
+        xSemaphoreGive(s_stream_lock);
+        stream_frame_unref(latest);
+
+        if (max_fd >= 0) {
+            /* Some client is mid-part: come back when a socket drains. New
+             * frames for idle clients wait at most one select timeout. */
+            struct timeval tv = {.tv_sec = 0, .tv_usec = STREAM_SELECT_TIMEOUT_MS * 1000};
+            select(max_fd + 1, NULL, &wfds, NULL, &tv);
+        } else {
+            ulTaskNotifyTake(pdTRUE, stream_wait_ticks(wake_us - now_us));
+        }
+    }
+}
+
+/*
+ * Preview tap: while a capture owns the camera the broadcaster is paused, and
+ * the capture loop offers every STREAM_PREVIEW_EVERY_N-th frame it already
+ * grabbed. A JPEG frame is copied as is; other formats are decimated to at
+ * most STREAM_PREVIEW_MAX_WIDTH x STREAM_PREVIEW_MAX_HEIGHT and encoded to
+ * JPEG by the broadcaster, off the capture task. Only one preview is in
+ * flight at a time; an offer made while one is pending is dropped, so the
+ * capture loop pays at most one bounded copy per N frames.
+ */
+static bool stream_preview_decimate(const camera_fb_t *fb)
+{
+    size_t bpp;
+    if (fb->format == PIXFORMAT_GRAYSCALE) {
+        bpp = 1;
+    } else if (fb->format == PIXFORMAT_RGB565 || fb->format == PIXFORMAT_YUV422) {
+        bpp = 2;
+    } else {
+        return false;
+    }
+    if (!s_preview.raw) {
+        s_preview.raw = heap_caps_malloc(STREAM_PREVIEW_MAX_WIDTH * STREAM_PREVIEW_MAX_HEIGHT * 2,
+                                         MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!s_preview.raw) {
+            return false;
+        }
+    }
+    int step = MAX((fb->width + STREAM_PREVIEW_MAX_WIDTH - 1) / STREAM_PREVIEW_MAX_WIDTH,
+                   (fb->height + STREAM_PREVIEW_MAX_HEIGHT - 1) / STREAM_PREVIEW_MAX_HEIGHT);
+    bool yuv = fb->format == PIXFORMAT_YUV422;
+    if (yuv && step > 1) {
+        step = (step + 1) & ~1;     /* keep Y0 U Y1 V macropixels intact */
+    }
+    int width = fb->width / step;
+    int height = fb->height / step;
+    if (yuv) {
+        width &= ~1;
+    }
+    uint8_t *dst = s_preview.raw;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t *row = fb->buf + (size_t)y * step * fb->width * bpp;
+        if (yuv) {
+            for (int x = 0; x < width; x += 2, dst += 4) {
+                memcpy(dst, row + (size_t)x * step * 2, 4);
+            }
+        } else {
+            for (int x = 0; x < width; ++x, dst += bpp) {
+                memcpy(dst, row + (size_t)x * step * bpp, bpp);
+            }
+        }
+    }
+    s_preview.width = width;
+    s_preview.height = height;
+    s_preview.format = fb->format;
+    s_preview.raw_len = dst - s_preview.raw;
+    return true;
+}
+
+static void stream_preview_offer(const camera_fb_t *fb, int index)
+{
+    if (CONFIG_STREAM_PREVIEW_EVERY_N <= 0 || index % CONFIG_STREAM_PREVIEW_EVERY_N != 0 ||
+        !s_stream_enabled || s_stream_client_count == 0 || s_preview.pending) {
+        return;
+    }
+    bool ready;
+    if (fb->format == PIXFORMAT_JPEG) {
+        s_preview.jpeg = stream_frame_from_fb(fb);
+        ready = s_preview.jpeg != NULL;
+    } else {
+        ready = stream_preview_decimate(fb);
+    }
+    if (ready) {
+        s_preview.timestamp_us = capseq_fb_time_us(fb);
+        s_preview.pending = true;
+        xTaskNotifyGive(s_stream_task);
+    }
+}
+
+/* Broadcaster side: publishes a pending preview, encoding it if needed. */
+static void stream_preview_publish(void)
+{
+    if (!s_preview.pending) {
+        return;
+    }
+    stream_frame_t *frame = s_preview.jpeg;
+    s_preview.jpeg = NULL;
+    if (!frame) {
+        uint8_t *jpg = NULL;
+        size_t jpg_len = 0;
+        frame = calloc(1, sizeof(*frame));
+        if (frame && fmt2jpg(s_preview.raw, s_preview.raw_len, s_preview.width, s_preview.height,
+                             s_preview.format, STREAM_PREVIEW_QUALITY, &jpg, &jpg_len)) {
+            frame->buf = jpg;
+            frame->len = jpg_len;
+            frame->width = s_preview.width;
+            frame->height = s_preview.height;
+            frame->format = PIXFORMAT_JPEG;
+            frame->refs = 1;
+        } else {
+            free(jpg);
+            free(frame);
+            frame = NULL;
+        }
+    }
+    if (frame) {
+        frame->timestamp_us = s_preview.timestamp_us;
+    }
+    s_preview.pending = false;
+    if (frame) {
+        stream_frame_publish(frame);
+    }
+}
+
+/* Grab period for the fastest subscribed client; 0 means as fast as possible. */
+static int64_t stream_grab_period_us(void)
+{
+    int64_t period_us = -1;
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        const stream_client_t *client = &s_stream_clients[i];
+        if (client->fd >= 0 && (period_us < 0 || client->period_us < period_us)) {
+            period_us = client->period_us;
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+    return MAX(period_us, 0);
+}
+
+static void stream_broadcast_task(void *arg)
+{
+    (void)arg;
+    int64_t next_grab_us = 0;
+    int64_t last_grab_us = 0;
+    while (true) {
+        if (!s_stream_enabled || s_stream_stop_requested || s_stream_paused ||
+            (s_stream_client_count == 0 && !s_snapshot_wanted)) {
+            s_stream_in_progress = false;
+            stream_preview_publish();
+            s_stream_fps_x10 = 0;
+            last_grab_us = 0;
+            next_grab_us = 0;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+            continue;
+        }
+        /* Sleep only for what is left of the period after the previous grab
+         * and publish; a late grab is not made up with a burst. */
+        int64_t period_us = stream_grab_period_us();
+        int64_t now_us = esp_timer_get_time();
+        if (next_grab_us == 0) {
+            next_grab_us = now_us;
+        }
+        if (period_us > 0 && next_grab_us > now_us) {
+            vTaskDelay(stream_wait_ticks(next_grab_us - now_us));
+        }
+        if (!s_stream_in_progress) {
+            sensor_t *sensor = esp_camera_sensor_get();
+            if (sensor) {
+                sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+            }
+            s_stream_in_progress = true;
+        }
+
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGW(TAG, "Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+        stream_frame_t *frame = stream_frame_from_fb(fb);
+        esp_camera_fb_return(fb);
+        if (!frame) {
+            ESP_LOGW(TAG, "Stream frame alloc failed");
+            vTaskDelay(pdMS_TO_TICKS(20));
+            continue;
+        }
+        stream_frame_publish(frame);
+        s_snapshot_wanted = false;
+        now_us = esp_timer_get_time();
+        s_stream_fps_x10 = stream_fps_update(s_stream_fps_x10, &last_grab_us, now_us);
+        next_grab_us = MAX(next_grab_us + period_us, now_us);
+    }
+}
+
+/* ?fps=N from the request, clamped; STREAM_DEFAULT_FPS without it. */
+static int stream_query_fps(httpd_req_t *req)
+{
+    int fps = CONFIG_STREAM_DEFAULT_FPS;
+    char query[32];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) {
+        fps = atoi(value);
+    }
+    return clamp_int(fps, 0, STREAM_MAX_FPS);
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    if (!s_stream_enabled) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream disabled");
+        return ESP_FAIL;
+    }
+    int fps = stream_query_fps(req);
+
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    stream_client_t *client = NULL;
+    for (int i = 0; i < STREAM_MAX_CLIENTS && !client; ++i) {
+        if (s_stream_clients[i].fd < 0) {
+            client = &s_stream_clients[i];
+        }
+    }
+    httpd_req_t *async_req = NULL;
+    if (client && httpd_req_async_handler_begin(req, &async_req) == ESP_OK) {
+        memset(client, 0, sizeof(*client));
+        client->req = async_req;
+        client->fd = httpd_req_to_sockfd(req);
+        client->last_progress_us = esp_timer_get_time();
+        client->period_us = fps ? 1000000 / fps : 0;
+        s_stream_client_count++;
+    }
+    xSemaphoreGive(s_stream_lock);
+    if (!async_req) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "too many stream clients");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Stream client %d joined (fps %d)", client->fd, fps);
+    xTaskNotifyGive(s_stream_task);
+    xTaskNotifyGive(s_stream_sender_task);
+    return ESP_OK;
+}
+
+/*
+ * Answers a PING from the httpd task. The sender task writes the PONG, since
+ * it owns the socket while the client streams. A PING that arrives while an
+ * earlier PONG is half sent goes unanswered; the next one is.
+ */
+static void stream_ws_queue_pong(int fd, const uint8_t *payload, size_t len)
+{
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        stream_client_t *client = &s_stream_clients[i];
+        if (client->ws && client->fd == fd && client->pong_sent == 0) {
+            client->pong[0] = 0x8A;     /* FIN, pong */
+            client->pong[1] = (uint8_t)len;
+            memcpy(client->pong + 2, payload, len);
+            client->pong_len = 2 + len;
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+    xTaskNotifyGive(s_stream_sender_task);
+}
+
+/*
+ * GET /ws (port 81): the same frames as /stream, one binary WebSocket message
+ * each (stream_ws_header_t + JPEG), written by the sender task like any
+ * other viewer. Text messages control the stream: "start", "stop" and
+ * "fps=N" for this socket. A /ws viewer survives a stream stop so it can
+ * start it again. Control frames are handled here too: PINGs get a PONG.
+ */
+static esp_err_t stream_ws_handler(httpd_req_t *req)
+{
+    int fd = httpd_req_to_sockfd(req);
+    if (req->method == HTTP_GET) {
+        int fps = stream_query_fps(req);
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        stream_client_t *client = NULL;
+        for (int i = 0; i < STREAM_MAX_CLIENTS && !client; ++i) {
+            if (s_stream_clients[i].fd < 0) {
+                client = &s_stream_clients[i];
+            }
+        }
+        if (client) {
+            memset(client, 0, sizeof(*client));
+            client->fd = fd;
+            client->ws = true;
+            client->last_progress_us = esp_timer_get_time();
+            client->period_us = fps ? 1000000 / fps : 0;
+            s_stream_client_count++;
+        }
+        xSemaphoreGive(s_stream_lock);
+        if (!client) {
+            ESP_LOGW(TAG, "WebSocket client %d refused: too many stream clients", fd);
+            return ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "WebSocket client %d joined (fps %d)", fd, fps);
+        xTaskNotifyGive(s_stream_task);
+        xTaskNotifyGive(s_stream_sender_task);
+        return ESP_OK;
+    }
+
+    char text[STREAM_WS_CONTROL_MAX + 1];
+    httpd_ws_frame_t pkt = {0};
+    if (httpd_ws_recv_frame(req, &pkt, 0) != ESP_OK || pkt.len >= sizeof(text)) {
+        return ESP_FAIL;
+    }
+    pkt.payload = (uint8_t *)text;
+    if (pkt.len && httpd_ws_recv_frame(req, &pkt, sizeof(text) - 1) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    text[pkt.len] = '\0';
+
+    if (pkt.type == HTTPD_WS_TYPE_CLOSE) {
+        xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+        for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+            if (s_stream_clients[i].ws && s_stream_clients[i].fd == fd) {
+                stream_client_drop(&s_stream_clients[i]);
+            }
+        }
+        xSemaphoreGive(s_stream_lock);
+    } else if (pkt.type == HTTPD_WS_TYPE_PING) {
+        stream_ws_queue_pong(fd, (const uint8_t *)text, pkt.len);
+    } else if (pkt.type == HTTPD_WS_TYPE_TEXT) {
+        if (strcmp(text, "start") == 0) {
+            stream_set_enabled(true);
+        } else if (strcmp(text, "stop") == 0) {
+            stream_set_enabled(false);
+        } else if (strncmp(text, "fps=", 4) == 0) {
+            int fps = clamp_int(atoi(text + 4), 0, STREAM_MAX_FPS);
+            xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+            for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+                if (s_stream_clients[i].ws && s_stream_clients[i].fd == fd) {
+                    s_stream_clients[i].period_us = fps ? 1000000 / fps : 0;
+                    s_stream_clients[i].next_due_us = 0;
+                }
+            }
+            xSemaphoreGive(s_stream_lock);
+            xTaskNotifyGive(s_stream_sender_task);
+        } else {
+            ESP_LOGW(TAG, "WebSocket client %d: unknown command '%s'", fd, text);
+        }
+    }
+    return ESP_OK;
+}
+
+/*
+ * Stream server close_fn. A /ws viewer holds no request, so httpd may close
+ * its socket at any time; forget it before the fd can be handed out again.
+ */
+static void stream_sess_close(httpd_handle_t hd, int sockfd)
+{
+    (void)hd;
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        if (s_stream_clients[i].ws && s_stream_clients[i].fd == sockfd) {
+            stream_client_release(&s_stream_clients[i]);
+        }
+    }
+    xSemaphoreGive(s_stream_lock);
+    close(sockfd);
+}
+
+/* Appends the broadcaster rate and ,"stream_viewers":[...] with each client's counters. */
+static int stream_clients_json(char *buf, size_t len)
+{
+    uint32_t fps_x10 = s_stream_fps_x10;
+    int used = snprintf(buf, len, ",\"stream_fps\":%" PRIu32 ".%" PRIu32 ",\"stream_viewers\":[",
+                        fps_x10 / 10, fps_x10 % 10);
+    xSemaphoreTake(s_stream_lock, portMAX_DELAY);
+    bool first = true;
+    for (int i = 0; i < STREAM_MAX_CLIENTS && used < (int)len; ++i) {
+        const stream_client_t *client = &s_stream_clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        used += snprintf(buf + used, len - used,
+                         "%s{\"fd\":%d,\"transport\":\"%s\",\"target_fps\":%" PRIu32 ",\"fps\":%" PRIu32 ".%" PRIu32
+                         ",\"frames_sent\":%" PRIu32 ",\"frames_skipped\":%" PRIu32
+                         ",\"send_calls\":%" PRIu32 ",\"bytes_sent\":%llu}",
+                         first ? "" : ",", client->fd, client->ws ? "ws" : "mjpeg",
+                         client->period_us ? 1000000 / client->period_us : 0,
+                         client->fps_x10 / 10, client->fps_x10 % 10,
+                         client->frames_sent, client->frames_skipped,
+                         client->send_calls, (unsigned long long)client->bytes_sent);
+        first = false;
+    }
+    xSemaphoreGive(s_stream_lock);
+    if (used < (int)len) {
+        used += snprintf(buf + used, len - used, "]");
+    }
+    return MIN(used, (int)len - 1);
+}
+
+/*
+ * GET /snapshot.jpg: the newest frame the broadcaster (or the capture preview
+ * tap) already published, tagged with its sequence number. A frame older
+ * than SNAPSHOT_MAX_AGE_MS is refreshed with one broadcaster grab when the
+ * stream is enabled and the camera is not busy capturing; otherwise the
+ * cached frame is served as is.
+ */
+static bool snapshot_etag_matches(httpd_req_t *req, uint32_t seq)
+{
+    char value[32];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK) {
+        return false;
+    }
+    if (strcmp(value, "*") == 0) {
+        return true;
+    }
+    const char *p = value;
+    if (strncmp(p, "W/", 2) == 0) {
+        p += 2;
+    }
+    if (*p == '"') {
+        p++;
+    }
+    char *end = NULL;
+    unsigned long tag = strtoul(p, &end, 10);
+    return end != p && (*end == '"' || *end == '\0') && tag == seq;
+}
+
+static esp_err_t snapshot_handler(httpd_req_t *req)
+{
+    stream_frame_t *frame = stream_frame_latest();
+    bool stale = !frame || esp_timer_get_time() - frame->timestamp_us > SNAPSHOT_MAX_AGE_MS * 1000LL;
+    if (stale && s_stream_enabled && !s_stream_paused && s_stream_task) {
+        uint32_t seq = frame ? frame->seq : s_frame_seq;
+        s_snapshot_wanted = true;
+        xTaskNotifyGive(s_stream_task);
+        for (int waited_ms = 0; waited_ms < SNAPSHOT_WAIT_MS && s_frame_seq == seq; waited_ms += 10) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        if (s_frame_seq != seq) {
+            stream_frame_unref(frame);
+            frame = stream_frame_latest();
+        }
+    }
+    if (!frame) {
+        httpd_resp_send_err(req, HTTPD_409_CONFLICT,
+                            s_stream_enabled ? "no frame yet" : "stream disabled");
+        return ESP_FAIL;
+    }
+
+    char etag[16];
+    char stamp[24];
+    snprintf(etag, sizeof(etag), "\"%lu\"", (unsigned long)frame->seq);
+    snprintf(stamp, sizeof(stamp), "%lld", (long long)frame->timestamp_us);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "X-Timestamp-Us", stamp);
+    esp_err_t err;
+    if (snapshot_etag_matches(req, frame->seq)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        err = httpd_resp_send(req, NULL, 0);
+    } else {
+        httpd_resp_set_type(req, "image/jpeg");
+        err = httpd_resp_send(req, (const char *)frame->buf, frame->len);
+    }
+    stream_frame_unref(frame);
+    return err;
+}
+
+static esp_err_t init_stream_broadcaster(void)
+{
+    s_stream_lock = xSemaphoreCreateMutex();
+    if (!s_stream_lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < STREAM_MAX_CLIENTS; ++i) {
+        s_stream_clients[i].fd = -1;
+    }
+    if (xTaskCreatePinnedToCore(stream_sender_task, "stream_send", STREAM_TASK_STACK_SIZE, NULL,
+                                STREAM_TASK_PRIORITY, &s_stream_sender_task, NET_TASK_CORE) != pdPASS ||
+        xTaskCreatePinnedToCore(stream_broadcast_task, "stream_bcast", STREAM_TASK_STACK_SIZE, NULL,
+                                STREAM_TASK_PRIORITY, &s_stream_task, NET_TASK_CORE) != pdPASS) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sensor_handler(httpd_req_t *req)
+{
+    char content[512] = {0};
+    if (read_body(req, content, sizeof(content)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid body");
+        return ESP_FAIL;
+    }
+
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (!sensor) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor not ready");
+        return ESP_FAIL;
+    }
+
+    char type_buf[64] = {0};
+    const char *content_type = type_buf;
+    if (httpd_req_get_hdr_value_len(req, "Content-Type") > 0) {
+        if (httpd_req_get_hdr_value_str(req, "Content-Type", type_buf, sizeof(type_buf)) == ESP_OK) {
+            content_type = type_buf;
+        }
+    }
+
+    if (strstr(content_type, "application/json") != NULL) {
+        apply_sensor_settings_from_json(sensor, content);
+    } else {
+        char *saveptr;
+        char *pair = strtok_r(content, "&", &saveptr);
+        while (pair) {
+            char *eq = strchr(pair, '=');
+            if (eq) {
+                *eq = '\0';
+                const char *key = pair;
+                const char *value = eq + 1;
+                if (strcmp(key, "framesize") == 0) {
+                    framesize_t fs = parse_framesize(value);
+                    apply_sensor_setting(sensor, "framesize", fs);
+                } else if (strcmp(key, "pixel_format") == 0) {
+                    sensor->set_pixformat(sensor, parse_pixformat(value));
+                } else {
+                    apply_sensor_setting(sensor, key, atoi(value));
+                }
+            }
+            pair = strtok_r(NULL, "&", &saveptr);
+        }
+    }
+
+    httpd_resp_sendstr(req, "OK");
+    return ESP_OK;
+}
+
+/*
+ * Session transfer: GET /api/session/<session> lists the files that belong
+ * to a capture session, one "<name> <size>" line each, and
+ * GET /api/session/<session>/<name> returns one of them. The file endpoint
+ * honours ?offset=N or "Range: bytes=N-" so an interrupted transfer resumes
+ * where the local copy ends.
+ */
+static bool capseq_safe_name(const char *name)
+{
+    if (!name || !name[0] || strstr(name, "..")) {
+        return false;
+    }
+    return strpbrk(name, "/\\") == NULL;
+}
+
+/* PSRAM when available: SD/eMMC and TCP both want large sequential blocks. */
+static uint8_t *alloc_io_buffer(size_t *size)
+{
+    uint8_t *buf = heap_caps_malloc(*size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buf) {
+        *size = FILE_SEND_BUF_MIN;
+        buf = malloc(*size);
+    }
+    return buf;
+}
+
+static esp_err_t httpd_send_all(httpd_req_t *req, const char *buf, size_t len)
+{
+    while (len > 0) {
+        int sent = httpd_send(req, buf, len);
+        if (sent <= 0) {
+            return ESP_FAIL;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Resolves the requested byte range of a file of `total` bytes from
+ * ?offset=N or a single "Range: bytes=a-b", "bytes=a-" or "bytes=-n".
+ * Returns 1 for a partial response, 0 for the whole file and -1 when the
+ * range is unsatisfiable. Malformed or multi-range headers get the whole
+ * file, which RFC 9110 allows.
+ */
+static int parse_byte_range(httpd_req_t *req, size_t total, size_t *start, size_t *end)
+{
+    char value[48];
+    char query[64];
+    *start = 0;
+    *end = total ? total - 1 : 0;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+        *start = (size_t)strtoul(value, NULL, 10);
+        if (*start == 0) {
+            return 0;
+        }
+        return *start < total ? 1 : -1;
+    }
+    if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK ||
+        strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return 0;
+    }
+    const char *spec = value + 6;
+    const char *dash = strchr(spec, '-');
+    if (!dash) {
+        return 0;
+    }
+    if (dash == spec) {
+        size_t suffix = (size_t)strtoul(dash + 1, NULL, 10);
+        if (suffix == 0 || total == 0) {
+            return -1;
+        }
+        *start = (suffix < total) ? total - suffix : 0;
+        return 1;
+    }
+    *start = (size_t)strtoul(spec, NULL, 10);
+    if (dash[1] != '\0') {
+        size_t last = (size_t)strtoul(dash + 1, NULL, 10);
+        if (last < *start) {
+            *start = 0;
+            return 0;
+        }
+        *end = MIN(last, *end);
+    }
+    return *start < total ? 1 : -1;
+}
+
+/*
+ * Writes the status line and headers by hand and pushes the file body with
+ * raw socket sends: the response has an exact Content-Length, so there is no
+ * chunked framing and every read is a FILE_SEND_BUF_SIZE block.
+ */
+static esp_err_t send_file_raw(httpd_req_t *req, const char *path, const char *type)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "file not found");
+        return ESP_FAIL;
+    }
+    size_t total = (size_t)st.st_size;
+    size_t start = 0;
+    size_t end = 0;
+    int ranged = parse_byte_range(req, total, &start, &end);
+    if (ranged < 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes */%u", (unsigned)total);
+        httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Content-Range", range);
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "open failed");
+        return ESP_FAIL;
+    }
+    size_t buf_size = FILE_SEND_BUF_SIZE;
+    uint8_t *buf = alloc_io_buffer(&buf_size);
+    if (!buf) {
+        fclose(file);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no memory");
+        return ESP_FAIL;
+    }
+
+    size_t remaining = total ? end - start + 1 : 0;
+    char hdr[256];
+    int hdr_len;
+    if (ranged) {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                           "Content-Length: %u\r\nContent-Range: bytes %u-%u/%u\r\n"
+                           "Accept-Ranges: bytes\r\n\r\n",
+                           type, (unsigned)remaining, (unsigned)start, (unsigned)end,
+                           (unsigned)total);
+    } else {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n"
+                           "Accept-Ranges: bytes\r\n\r\n",
+                           type, (unsigned)remaining);
+    }
+
+    esp_err_t err = httpd_send_all(req, hdr, hdr_len);
+    if (err == ESP_OK && start > 0 && fseek(file, (long)start, SEEK_SET) != 0) {
+        err = ESP_FAIL;
+    }
+    while (err == ESP_OK && remaining > 0) {
+        size_t n = fread(buf, 1, MIN(buf_size, remaining), file);
+        if (n == 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        err = httpd_send_all(req, (const char *)buf, n);
+        remaining -= n;
+    }
+    free(buf);
+    fclose(file);
+    if (err != ESP_OK) {
+        /* Headers already went out; a short body must end the connection. */
+        ESP_LOGW(TAG, "Send of %s aborted with %u bytes left", path, (unsigned)remaining);
+    }
+    return err;
+}
+
+static const char *file_content_type(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext && strcmp(ext, ".jpg") == 0) {
+        return "image/jpeg";
+    }
+    if (ext && strcmp(ext, ".csv") == 0) {
+        return "text/csv";
+    }
+    return "application/octet-stream";
+}
+
+static esp_err_t session_list_send(httpd_req_t *req, const char *session)
+{
+    DIR *dir = opendir(CAPTURE_DIR);
+    if (!dir) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no captures");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    struct dirent *entry;
+    char line[300];
+    char path[300];
+    int count = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!capseq_session_file(session, entry->d_name)) {
+            continue;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        int len = snprintf(line, sizeof(line), "%s %ld\n", entry->d_name, (long)st.st_size);
+        if (httpd_resp_send_chunk(req, line, len) != ESP_OK) {
+            closedir(dir);
+            return ESP_FAIL;
+        }
+        count++;
+    }
+    closedir(dir);
+    ESP_LOGI(TAG, "Session %s: listed %d files", session, count);
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/*
+ * Session archive: GET /api/session/<session>?format=tar streams every file
+ * of the session (on the master also the collected slave-<id>/ copies) as one
+ * store-only ustar archive. Sizes are known up front, so the response has an
+ * exact Content-Length and goes out with raw sends. A reader task fills PSRAM
+ * blocks with headers and file data while the HTTP task sends the previous
+ * block; nothing is staged on the card.
+ */
+#define TAR_BLOCK 512
+#define TAR_PAD(size) (((size) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+
+typedef struct __attribute__((packed)) {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+typedef struct {
+    char name[100];         /* archive path, relative to CAPTURE_DIR */
+    uint32_t size;
+    uint32_t mtime;
+} tar_entry_t;
+
+typedef struct {
+    uint8_t *data;          /* NULL: end of archive (or reader failure) */
+    size_t len;
+} tar_block_t;
+
+typedef struct {
+    const tar_entry_t *entries;
+    int count;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    uint8_t *cur;
+    size_t fill;
+    volatile bool abort;
+    bool failed;
+} tar_stream_t;
+
+static bool tar_entries_add(tar_entry_t **entries, int *count, int *cap, const char *dir_path,
+                            const char *prefix, const char *name)
+{
+    char path[320];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return true;
+    }
+    if (*count == *cap) {
+        int grow = *cap ? *cap * 2 : 64;
+        tar_entry_t *bigger = heap_caps_realloc(*entries, grow * sizeof(tar_entry_t),
+                                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!bigger) {
+            return false;
+        }
+        *entries = bigger;
+        *cap = grow;
+    }
+    tar_entry_t *e = &(*entries)[*count];
+    int len = snprintf(e->name, sizeof(e->name), "%s%s", prefix, name);
+    if (len >= (int)sizeof(e->name)) {
+        return true;        /* does not fit a plain ustar name */
+    }
+    e->size = (uint32_t)st.st_size;
+    e->mtime = (uint32_t)st.st_mtime;
+    (*count)++;
+    return true;
+}
+
+static tar_entry_t *tar_collect_entries(const char *session, int *count)
+{
+    tar_entry_t *entries = NULL;
+    int cap = 0;
+    *count = 0;
+    DIR *dir = opendir(CAPTURE_DIR);
+    if (!dir) {
+        return NULL;
+    }
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (capseq_session_file(session, entry->d_name)) {
+            ok = tar_entries_add(&entries, count, &cap, CAPTURE_DIR, "", entry->d_name);
+        } else if (strncmp(entry->d_name, "slave-", 6) == 0 && entry->d_type == DT_DIR) {
+            char sub_path[64];
+            char prefix[48];
+            snprintf(sub_path, sizeof(sub_path), "%s/%s", CAPTURE_DIR, entry->d_name);
+            snprintf(prefix, sizeof(prefix), "%s/", entry->d_name);
+            DIR *sub = opendir(sub_path);
+            struct dirent *sub_entry;
+            while (ok && sub && (sub_entry = readdir(sub)) != NULL) {
+                if (capseq_session_file(session, sub_entry->d_name)) {
+                    ok = tar_entries_add(&entries, count, &cap, sub_path, prefix, sub_entry->d_name);
+                }
+            }
+            if (sub) {
+                closedir(sub);
+            }
+        }
+    }
+    closedir(dir);
+    if (!ok) {
+        free(entries);
+        *count = 0;
+        return NULL;
+    }
+    return entries;
+}
+
+static void tar_header_fill(tar_header_t *hdr, const tar_entry_t *e)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->name, e->name, strnlen(e->name, sizeof(hdr->name)));
+    snprintf(hdr->mode, sizeof(hdr->mode), "%07o", 0644);
+    snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 0);
+    snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 0);
+    snprintf(hdr->size, sizeof(hdr->size), "%011" PRIo32, e->size);
+    snprintf(hdr->mtime, sizeof(hdr->mtime), "%011" PRIo32, e->mtime);
+    hdr->typeflag = '0';
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    uint32_t sum = 0;
+    const uint8_t *bytes = (const uint8_t *)hdr;
+    for (size_t i = 0; i < sizeof(*hdr); ++i) {
+        sum += bytes[i];
+    }
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06" PRIo32, sum);
+}
+
+/*
+ * Queues the current block once it is full (or, with flush, whatever it
+ * holds) and otherwise makes sure a block with free space is at hand.
+ */
+static bool tar_emit(tar_stream_t *ts, bool flush)
+{
+    if (ts->cur && (ts->fill == TAR_STREAM_BLOCK_SIZE || (flush && ts->fill > 0))) {
+        tar_block_t block = {.data = ts->cur, .len = ts->fill};
+        xQueueSend(ts->full_q, &block, portMAX_DELAY);
+        ts->cur = NULL;
+    }
+    if (flush) {
+        return true;
+    }
+    if (!ts->cur) {
+        if (ts->abort || xQueueReceive(ts->free_q, &ts->cur, portMAX_DELAY) != pdTRUE) {
+            return false;
+        }
+        ts->fill = 0;
+    }
+    return true;
+}
+
+static bool tar_put_zero(tar_stream_t *ts, size_t len)
+{
+    while (len > 0) {
+        if (!tar_emit(ts, false)) {
+            return false;
+        }
+        size_t n = MIN(len, TAR_STREAM_BLOCK_SIZE - ts->fill);
+        memset(ts->cur + ts->fill, 0, n);
+        ts->fill += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool tar_put_file(tar_stream_t *ts, const tar_entry_t *e)
+{
+    if (!tar_emit(ts, false)) {
+        return false;
+    }
+    /* TAR_STREAM_BLOCK_SIZE is a multiple of 512, so a header never splits. */
+    tar_header_fill((tar_header_t *)(ts->cur + ts->fill), e);
+    ts->fill += TAR_BLOCK;
+
+    char path[160];
+    snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, e->name);
+    FILE *file = fopen(path, "rb");
+    size_t left = e->size;
+    while (file && left > 0) {
+        if (!tar_emit(ts, false)) {
+            break;
+        }
+        size_t n = fread(ts->cur + ts->fill, 1, MIN(left, TAR_STREAM_BLOCK_SIZE - ts->fill), file);
+        if (n == 0) {
+            break;
+        }
+        ts->fill += n;
+        left -= n;
+    }
+    if (file) {
+        fclose(file);
+    }
+    if (left > 0) {
+        ESP_LOGW(TAG, "Archive: %s short by %u bytes", e->name, (unsigned)left);
+        return false;
+    }
+    return tar_put_zero(ts, TAR_PAD(e->size) - e->size);
+}
+
+static void tar_reader_task(void *arg)
+{
+    tar_stream_t *ts = (tar_stream_t *)arg;
+    bool ok = true;
+    for (int i = 0; ok && i < ts->count; ++i) {
+        ok = tar_put_file(ts, &ts->entries[i]);
+    }
+    ok = ok && tar_put_zero(ts, 2 * TAR_BLOCK) && tar_emit(ts, true);
+    if (ts->cur) {
+        xQueueSend(ts->free_q, &ts->cur, 0);
+    }
+    ts->failed = !ok;
+    tar_block_t end = {0};
+    xQueueSend(ts->full_q, &end, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t session_tar_send(httpd_req_t *req, const char *session)
+{
+    int count = 0;
+    tar_entry_t *entries = tar_collect_entries(session, &count);
+    if (!entries || count == 0) {
+        free(entries);
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "empty session");
+        return ESP_FAIL;
+    }
+    uint64_t total = 2 * TAR_BLOCK;
+    for (int i = 0; i < count; ++i) {
+        total += TAR_BLOCK + TAR_PAD((uint64_t)entries[i].size);
+    }
+
+    tar_stream_t ts = {
+        .entries = entries,
+        .count = count,
+        .free_q = xQueueCreate(TAR_STREAM_BLOCK_COUNT, sizeof(uint8_t *)),
+        .full_q = xQueueCreate(TAR_STREAM_BLOCK_COUNT + 1, sizeof(tar_block_t)),
+    };
+    uint8_t *blocks[TAR_STREAM_BLOCK_COUNT] = {0};
+    bool ok = ts.free_q && ts.full_q;
+    for (int i = 0; ok && i < TAR_STREAM_BLOCK_COUNT; ++i) {
+        blocks[i] = heap_caps_malloc(TAR_STREAM_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        ok = blocks[i] != NULL;
+        if (ok) {
+            xQueueSend(ts.free_q, &blocks[i], 0);
+        }
+    }
+    esp_err_t err = ESP_FAIL;
+    if (!ok) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no memory");
+    } else if (xTaskCreatePinnedToCore(tar_reader_task, "tar_rd", TAR_READER_TASK_STACK_SIZE, &ts,
+                                       CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE) != pdPASS) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "reader task create failed");
+    } else {
+        char hdr[192];
+        int hdr_len = snprintf(hdr, sizeof(hdr),
+                               "HTTP/1.1 200 OK\r\nContent-Type: application/x-tar\r\n"
+                               "Content-Length: %llu\r\n"
+                               "Content-Disposition: attachment; filename=\"%s.tar\"\r\n\r\n",
+                               (unsigned long long)total, session);
+        err = httpd_send_all(req, hdr, hdr_len);
+        if (err != ESP_OK) {
+            ts.abort = true;
+        }
+        uint64_t sent = 0;
+        tar_block_t block;
+        /* Drain until the reader's end marker even after a send error, so
+         * it never blocks on a queue that nobody reads. */
+        while (xQueueReceive(ts.full_q, &block, portMAX_DELAY) == pdTRUE && block.data) {
+            if (!ts.abort) {
+                err = httpd_send_all(req, (const char *)block.data, block.len);
+                ts.abort = (err != ESP_OK);
+                sent += block.len;
+            }
+            xQueueSend(ts.free_q, &block.data, 0);
+        }
+        if (err == ESP_OK && (ts.failed || sent != total)) {
+            err = ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "Archive %s: %d files, %llu/%llu bytes%s", session, count,
+                 (unsigned long long)sent, (unsigned long long)total, err == ESP_OK ? "" : " (aborted)");
     }
-    httpd_resp_sendstr(req, "OK");
-    return ESP_OK;
-}
 
-static esp_err_t status_handler(httpd_req_t *req)
-{
-    int64_t uptime_ms = esp_timer_get_time() / 1000;
-    uint32_t free_heap = esp_get_free_heap_size();
-    bool capture_ready = s_capture_ready;
-    bool capture_active = s_capture_in_progress;
-    char response[320];
-    snprintf(response, sizeof(response),
-             "{\"stream_enabled\":%s,\"stream_active\":%s,\"capture_ready\":%s,\"capture_active\":%s,"
-             "\"uptime_ms\":%lld,\"free_heap\":%" PRIu32 ",\"slave_id\":\"%s\"}",
-             s_stream_enabled ? "true" : "false",
-             s_stream_in_progress ? "true" : "false",
-             capture_ready ? "true" : "false",
-             capture_active ? "true" : "false",
-             uptime_ms,
-             free_heap,
-             CONFIG_SLAVE_ID);
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
-    return ESP_OK;
+    for (int i = 0; i < TAR_STREAM_BLOCK_COUNT; ++i) {
+        free(blocks[i]);
+    }
+    if (ts.free_q) vQueueDelete(ts.free_q);
+    if (ts.full_q) vQueueDelete(ts.full_q);
+    free(entries);
+    return err;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req)
+static esp_err_t session_handler(httpd_req_t *req)
 {
-    if (!s_stream_enabled) {
-        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream disabled");
+    char session[32];
+    char name[96] = {0};
+    const char *rest = req->uri + strlen("/api/session/");
+    size_t len = strcspn(rest, "/?");
+    if (len == 0 || len >= sizeof(session)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid session");
+        return ESP_FAIL;
+    }
+    memcpy(session, rest, len);
+    session[len] = '\0';
+    if (rest[len] == '/') {
+        const char *file = rest + len + 1;
+        size_t name_len = strcspn(file, "?");
+        if (name_len >= sizeof(name)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid file");
+            return ESP_FAIL;
+        }
+        memcpy(name, file, name_len);
+    }
+    if (!capseq_safe_name(session) || (name[0] && !capseq_safe_name(name))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
         return ESP_FAIL;
     }
-    if (s_stream_in_progress) {
-        httpd_resp_send_err(req, HTTPD_409_CONFLICT, "stream already active");
+    if (!name[0]) {
+        char query[32];
+        char format[8];
+        if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "format", format, sizeof(format)) == ESP_OK &&
+            strcmp(format, "tar") == 0) {
+            return session_tar_send(req, session);
+        }
+        return session_list_send(req, session);
+    }
+    if (!capseq_session_file(session, name)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "not in session");
         return ESP_FAIL;
     }
 
-    s_stream_in_progress = true;
-    s_stream_fd = httpd_req_to_sockfd(req);
-    httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
-    char part_buf[128];
+    char path[160];
+    snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, name);
+    return send_file_raw(req, path, file_content_type(name));
+}
 
-    sensor_t *sensor = esp_camera_sensor_get();
-    if (sensor) {
-        sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+/*
+ * GET /api/files?offset=N&limit=M[&dir=<sub>] pages through CAPTURE_DIR (or
+ * one subdirectory of it, e.g. collected slave-<id> frames) as JSON;
+ * GET /api/files/<name> or /api/files/<sub>/<name> downloads through
+ * send_file_raw() with Range support. Only the returned page is stat()ed, so
+ * a page costs the same regardless of where it sits in the directory.
+ */
+static esp_err_t files_list_send(httpd_req_t *req)
+{
+    char query[96] = {0};
+    char value[32];
+    char sub[32] = {0};
+    int offset = 0;
+    int limit = FILES_PAGE_DEFAULT;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+            offset = MAX(atoi(value), 0);
+        }
+        if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+            limit = clamp_int(atoi(value), 1, FILES_PAGE_MAX);
+        }
+        if (httpd_query_key_value(query, "dir", sub, sizeof(sub)) == ESP_OK && !capseq_safe_name(sub)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid dir");
+            return ESP_FAIL;
+        }
     }
 
-    while (s_stream_enabled) {
-        if (s_stream_stop_requested) {
-            break;
-        }
-        camera_fb_t *fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGW(TAG, "Camera capture failed");
+    char dir_path[64];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%s", CAPTURE_DIR, sub[0] ? "/" : "", sub);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "directory not found");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    char line[320];
+    int len = snprintf(line, sizeof(line), "{\"dir\":\"%s\",\"offset\":%d,\"limit\":%d,\"files\":[",
+                       sub, offset, limit);
+    esp_err_t err = httpd_resp_send_chunk(req, line, len);
+
+    struct dirent *entry;
+    int index = 0;
+    int count = 0;
+    while (err == ESP_OK && (entry = readdir(dir)) != NULL) {
+        if (index++ < offset || count >= limit) {
             continue;
         }
-
-        int header_len = snprintf(part_buf, sizeof(part_buf),
-                                  "--" STREAM_BOUNDARY "\r\n"
-                                  "Content-Type: image/jpeg\r\n"
-                                  "Content-Length: %u\r\n\r\n",
-                                  fb->len);
-        if (httpd_resp_send_chunk(req, part_buf, header_len) != ESP_OK ||
-            httpd_resp_send_chunk(req, (const char *)fb->buf, fb->len) != ESP_OK ||
-            httpd_resp_send_chunk(req, "\r\n", 2) != ESP_OK) {
-            esp_camera_fb_return(fb);
-            break;
+        char path[320];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (stat(path, &st) != 0) {
+            memset(&st, 0, sizeof(st));
         }
-
-        esp_camera_fb_return(fb);
-        vTaskDelay(pdMS_TO_TICKS(20));
+        len = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"size\":%ld,\"mtime\":%lld,\"dir\":%s}",
+                       count ? "," : "", entry->d_name, (long)st.st_size, (long long)st.st_mtime,
+                       S_ISDIR(st.st_mode) ? "true" : "false");
+        err = httpd_resp_send_chunk(req, line, len);
+        count++;
     }
-
-    s_stream_in_progress = false;
-    s_stream_stop_requested = false;
-    if (s_stream_fd == httpd_req_to_sockfd(req)) {
-        s_stream_fd = -1;
+    closedir(dir);
+    if (err != ESP_OK) {
+        return err;
     }
-    httpd_resp_sendstr_chunk(req, NULL);
-    return ESP_OK;
+    len = snprintf(line, sizeof(line), "],\"count\":%d,\"total\":%d}", count, index);
+    httpd_resp_send_chunk(req, line, len);
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
-static esp_err_t sensor_handler(httpd_req_t *req)
+static esp_err_t files_handler(httpd_req_t *req)
 {
-    char content[512] = {0};
-    if (read_body(req, content, sizeof(content)) != ESP_OK) {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid body");
-        return ESP_FAIL;
+    const char *rest = req->uri + strlen("/api/files");
+    if (*rest == '/') {
+        rest++;
+    }
+    size_t len = strcspn(rest, "?");
+    if (len == 0) {
+        return files_list_send(req);
     }
 
-    sensor_t *sensor = esp_camera_sensor_get();
-    if (!sensor) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "sensor not ready");
+    char rel[128];
+    if (len >= sizeof(rel)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
         return ESP_FAIL;
     }
-
-    char type_buf[64] = {0};
-    const char *content_type = type_buf;
-    if (httpd_req_get_hdr_value_len(req, "Content-Type") > 0) {
-        if (httpd_req_get_hdr_value_str(req, "Content-Type", type_buf, sizeof(type_buf)) == ESP_OK) {
-            content_type = type_buf;
-        }
+    memcpy(rel, rest, len);
+    rel[len] = '\0';
+    char *name = strchr(rel, '/');
+    if (name) {
+        *name++ = '\0';
+    }
+    if (!capseq_safe_name(rel) || (name && !capseq_safe_name(name))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid name");
+        return ESP_FAIL;
     }
 
-    if (strstr(content_type, "application/json") != NULL) {
-        apply_sensor_settings_from_json(sensor, content);
+    char path[192];
+    if (name) {
+        snprintf(path, sizeof(path), "%s/%s/%s", CAPTURE_DIR, rel, name);
     } else {
-        char *saveptr;
-        char *pair = strtok_r(content, "&", &saveptr);
-        while (pair) {
-            char *eq = strchr(pair, '=');
-            if (eq) {
-                *eq = '\0';
-                const char *key = pair;
-                const char *value = eq + 1;
-                if (strcmp(key, "framesize") == 0) {
-                    framesize_t fs = parse_framesize(value);
-                    apply_sensor_setting(sensor, "framesize", fs);
-                } else if (strcmp(key, "pixel_format") == 0) {
-                    sensor->set_pixformat(sensor, parse_pixformat(value));
-                } else {
-                    apply_sensor_setting(sensor, key, atoi(value));
-                }
-            }
-            pair = strtok_r(NULL, "&", &saveptr);
-        }
+        snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, rel);
     }
+    return send_file_raw(req, path, file_content_type(name ? name : rel));
+}
 
-    httpd_resp_sendstr(req, "OK");
-    return ESP_OK;
+static uint32_t capseq_node_id(const char *id)
+{
+    return (uint32_t)strtoul(id, NULL, 16);
 }
 
-static bool parse_int64_payload(const char *buf, int64_t *out_value)
+static void capseq_reply(int sock, const struct sockaddr_storage *to, socklen_t to_len,
+                         const capseq_msg_t *req, uint8_t type, int32_t status, int64_t recv_us)
 {
-    if (!buf || !out_value) {
-        return false;
-    }
-    char *end = NULL;
-    errno = 0;
-    int64_t value = strtoll(buf, &end, 10);
-    if (errno != 0 || end == buf) {
-        return false;
-    }
-    *out_value = value;
-    return true;
+    capseq_msg_t resp = {
+        .magic = CAPSEQ_PROTO_MAGIC,
+        .version = CAPSEQ_PROTO_VERSION,
+        .type = type,
+        .seq = req->seq,
+        .sender_id = capseq_node_id(CONFIG_SLAVE_ID),
+        .status = status,
+        .origin_us = req->origin_us,
+        .recv_us = recv_us,
+        .arg_us = req->arg_us,
+    };
+    resp.xmit_us = esp_timer_get_time();
+    sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr *)to, to_len);
 }
 
-static bool start_slave_capture(int64_t start_delay_us)
+static int64_t capseq_sync_disparity(void)
 {
-    slave_capture_request_t req_copy = {0};
-    if (!s_capture_mutex) {
+    portENTER_CRITICAL(&s_sync_lock);
+    int64_t disparity_us = s_sync_disparity_us;
+    portEXIT_CRITICAL(&s_sync_lock);
+    return disparity_us;
+}
+
+/* Hands the prepared capture to the capture task, so this (UDP) task keeps
+ * answering and can apply beacons while frames are being taken. */
+static bool start_slave_capture(int64_t start_master_us, const capseq_start_entry_t *entry)
+{
+    if (!s_capture_mutex || !s_capture_cmd_queue) {
         return false;
     }
     if (xSemaphoreTake(s_capture_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
@@ -622,18 +2324,122 @@ static bool start_slave_capture(int64_t start_delay_us)
         xSemaphoreGive(s_capture_mutex);
         return false;
     }
-    s_capture_in_progress = true;
-    s_capture_ready = false;
-    req_copy = s_capture_req;
+    portENTER_CRITICAL(&s_sync_lock);
+    s_sync_disparity_us = entry->disparity_us;
+    s_sync_trip_us = entry->trip_us;
+    portEXIT_CRITICAL(&s_sync_lock);
+    slave_capture_cmd_t cmd = {
+        .type = CAPSEQ_MSG_START,
+        .start_master_us = start_master_us,
+    };
+    bool queued = xQueueSend(s_capture_cmd_queue, &cmd, 0) == pdTRUE;
+    if (queued) {
+        s_capture_in_progress = true;
+        s_capture_ready = false;
+    }
     xSemaphoreGive(s_capture_mutex);
+    return queued;
+}
 
-    esp_err_t err = run_slave_capture(&req_copy, start_delay_us);
+/* Accepts a PREPARE from the sync channel; the camera is set up on the
+ * capture task and READY reports when it is done. */
+static esp_err_t queue_slave_prepare(const capseq_prepare_msg_t *prep)
+{
+    if (!s_capture_mutex || !s_capture_cmd_queue) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xSemaphoreTake(s_capture_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t err = ESP_OK;
+    if (s_capture_ready || s_capture_in_progress || s_prepare_pending) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        slave_capture_cmd_t cmd = {
+            .type = CAPSEQ_MSG_PREPARE,
+        };
+        memcpy(&cmd.prepare, prep, CAPSEQ_PREPARE_MSG_LEN(prep->sensor_count));
+        if (xQueueSend(s_capture_cmd_queue, &cmd, 0) == pdTRUE) {
+            s_prepare_pending = true;
+        } else {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreGive(s_capture_mutex);
+    return err;
+}
 
+static void run_slave_prepare(const capseq_prepare_msg_t *prep)
+{
+    char session[sizeof(prep->session) + 1];
+    memcpy(session, prep->session, sizeof(prep->session));
+    session[sizeof(prep->session)] = '\0';
+    framesize_t fs = (prep->framesize < FRAMESIZE_INVALID) ? (framesize_t)prep->framesize
+                                                          : DEFAULT_FRAME_SIZE;
+    int resync_every = prep->resync_every ? prep->resync_every : CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES;
+
+    esp_err_t err = prepare_slave_capture(NULL, session[0] ? session : "session",
+                                          (int)prep->frame_count, fs, (pixformat_t)prep->pixformat,
+                                          prep->interval_us, resync_every,
+                                          prep->sensors, prep->sensor_count);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "UDP prepare failed: %s", esp_err_to_name(err));
+    }
     if (xSemaphoreTake(s_capture_mutex, pdMS_TO_TICKS(1000)) == pdTRUE) {
-        s_capture_in_progress = false;
+        s_prepare_pending = false;
         xSemaphoreGive(s_capture_mutex);
     }
-    return err == ESP_OK;
+}
+
+/* Folds one beacon into the disparity estimate. Queueing only ever delays a
+ * beacon, so samples far from the current estimate are ignored. */
+static void capseq_apply_beacon(const capseq_msg_t *msg, int64_t recv_us)
+{
+    portENTER_CRITICAL(&s_sync_lock);
+    int64_t sample_us = msg->origin_us + s_sync_trip_us - recv_us;
+    int64_t step_us = sample_us - s_sync_disparity_us;
+    bool applied = step_us > -CAPSEQ_BEACON_MAX_STEP_US && step_us < CAPSEQ_BEACON_MAX_STEP_US;
+    if (applied) {
+        s_sync_disparity_us += step_us / 4;
+    }
+    portEXIT_CRITICAL(&s_sync_lock);
+    ESP_LOGD(TAG, "Beacon slot %lld: step=%lldus%s", (long long)msg->arg_us, (long long)step_us,
+             applied ? "" : " (ignored)");
+}
+
+static void slave_capture_task(void *arg)
+{
+    (void)arg;
+    slave_capture_cmd_t cmd;
+    for (;;) {
+        if (xQueueReceive(s_capture_cmd_queue, &cmd, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        if (cmd.type == CAPSEQ_MSG_PREPARE) {
+            run_slave_prepare(&cmd.prepare);
+            continue;
+        }
+        slave_capture_request_t req_copy = {0};
+        if (xSemaphoreTake(s_capture_mutex, portMAX_DELAY) == pdTRUE) {
+            req_copy = s_capture_req;
+            xSemaphoreGive(s_capture_mutex);
+        }
+
+        esp_err_t err = run_slave_capture(&req_copy, cmd.start_master_us);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Slave capture failed: %s", esp_err_to_name(err));
+        }
+        if (req_copy.need_reinit) {
+            restore_stream_camera_and_resume();
+        } else {
+            resume_stream();
+        }
+
+        if (xSemaphoreTake(s_capture_mutex, pdMS_TO_TICKS(1000)) == pdTRUE) {
+            s_capture_in_progress = false;
+            xSemaphoreGive(s_capture_mutex);
+        }
+    }
 }
 
 static void udp_sync_task(void *arg)
@@ -658,70 +2464,145 @@ static void udp_sync_task(void *arg)
         return;
     }
 
-    char rx_buf[64];
+    if (inet_addr(CONFIG_CAPSEQ_SYNC_GROUP_ADDR) != htonl(INADDR_BROADCAST)) {
+        struct ip_mreq mreq = {
+            .imr_interface.s_addr = htonl(INADDR_ANY),
+        };
+        if (inet_pton(AF_INET, CONFIG_CAPSEQ_SYNC_GROUP_ADDR, &mreq.imr_multiaddr) == 1 &&
+            setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            ESP_LOGW(TAG, "UDP join %s failed (%d)", CONFIG_CAPSEQ_SYNC_GROUP_ADDR, errno);
+        }
+    }
+
+    const uint32_t self_id = capseq_node_id(CONFIG_SLAVE_ID);
+    uint32_t last_start_seq = 0;
+    uint32_t last_start_master = 0;
+    uint32_t last_prepare_seq = 0;
+    uint32_t last_prepare_master = 0;
     for (;;) {
+        union {
+            capseq_msg_t hdr;
+            capseq_start_msg_t start;
+            capseq_prepare_msg_t prepare;
+        } rx;
         struct sockaddr_storage source_addr;
         socklen_t socklen = sizeof(source_addr);
-        int len = recvfrom(sock, rx_buf, sizeof(rx_buf) - 1, 0,
+        int len = recvfrom(sock, &rx, sizeof(rx), 0,
                            (struct sockaddr *)&source_addr, &socklen);
-        if (len < 0) {
+        int64_t recv_us = esp_timer_get_time();
+        capseq_msg_t msg = rx.hdr;
+        if (len < (int)offsetof(capseq_msg_t, sender_id) || msg.magic != CAPSEQ_PROTO_MAGIC) {
             continue;
         }
-        rx_buf[len] = '\0';
+        size_t expected_len = sizeof(msg);
+        if (msg.type == CAPSEQ_MSG_START && len > (int)sizeof(msg)) {
+            expected_len = (rx.start.count <= CAPSEQ_START_MAX_SLAVES)
+                               ? CAPSEQ_START_MSG_LEN(rx.start.count) : 0;
+        } else if (msg.type == CAPSEQ_MSG_PREPARE && len >= (int)CAPSEQ_PREPARE_MSG_LEN(0)) {
+            expected_len = (rx.prepare.sensor_count <= CAPSEQ_SENSOR_KEY_COUNT)
+                               ? CAPSEQ_PREPARE_MSG_LEN(rx.prepare.sensor_count) : 0;
+        }
+        if (msg.version != CAPSEQ_PROTO_VERSION || len != (int)expected_len) {
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                         ESP_ERR_INVALID_VERSION, recv_us);
+            continue;
+        }
+
+        switch (msg.type) {
+        case CAPSEQ_MSG_PING:
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_PONG, ESP_OK, recv_us);
+            break;
 
-        if (strncmp(rx_buf, "READY", 5) == 0) {
+        case CAPSEQ_MSG_READY: {
             bool ready = false;
             if (s_capture_mutex && xSemaphoreTake(s_capture_mutex, 0) == pdTRUE) {
                 ready = s_capture_ready && !s_capture_in_progress;
                 xSemaphoreGive(s_capture_mutex);
             }
-            const char *resp = ready ? "OK" : "NO";
-            sendto(sock, resp, strlen(resp), 0,
-                   (struct sockaddr *)&source_addr, socklen);
-            continue;
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_READY_RESP,
+                         ready ? ESP_OK : ESP_ERR_INVALID_STATE, recv_us);
+            break;
         }
 
-        if (strncmp(rx_buf, "START", 5) == 0) {
-            int64_t delay_us = 0;
-            if (sscanf(rx_buf + 5, "%lld", (long long *)&delay_us) != 1 || delay_us < 0) {
-                const char *resp = "NO";
-                sendto(sock, resp, strlen(resp), 0,
-                       (struct sockaddr *)&source_addr, socklen);
-                continue;
+        case CAPSEQ_MSG_START: {
+            if (len == (int)sizeof(msg)) {
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                             ESP_ERR_INVALID_ARG, recv_us);
+                break;
             }
-
-            bool can_start = false;
-            if (s_capture_mutex && xSemaphoreTake(s_capture_mutex, 0) == pdTRUE) {
-                can_start = s_capture_ready && !s_capture_in_progress;
-                xSemaphoreGive(s_capture_mutex);
+            const capseq_start_entry_t *entry = NULL;
+            for (int i = 0; i < rx.start.count; ++i) {
+                if (rx.start.entries[i].node_id == self_id) {
+                    entry = &rx.start.entries[i];
+                    break;
+                }
             }
-            const char *resp = can_start ? "ACK" : "NO";
-            sendto(sock, resp, strlen(resp), 0,
-                   (struct sockaddr *)&source_addr, socklen);
-            if (can_start) {
-                start_slave_capture(delay_us);
+            if (!entry) {
+                /* Group START for a rig this slave is not part of. */
+                break;
             }
-            continue;
+            if (msg.seq == last_start_seq && msg.sender_id == last_start_master) {
+                /* Retransmit of a START already accepted: the ACK was lost. */
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_START_ACK, ESP_OK, recv_us);
+                break;
+            }
+            int64_t start_us = msg.arg_us - entry->disparity_us;
+            if (start_us < recv_us) {
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                             ESP_ERR_TIMEOUT, recv_us);
+                break;
+            }
+            if (!start_slave_capture(msg.arg_us, entry)) {
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                             ESP_ERR_INVALID_STATE, recv_us);
+                break;
+            }
+            last_start_seq = msg.seq;
+            last_start_master = msg.sender_id;
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_START_ACK, ESP_OK, recv_us);
+            break;
         }
 
-        int64_t ignored = 0;
-        if (parse_int64_payload(rx_buf, &ignored)) {
-            int64_t now_us = esp_timer_get_time();
-            char tx_buf[32];
-            int tx_len = snprintf(tx_buf, sizeof(tx_buf), "%lld", (long long)now_us);
-            sendto(sock, tx_buf, tx_len, 0,
-                   (struct sockaddr *)&source_addr, socklen);
-            continue;
+        case CAPSEQ_MSG_PREPARE: {
+            if (len == (int)sizeof(msg)) {
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                             ESP_ERR_INVALID_ARG, recv_us);
+                break;
+            }
+            if (msg.seq == last_prepare_seq && msg.sender_id == last_prepare_master) {
+                /* Retransmit of a PREPARE already queued: the ACK was lost. */
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_PREPARE_ACK, ESP_OK, recv_us);
+                break;
+            }
+            esp_err_t err = queue_slave_prepare(&rx.prepare);
+            if (err != ESP_OK) {
+                capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR, err, recv_us);
+                break;
+            }
+            last_prepare_seq = msg.seq;
+            last_prepare_master = msg.sender_id;
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_PREPARE_ACK, ESP_OK, recv_us);
+            break;
         }
 
-        const char *resp = "ERR";
-        sendto(sock, resp, strlen(resp), 0,
-               (struct sockaddr *)&source_addr, socklen);
+        case CAPSEQ_MSG_BEACON:
+            if (s_capture_in_progress && msg.sender_id == last_start_master) {
+                capseq_apply_beacon(&msg, recv_us);
+            }
+            break;
+
+        default:
+            capseq_reply(sock, &source_addr, socklen, &msg, CAPSEQ_MSG_ERROR,
+                         ESP_ERR_NOT_SUPPORTED, recv_us);
+            break;
+        }
     }
 }
 
 static esp_err_t prepare_slave_capture(const char *query, const char *session,
-                                       int frame_count, framesize_t fs, pixformat_t fmt)
+                                       int frame_count, framesize_t fs, pixformat_t fmt,
+                                       int64_t interval_us, int resync_every,
+                                       const capseq_sensor_kv_t *sensors, int sensor_count)
 {
     if (!session || frame_count <= 0) {
         return ESP_ERR_INVALID_ARG;
@@ -741,7 +2622,7 @@ static esp_err_t prepare_slave_capture(const char *query, const char *session,
         return ESP_ERR_TIMEOUT;
     }
 
-    stop_stream_and_wait(2000);
+    pause_stream_and_wait(2000);
 
     bool need_reinit = true;
     esp_camera_deinit();
@@ -751,10 +2632,17 @@ static esp_err_t prepare_slave_capture(const char *query, const char *session,
     esp_err_t init_err = init_camera_with_format(fs, fmt);
     if (init_err != ESP_OK) {
         ESP_LOGW(TAG, "Capture camera init failed: %s", esp_err_to_name(init_err));
+        restore_stream_camera_and_resume();
         return ESP_FAIL;
     }
 
     apply_sensor_settings_from_query_str(query);
+    sensor_t *sensor = esp_camera_sensor_get();
+    for (int i = 0; sensor && i < sensor_count; ++i) {
+        if (sensors[i].key < CAPSEQ_SENSOR_KEY_COUNT) {
+            apply_sensor_setting(sensor, s_capseq_sensor_keys[sensors[i].key], sensors[i].value);
+        }
+    }
 
     for (int i = 0; i < CONFIG_CAPSEQ_DROP_FRAMES; ++i) {
         camera_fb_t *fb = esp_camera_fb_get();
@@ -764,6 +2652,7 @@ static esp_err_t prepare_slave_capture(const char *query, const char *session,
     }
 
     if (xSemaphoreTake(s_capture_mutex, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        restore_stream_camera_and_resume();
         return ESP_ERR_TIMEOUT;
     }
     snprintf(s_capture_req.session, sizeof(s_capture_req.session), "%s", session);
@@ -771,6 +2660,8 @@ static esp_err_t prepare_slave_capture(const char *query, const char *session,
     s_capture_req.frame_count = frame_count;
     s_capture_req.fs = fs;
     s_capture_req.fmt = fmt;
+    s_capture_req.interval_us = interval_us;
+    s_capture_req.resync_every = resync_every;
     s_capture_req.need_reinit = need_reinit;
     s_capture_ready = true;
     xSemaphoreGive(s_capture_mutex);
@@ -778,16 +2669,10 @@ static esp_err_t prepare_slave_capture(const char *query, const char *session,
     return ESP_OK;
 }
 
-static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t start_delay_us)
+static void capseq_wait_until(int64_t target_us)
 {
-    if (!req) {
-        return ESP_ERR_INVALID_ARG;
-    }
-
-    int64_t start_time_us = esp_timer_get_time() + start_delay_us;
     while (true) {
-        int64_t now_us = esp_timer_get_time();
-        int64_t remaining_us = start_time_us - now_us;
+        int64_t remaining_us = target_us - esp_timer_get_time();
         if (remaining_us <= 0) {
             break;
         }
@@ -797,12 +2682,114 @@ static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t s
             esp_rom_delay_us(100);
         }
     }
+}
+
+static const char *capseq_slot_action_name(capseq_slot_action_t action)
+{
+    switch (action) {
+    case CAPSEQ_SLOT_ON_TIME: return "ok";
+    case CAPSEQ_SLOT_DELAYED: return "delayed";
+    case CAPSEQ_SLOT_DROPPED: return "dropped";
+    default: return "free";
+    }
+}
+
+static int64_t capseq_fb_time_us(const camera_fb_t *fb)
+{
+    return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+/*
+ * Grabs the frame for one schedule slot. A frame the driver buffered before
+ * the slot is returned and re-grabbed (a delayed grab); a slot we reach more
+ * than half an interval late is skipped entirely (a dropped frame), so slot
+ * indices stay paired across cameras.
+ */
+static camera_fb_t *capseq_grab_slot(int64_t slot_us, int64_t interval_us,
+                                     capseq_slot_action_t *action, int64_t *phase_err_us)
+{
+    *phase_err_us = esp_timer_get_time() - slot_us;
+    if (*phase_err_us > interval_us / 2) {
+        *action = CAPSEQ_SLOT_DROPPED;
+        return NULL;
+    }
+    capseq_wait_until(slot_us);
+
+    *action = CAPSEQ_SLOT_ON_TIME;
+    for (int attempt = 0; attempt <= CAPSEQ_SLOT_MAX_REGRAB; ++attempt) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            return NULL;
+        }
+        *phase_err_us = capseq_fb_time_us(fb) - slot_us;
+        if (*phase_err_us >= 0 || attempt == CAPSEQ_SLOT_MAX_REGRAB) {
+            return fb;
+        }
+        esp_camera_fb_return(fb);
+        *action = CAPSEQ_SLOT_DELAYED;
+    }
+    return NULL;
+}
+
+/* Per-session sidecar next to the frames. frame_us + offset_us is the frame
+ * time in the master clock, which is what pairs frames across cameras. */
+static FILE *capseq_meta_open(const char *session, const char *role, const char *id,
+                              int64_t interval_us, int resync_every)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.csv", CAPTURE_DIR, session);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        ESP_LOGW(TAG, "Failed to open %s", path);
+        return NULL;
+    }
+    fprintf(file, "# session=%s role=%s id=%s interval_us=%lld resync_every=%d\n",
+            session, role, id, (long long)interval_us, resync_every);
+    fprintf(file, "slot,frame_us,phase_err_us,offset_us,action,file\n");
+    return file;
+}
+
+static void capseq_meta_write(FILE *file, int slot, int64_t frame_us, int64_t phase_err_us,
+                              int64_t offset_us, capseq_slot_action_t action, const char *name)
+{
+    if (!file) {
+        return;
+    }
+    fprintf(file, "%d,%lld,%lld,%lld,%s,%s\n", slot, (long long)frame_us, (long long)phase_err_us,
+            (long long)offset_us, capseq_slot_action_name(action), name ? name : "");
+}
+
+static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t start_master_us)
+{
+    if (!req) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    /* Slot times are kept in the master clock and converted with the latest
+     * disparity, so beacon corrections move every later slot. */
+    capseq_wait_until(start_master_us - capseq_sync_disparity());
 
+    FILE *meta = capseq_meta_open(req->session, "slave", CONFIG_SLAVE_ID, req->interval_us,
+                                  req->resync_every);
     int64_t prev_timestamp_ms = -1;
     for (int i = 0; i < req->frame_count; ++i) {
-        camera_fb_t *fb = esp_camera_fb_get();
+        capseq_slot_action_t action = CAPSEQ_SLOT_FREE;
+        int64_t phase_err_us = 0;
+        camera_fb_t *fb = NULL;
+        if (req->interval_us > 0) {
+            int64_t slot_us = start_master_us + i * req->interval_us - capseq_sync_disparity();
+            fb = capseq_grab_slot(slot_us, req->interval_us, &action, &phase_err_us);
+        } else {
+            fb = esp_camera_fb_get();
+        }
+        int64_t disparity_us = capseq_sync_disparity();
         if (!fb) {
-            ESP_LOGW(TAG, "Frame capture failed (%d)", i);
+            if (action == CAPSEQ_SLOT_DROPPED) {
+                ESP_LOGW(TAG, "Slot %d dropped (%lldus late)", i, (long long)phase_err_us);
+                capseq_meta_write(meta, i, 0, phase_err_us, disparity_us, action, NULL);
+            } else {
+                ESP_LOGW(TAG, "Frame capture failed (%d)", i);
+            }
             continue;
         }
 
@@ -826,31 +2813,32 @@ static esp_err_t run_slave_capture(const slave_capture_request_t *req, int64_t s
         fwrite(fb->buf, 1, fb->len, file);
         fclose(file);
 
+        capseq_meta_write(meta, i, capseq_fb_time_us(fb), phase_err_us, disparity_us, action,
+                          path + strlen(CAPTURE_DIR) + 1);
+        stream_preview_offer(fb, i);
         esp_camera_fb_return(fb);
         prev_timestamp_ms = timestamp_ms;
     }
-    
-    vTaskDelay(pdMS_TO_TICKS(500));
-    if (req->need_reinit) {
-        esp_camera_deinit();
-        gpio_uninstall_isr_service();
-        camera_power_cycle();
-        vTaskDelay(pdMS_TO_TICKS(500));
-        esp_err_t init_err = init_camera();
-        if (init_err != ESP_OK) {
-            ESP_LOGW(TAG, "Restore camera init failed: %s", esp_err_to_name(init_err));
-        }
+    if (meta) {
+        fclose(meta);
     }
 
+    vTaskDelay(pdMS_TO_TICKS(500));
+
     return ESP_OK;
 }
 
 static esp_err_t init_udp_sync_task(void)
 {
     s_capture_mutex = xSemaphoreCreateMutex();
-    if (!s_capture_mutex) {
+    s_capture_cmd_queue = xQueueCreate(2, sizeof(slave_capture_cmd_t));
+    if (!s_capture_mutex || !s_capture_cmd_queue) {
         return ESP_ERR_NO_MEM;
     }
+    if (xTaskCreatePinnedToCore(slave_capture_task, "capture_task", CAPTURE_TASK_STACK_SIZE, NULL,
+                                CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE) != pdPASS) {
+        return ESP_FAIL;
+    }
     BaseType_t task_ok = xTaskCreatePinnedToCore(
         udp_sync_task,
         "udp_sync",
@@ -894,6 +2882,8 @@ static esp_err_t capture_handler(httpd_req_t *req)
     int frame_count = 0;
     framesize_t fs = DEFAULT_FRAME_SIZE;
     pixformat_t fmt = DEFAULT_PIXEL_FORMAT;
+    int sync_interval_ms = 0;
+    int resync_every = CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES;
 
     if (httpd_query_key_value(args, "session", session, sizeof(session)) != ESP_OK) {
         strncpy(session, "session", sizeof(session) - 1);
@@ -910,8 +2900,17 @@ static esp_err_t capture_handler(httpd_req_t *req)
     if (httpd_query_key_value(args, "pixel_format", value, sizeof(value)) == ESP_OK) {
         fmt = parse_pixformat(value);
     }
+    if (httpd_query_key_value(args, "sync_interval_ms", value, sizeof(value)) == ESP_OK) {
+        sync_interval_ms = atoi(value);
+    }
+    if (httpd_query_key_value(args, "resync_every", value, sizeof(value)) == ESP_OK) {
+        resync_every = atoi(value);
+    }
 
-    esp_err_t prep_err = prepare_slave_capture(args, session, frame_count, fs, fmt);
+    esp_err_t prep_err = prepare_slave_capture(args, session, frame_count, fs, fmt,
+                                               (sync_interval_ms > 0) ? (int64_t)sync_interval_ms * 1000 : 0,
+                                               (resync_every > 0) ? resync_every : CONFIG_CAPSEQ_RESYNC_EVERY_FRAMES,
+                                               NULL, 0);
     if (prep_err != ESP_OK) {
         const char *msg = (prep_err == ESP_ERR_INVALID_STATE) ? "capture busy" : "capture prep failed";
         httpd_resp_send_err(req, HTTPD_409_CONFLICT, msg);
@@ -1133,14 +3132,21 @@ static esp_err_t init_mdns(void)
     ESP_ERROR_CHECK(mdns_hostname_set(hostname));
     ESP_ERROR_CHECK(mdns_instance_name_set("SlaveCam"));
     ESP_ERROR_CHECK(mdns_service_add(NULL, "_http", "_tcp", 80, NULL, 0));
+    /* Lets a master with CONFIG_CAPSEQ_SLAVE_MDNS_BROWSE find this slave. */
+    mdns_txt_item_t capseq_txt[] = {
+        { "id", CONFIG_SLAVE_ID },
+    };
+    ESP_ERROR_CHECK(mdns_service_add(NULL, "_capseq", "_udp", CONFIG_CAPSEQ_SYNC_UDP_PORT,
+                                     capseq_txt, 1));
     return ESP_OK;
 }
 
 static esp_err_t start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 9;
+    config.max_uri_handlers = 14;
     config.core_id = NET_TASK_CORE;
+    config.uri_match_fn = httpd_uri_match_wildcard;
 
     if (httpd_start(&s_httpd, &config) != ESP_OK) {
         return ESP_FAIL;
@@ -1194,12 +3200,36 @@ static esp_err_t start_webserver(void)
         .handler = stream_stop_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t snapshot_uri = {
+        .uri = "/snapshot.jpg",
+        .method = HTTP_GET,
+        .handler = snapshot_handler,
+        .user_ctx = NULL,
+    };
     httpd_uri_t status_uri = {
         .uri = "/api/status",
         .method = HTTP_GET,
         .handler = status_handler,
         .user_ctx = NULL,
     };
+    httpd_uri_t files_uri = {
+        .uri = "/api/files",
+        .method = HTTP_GET,
+        .handler = files_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t files_get_uri = {
+        .uri = "/api/files/*",
+        .method = HTTP_GET,
+        .handler = files_handler,
+        .user_ctx = NULL,
+    };
+    httpd_uri_t session_uri = {
+        .uri = "/api/session/*",
+        .method = HTTP_GET,
+        .handler = session_handler,
+        .user_ctx = NULL,
+    };
 
     httpd_register_uri_handler(s_httpd, &home_uri);
     httpd_register_uri_handler(s_httpd, &capture_uri);
@@ -1210,6 +3240,10 @@ static esp_err_t start_webserver(void)
     httpd_register_uri_handler(s_httpd, &stream_start_uri);
     httpd_register_uri_handler(s_httpd, &stream_stop_uri);
     httpd_register_uri_handler(s_httpd, &status_uri);
+    httpd_register_uri_handler(s_httpd, &snapshot_uri);
+    httpd_register_uri_handler(s_httpd, &session_uri);
+    httpd_register_uri_handler(s_httpd, &files_uri);
+    httpd_register_uri_handler(s_httpd, &files_get_uri);
 
     return ESP_OK;
 }
@@ -1219,8 +3253,13 @@ static esp_err_t start_stream_server(void)
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = 81;
     config.ctrl_port = 32769;
-    config.max_uri_handlers = 1;
+    config.max_uri_handlers = 2;
     config.core_id = NET_TASK_CORE;
+    config.close_fn = stream_sess_close;
+
+    if (init_stream_broadcaster() != ESP_OK) {
+        return ESP_FAIL;
+    }
 
     if (httpd_start(&s_stream_httpd, &config) != ESP_OK) {
         return ESP_FAIL;
@@ -1233,7 +3272,17 @@ static esp_err_t start_stream_server(void)
         .user_ctx = NULL,
     };
 
+    httpd_uri_t ws_uri = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = stream_ws_handler,
+        .user_ctx = NULL,
+        .is_websocket = true,
+        .handle_ws_control_frames = true,
+    };
+
     httpd_register_uri_handler(s_stream_httpd, &stream_uri);
+    httpd_register_uri_handler(s_stream_httpd, &ws_uri);
     return ESP_OK;
 }
 
@@ -4,22 +4,28 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <sys/param.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
 #include "esp_camera.h"
+#include "esp_crc.h"
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_psram.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
 #include "esp_system.h"
 #include "mdns.h"
 #include "nvs_flash.h"
@@ -50,16 +56,115 @@
 #define FRAME_HEIGHT 480
 #define FRAME_SIZE_BYTES (FRAME_WIDTH * FRAME_HEIGHT * 2)
 
-#define UDP_HEADER_SIZE 12
+#define UDP_HEADER_VERSION 2
+#define UDP_HEADER_SIZE 32
 #define UDP_DATA_CHUNK (UDP_PAYLOAD_MAX - UDP_HEADER_SIZE)
+_Static_assert(UDP_DATA_CHUNK % 4 == 0, "parity is XORed a word at a time");
+
+/* Pixel formats in the header. The camera delivers RGB565 high byte first. */
+#define UDP_FORMAT_RGB565_BE 1
+#define UDP_FORMAT_RGB565_LE 2
+#define UDP_FORMAT_GRAY8 3
+#define UDP_CAMERA_FORMAT UDP_FORMAT_RGB565_BE
+#if UDP_CAMERA_FORMAT == UDP_FORMAT_RGB565_BE
+#define UDP_PIXEL_HI 0          /* byte of a pixel holding R and the top of G */
+#define UDP_PIXEL_LO 1
+#else
+#define UDP_PIXEL_HI 1
+#define UDP_PIXEL_LO 0
+#endif
+
+/*
+ * Delta mode: the frame is cut into 16x10 pixel tiles and a delta frame
+ * carries only the tiles whose hash changed, four per packet, each as a
+ * u16 tile index followed by its rows. Every UDP_DELTA_KEYFRAME_EVERY-th
+ * frame goes out whole so the receiver resyncs after lost tiles. Hashes
+ * ignore the low bits of each channel (UDP_DELTA_PIXEL_MASK) so sensor
+ * noise alone does not count as a change.
+ */
+#define UDP_TILE_W 16
+#define UDP_TILE_H 10
+#define UDP_TILE_COLS (FRAME_WIDTH / UDP_TILE_W)
+#define UDP_TILE_ROWS (FRAME_HEIGHT / UDP_TILE_H)
+#define UDP_TILE_COUNT (UDP_TILE_COLS * UDP_TILE_ROWS)
+#define UDP_TILE_ENTRY_BYTES (2 + UDP_TILE_W * UDP_TILE_H * 2)
+#define UDP_TILES_PER_PACKET (UDP_DATA_CHUNK / UDP_TILE_ENTRY_BYTES)
+#define UDP_DELTA_KEYFRAME_EVERY 30
+/* Top 3 bits of R, G and B of the two pixels in a word as loaded from memory. */
+#if UDP_PIXEL_HI == 0
+#define UDP_DELTA_PIXEL_MASK 0x1CE71CE7u
+#else
+#define UDP_DELTA_PIXEL_MASK 0xE71CE71Cu
+#endif
+_Static_assert(FRAME_WIDTH % UDP_TILE_W == 0 && FRAME_HEIGHT % UDP_TILE_H == 0,
+               "tiles must cover the frame exactly");
+_Static_assert(UDP_TILE_W % 2 == 0, "tile rows are hashed a word at a time");
 
 #define CMD_START "START"
 #define CMD_STOP "STOP"
+#define CMD_STATS "STATS"
+#define CMD_TIME "TIME"         /* reply: time_us=<esp_timer clock>, to map capture_us */
+#define CMD_NACK "NACK"
+#define CMD_KEEPALIVE "KEEPALIVE"   /* refreshes a subscriber, no reply */
+#define CMD_OPT_NACK "NACK"     /* "START NACK": keep frames for retransmission */
+#define CMD_OPT_FEC "FEC="      /* "START FEC=8": one parity packet per 8 data packets */
+#define CMD_OPT_DELTA "DELTA"   /* "START DELTA": only send tiles that changed */
+#define CMD_OPT_GRAY "GRAY"     /* "START GRAY": 8-bit luma instead of RGB565 */
+#define CMD_OPT_DECIMATE "DECIMATE="    /* "START DECIMATE=2": every 2nd pixel and row */
+#define CMD_OPT_ROI "ROI="      /* "START ROI=x,y,w,h": crop, in full-frame pixels */
+#define CMD_OPT_PORT "PORT="    /* "START PORT=n": frames to this UDP port instead of 12501 */
+#define CMD_OPT_RATE "RATE="    /* "START RATE=n": at most n kbit/s of frames for this client */
+#define CMD_OPT_MCAST "MCAST"   /* "START MCAST": frames to UDP_MULTICAST_GROUP */
+
+#define UDP_FLAG_RETRANSMIT 0x0001
+#define UDP_FLAG_PARITY 0x0002
+#define UDP_FLAG_DELTA 0x0004
+#define UDP_FLAG_END 0x0008     /* after the data packets: u32 CRC-32 of the frame */
+#define UDP_FEC_GROUP_MAX 32
+#define UDP_ROI_MIN 16
+
+#ifndef CONFIG_UDP_STREAM_FEC_GROUP
+#define CONFIG_UDP_STREAM_FEC_GROUP 0
+#endif
+
+#ifndef CONFIG_UDP_STREAM_TARGET_KBPS
+#define CONFIG_UDP_STREAM_TARGET_KBPS 12000
+#endif
 
-#define UDP_SEND_RETRY_MAX 4
-#define UDP_SEND_RETRY_DELAY_MS 2
-#define UDP_SEND_PACE_EVERY_N 8
-#define UDP_SEND_PACE_DELAY_MS 1
+#define UDP_SEND_RETRY_MAX 8
+#define UDP_BUCKET_BURST_BYTES (4 * UDP_PAYLOAD_MAX)
+#define UDP_RATE_MIN_KBPS (CONFIG_UDP_STREAM_TARGET_KBPS / 8)
+#define UDP_STATS_INTERVAL_MS 5000
+/* Pacing waits sleep on a one-shot esp_timer and spin only this tail, which
+ * covers the timer's dispatch latency. */
+#define UDP_WAIT_SPIN_US 40
+
+/* 1: stage every packet in a stack buffer and sendto() it, as before
+ * sendmsg(); only kept to compare the per-frame cost. */
+#define UDP_SEND_COPY_PACKETS 0
+
+/* Frames kept after sending so NACKed packets can be re-sent, and how long
+ * they stay eligible. They come out of the camera's frame buffers, so the
+ * capture queue shrinks by the same amount. */
+#define UDP_NACK_HISTORY 2
+#define UDP_NACK_DEADLINE_MS 250
+#define UDP_NACK_QUEUE_LEN 4
+
+/* The stream task sleeps until a frame or NACK arrives; this bounds the
+ * sleep so held frames still expire. The control task wakes as often to
+ * time out subscribers. */
+#define UDP_IDLE_WAKE_MS 100
+
+/* Clients streaming at once. Each START comes from a control address that
+ * identifies the subscriber; one that sends nothing (KEEPALIVE, STATS, NACK,
+ * ...) for UDP_SUBSCRIBER_TIMEOUT_MS is dropped. */
+#define UDP_MAX_SUBSCRIBERS 4
+#define UDP_SUBSCRIBER_TIMEOUT_MS 5000
+#define UDP_MULTICAST_GROUP "239.255.0.50"
+#define UDP_MULTICAST_TTL 1
+
+#define FRAME_FB_COUNT 4
+#define FRAME_QUEUE_LEN MAX(FRAME_FB_COUNT - 1 - UDP_NACK_HISTORY, 1)
 
 #define INIT_DELAY_MS 200
 
@@ -73,29 +178,211 @@
 
 #define CAPTURE_TASK_STACK_SIZE 4096
 #define UDP_TASK_STACK_SIZE 6144
+#define UDP_CONTROL_TASK_STACK_SIZE 4096
 #define CAPTURE_TASK_PRIORITY 5
 #define UDP_TASK_PRIORITY 5
+/* Above the stream task on the same core, so a command preempts a frame
+ * between two packets instead of waiting for it to finish. */
+#define UDP_CONTROL_TASK_PRIORITY (UDP_TASK_PRIORITY + 1)
 
+/*
+ * Starts every stream datagram. Each packet describes its whole frame, so
+ * size and format can change between frames and any packet is enough to
+ * place its payload. Receivers should skip versions they do not know and
+ * take the payload from header_len on.
+ */
 typedef struct __attribute__((packed)) {
+    uint8_t version;        /* UDP_HEADER_VERSION */
+    uint8_t header_len;     /* sizeof(udp_frame_header_t) */
+    uint8_t format;         /* UDP_FORMAT_* */
+    uint8_t fec_group;      /* data packets per parity packet, 0 = no FEC */
     uint32_t frame_id;
     uint16_t packet_index;
-    uint16_t packet_count;
+    uint16_t packet_count;  /* data packets, not counting parity or the end packet */
     uint16_t payload_len;
-    uint16_t reserved;
+    uint16_t flags;         /* UDP_FLAG_* */
+    uint16_t width;         /* of the frame as sent, after crop and decimation */
+    uint16_t height;
+    uint16_t stride;        /* bytes per row */
+    uint16_t chunk_size;    /* data packet i carries bytes from i * chunk_size */
+    int64_t capture_us;     /* camera timestamp on the device clock (CMD_TIME) */
 } udp_frame_header_t;
+_Static_assert(sizeof(udp_frame_header_t) == UDP_HEADER_SIZE, "header layout");
+
+/* NACK from the receiver: bit i of the bitmap that follows asks for packet
+ * first_index + i of frame_id again. */
+typedef struct __attribute__((packed)) {
+    char magic[4];          /* CMD_NACK */
+    uint32_t frame_id;
+    uint16_t first_index;
+    uint16_t bit_count;
+} udp_nack_header_t;
+
+typedef struct {
+    camera_fb_t *fb;        /* NULL while the slot is free */
+    uint32_t frame_id;
+    int64_t sent_us;        /* when its last original packet went out */
+    uint32_t members;       /* bit i: s_subscribers[i] was sent this full frame */
+} udp_history_t;
 
 typedef struct {
     camera_fb_t *fb;
     uint32_t frame_id;
+    int64_t queued_us;      /* when the capture task queued it */
 } frame_item_t;
 
+/*
+ * Reduced stream mode chosen by START: crop to the ROI, keep every
+ * decimate-th pixel and row, optionally as luma. The full-frame mode sends
+ * the camera buffer as is; the others convert into s_mode_buf first.
+ */
+typedef struct {
+    bool gray;
+    uint8_t decimate;       /* 1, 2 or 4 */
+    uint16_t roi_x;
+    uint16_t roi_y;
+    uint16_t roi_w;
+    uint16_t roi_h;
+} udp_stream_mode_t;
+
+/* What a subscriber asked for in START. */
+typedef struct {
+    udp_stream_mode_t mode;
+    uint8_t fec_group;
+    bool nack;
+    bool delta;
+    bool multicast;
+    uint32_t rate_kbps;     /* 0 = as fast as the link allows */
+} udp_profile_t;
+
+typedef struct {
+    bool active;
+    struct sockaddr_in ctrl_addr;   /* where its commands come from: its identity */
+    struct sockaddr_in data_addr;   /* unicast frames and retransmissions */
+    udp_profile_t profile;
+    int64_t last_seen_us;
+    int64_t credit_bytes;   /* RATE= allowance; a frame goes out once it covers it */
+    int64_t credit_us;
+    bool has_frame;         /* last_frame_id is valid */
+    uint32_t last_frame_id; /* last frame it was sent, needed under a delta frame */
+    int delta_frames_left;  /* delta frames before its next keyframe */
+} udp_subscriber_t;
+
+/* Addresses one frame goes to. Every packet is sent to all of them before
+ * the next one is read, so the frame leaves PSRAM once however many
+ * subscribers share it. An address is skipped as soon as none of the
+ * subscribers it was added for is active any more. */
+typedef struct {
+    struct sockaddr_in addr[UDP_MAX_SUBSCRIBERS];
+    uint32_t owners[UDP_MAX_SUBSCRIBERS];   /* bit i: s_subscribers[i] */
+    int count;
+} udp_dest_list_t;
+
+/* A NACK handed from the control task to the stream task, with what the
+ * stream task needs of its subscriber. */
+typedef struct {
+    int subscriber;
+    struct sockaddr_in data_addr;
+    uint8_t fec_group;
+    uint16_t len;
+    uint8_t buf[256];
+} udp_nack_item_t;
+
+typedef enum {
+    UDP_SEND_FULL,          /* the camera buffer as is; the only kind kept for NACKs */
+    UDP_SEND_REDUCED,       /* converted by udp_mode_convert() */
+    UDP_SEND_DELTA,         /* tiles changed since the previous scanned frame */
+} udp_send_kind_t;
+
+/* Subscribers that get the same bytes for a frame. */
+typedef struct {
+    udp_send_kind_t kind;
+    udp_stream_mode_t mode;
+    uint8_t fec_group;
+    bool nack;
+    uint32_t members;       /* bit i: s_subscribers[i] */
+    udp_dest_list_t dests;
+} udp_send_group_t;
+
+/*
+ * Token bucket: bytes accrue at rate_kbps and a packet waits until its size
+ * is available, so packets leave evenly spaced instead of in tick-sized
+ * bursts. ENOBUFS cuts the rate; every clean frame wins part of it back.
+ */
+typedef struct {
+    int64_t last_us;
+    int64_t tokens;         /* bytes that may be sent right now */
+    uint32_t rate_kbps;     /* current rate, at most CONFIG_UDP_STREAM_TARGET_KBPS */
+} udp_bucket_t;
+
+/* Send-side counters, logged and reset every UDP_STATS_INTERVAL_MS. */
+typedef struct {
+    int64_t window_start_us;
+    uint32_t frames;
+    uint32_t packets;
+    uint32_t retries;       /* ENOBUFS/ENOMEM/EAGAIN, each followed by a back-off */
+    uint32_t errors;        /* packets given up on */
+    uint32_t nacks;
+    uint32_t retransmits;   /* packets re-sent for NACKs */
+    uint32_t nack_late;     /* NACKs for frames no longer held */
+    uint32_t parity;        /* FEC parity packets */
+    uint32_t tiles;         /* tiles sent in delta frames */
+    uint64_t bytes;
+    int64_t send_us_total;
+    int64_t send_us_max;
+    int64_t queue_us_total; /* from xQueueSend() to the frame's first packet */
+    int64_t queue_us_max;
+} udp_stats_t;
+
+/* The last complete stats window, as reported by STATS. */
+typedef struct {
+    uint32_t fps_x100;
+    uint32_t kbps;
+    uint32_t rate_kbps;
+    int64_t us_per_frame;
+    int64_t us_max;
+    int64_t queue_us;
+    int64_t queue_us_max;
+    uint32_t packets;
+    uint32_t retries;
+    uint32_t errors;
+    uint32_t nacks;
+    uint32_t retransmits;
+    uint32_t nack_late;
+    uint32_t parity;
+    uint32_t tiles;
+} udp_stats_summary_t;
+
 static QueueHandle_t s_frame_queue = NULL;
+static QueueHandle_t s_nack_queue = NULL;
+static TaskHandle_t s_udp_task = NULL;
+/* Guards s_subscribers and s_udp_summary, shared by the control and stream tasks. */
+static SemaphoreHandle_t s_udp_lock = NULL;
+static esp_timer_handle_t s_wait_timer = NULL;
+static SemaphoreHandle_t s_wait_done = NULL;  /* given by s_wait_timer */
 static EventGroupHandle_t s_wifi_event_group = NULL;
 static const int WIFI_CONNECTED_BIT = BIT0;
 
-static volatile bool s_stream_enabled = false;
-static volatile bool s_client_valid = false;
-static struct sockaddr_in s_stream_client = {0};
+static volatile bool s_stream_enabled = false;  /* any subscriber active */
+static volatile bool s_stream_restart = false;  /* first subscriber joined: reset the send state */
+static volatile uint32_t s_active_mask = 0;     /* bit i: s_subscribers[i].active */
+static udp_subscriber_t s_subscribers[UDP_MAX_SUBSCRIBERS];
+static struct sockaddr_in s_multicast_addr = {0};
+static udp_stats_t s_udp_stats = {0};
+static int64_t s_first_packet_us = 0;  /* first packet of the frame being sent, 0 until then */
+static udp_stats_summary_t s_udp_summary = {0};
+static udp_bucket_t s_udp_bucket = {.rate_kbps = CONFIG_UDP_STREAM_TARGET_KBPS};
+static udp_history_t s_udp_history[UDP_NACK_HISTORY];
+static uint32_t s_fec_parity[UDP_DATA_CHUNK / 4];
+static uint32_t s_subscribers_changed = 0;  /* bit i: slot i reset by START/STOP */
+static bool s_delta_scanned = false;
+static uint32_t s_delta_scan_id = 0;    /* frame s_tile_hash was taken from */
+static uint32_t s_tile_hash[UDP_TILE_COUNT];
+static uint8_t s_tile_changed[(UDP_TILE_COUNT + 7) / 8];
+static uint8_t s_delta_packet[UDP_DATA_CHUNK];
+static uint8_t *s_mode_buf = NULL;
+static uint16_t s_gray_lut_hi[256];
+static uint16_t s_gray_lut_lo[256];
 
 static void init_delay_ms(uint32_t ms)
 {
@@ -187,7 +474,7 @@ static esp_err_t init_camera_rgb565(void)
         .pixel_format = PIXFORMAT_RGB565,
         .frame_size = FRAMESIZE_VGA,
         .jpeg_quality = 12,
-        .fb_count = 4,
+        .fb_count = FRAME_FB_COUNT,
         .grab_mode = CAMERA_GRAB_WHEN_EMPTY,
         .fb_location = CAMERA_FB_IN_PSRAM,
     };
@@ -227,79 +514,861 @@ static void drain_frame_queue(void)
     }
 }
 
-static esp_err_t udp_send_frame(int sock, const struct sockaddr_in *dest, const frame_item_t *item)
+static void udp_wait_timer_cb(void *arg)
 {
-    static TickType_t s_last_send_err_tick = 0;
-    if (!dest || !item || !item->fb) {
-        return ESP_ERR_INVALID_ARG;
+    (void)arg;
+    xSemaphoreGive(s_wait_done);
+}
+
+/*
+ * Waits us microseconds. The task blocks on a one-shot esp_timer, so waits
+ * shorter than a tick do not busy the core Wi-Fi and lwIP run on, and only
+ * the last UDP_WAIT_SPIN_US are spun. Pacing does not depend on
+ * CONFIG_FREERTOS_HZ.
+ */
+static void udp_wait_us(int64_t us)
+{
+    const int64_t end_us = esp_timer_get_time() + us;
+    if (us > UDP_WAIT_SPIN_US) {
+        if (esp_timer_start_once(s_wait_timer, us - UDP_WAIT_SPIN_US) == ESP_OK) {
+            xSemaphoreTake(s_wait_done, portMAX_DELAY);
+        } else {
+            vTaskDelay(MAX(us / (portTICK_PERIOD_MS * 1000), 1));
+        }
+    }
+    const int64_t left_us = end_us - esp_timer_get_time();
+    if (left_us > 0) {
+        esp_rom_delay_us((uint32_t)left_us);
     }
+}
 
-    const uint8_t *data = item->fb->buf;
-    size_t frame_len = item->fb->len;
-    if (frame_len < FRAME_SIZE_BYTES) {
-        LOGW("Frame too small: %u bytes", (unsigned)frame_len);
-        return ESP_ERR_INVALID_SIZE;
+static void udp_bucket_refill(udp_bucket_t *bucket, int64_t now_us)
+{
+    if (bucket->last_us == 0) {
+        bucket->last_us = now_us;
+        bucket->tokens = UDP_BUCKET_BURST_BYTES;
     }
-    if (frame_len > FRAME_SIZE_BYTES) {
-        frame_len = FRAME_SIZE_BYTES;
+    bucket->tokens += (now_us - bucket->last_us) * bucket->rate_kbps / 8000;
+    if (bucket->tokens > UDP_BUCKET_BURST_BYTES) {
+        bucket->tokens = UDP_BUCKET_BURST_BYTES;
     }
+    bucket->last_us = now_us;
+}
 
-    const uint16_t packet_count = (frame_len + UDP_DATA_CHUNK - 1) / UDP_DATA_CHUNK;
+/* Blocks until len bytes may go out at the current rate, then spends them. */
+static void udp_bucket_take(udp_bucket_t *bucket, size_t len)
+{
+    udp_bucket_refill(bucket, esp_timer_get_time());
+    if (bucket->tokens < (int64_t)len) {
+        udp_wait_us(((int64_t)len - bucket->tokens) * 8000 / bucket->rate_kbps);
+        udp_bucket_refill(bucket, esp_timer_get_time());
+    }
+    bucket->tokens -= len;
+}
 
-    uint8_t packet[UDP_PAYLOAD_MAX];
-    for (uint16_t idx = 0; idx < packet_count; ++idx) {
-        if (!s_stream_enabled) {
-            return ESP_OK;
-        }
-        size_t offset = (size_t)idx * UDP_DATA_CHUNK;
-        size_t chunk = frame_len - offset;
-        if (chunk > UDP_DATA_CHUNK) {
-            chunk = UDP_DATA_CHUNK;
-        }
+/* lwIP ran out of buffers: send slower and let the queue drain for a packet time. */
+static void udp_bucket_backoff(udp_bucket_t *bucket)
+{
+    bucket->rate_kbps = MAX(bucket->rate_kbps * 3 / 4, UDP_RATE_MIN_KBPS);
+    bucket->tokens = 0;
+    udp_wait_us((int64_t)UDP_PAYLOAD_MAX * 8000 / bucket->rate_kbps);
+    bucket->last_us = esp_timer_get_time();
+}
 
-        udp_frame_header_t header = {
-            .frame_id = item->frame_id,
-            .packet_index = idx,
-            .packet_count = packet_count,
-            .payload_len = (uint16_t)chunk,
-            .reserved = 0,
-        };
+static void udp_bucket_recover(udp_bucket_t *bucket)
+{
+    bucket->rate_kbps = MIN(bucket->rate_kbps + CONFIG_UDP_STREAM_TARGET_KBPS / 16,
+                            CONFIG_UDP_STREAM_TARGET_KBPS);
+}
+
+static size_t udp_chunk_len(size_t frame_len, uint16_t idx)
+{
+    return MIN(frame_len - (size_t)idx * UDP_DATA_CHUNK, (size_t)UDP_DATA_CHUNK);
+}
+
+static int64_t udp_fb_time_us(const camera_fb_t *fb)
+{
+    return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
 
-        memcpy(packet, &header, sizeof(header));
-        memcpy(packet + sizeof(header), data + offset, chunk);
+/*
+ * Sends one header + payload datagram to every destination through the token
+ * bucket, backing off on ENOBUFS. Fails only if no destination took it, so
+ * one unreachable subscriber does not cut the frame short for the others.
+ * Destinations whose subscribers have stopped are skipped; with none left
+ * it returns ESP_ERR_NOT_FOUND.
+ */
+static esp_err_t udp_send_datagram(int sock, const udp_dest_list_t *dests,
+                                   const udp_frame_header_t *header, const void *payload,
+                                   bool *backed_off)
+{
+    static TickType_t s_last_send_err_tick = 0;
+    const size_t chunk = header->payload_len;
 
+#if UDP_SEND_COPY_PACKETS
+    uint8_t packet[UDP_PAYLOAD_MAX];
+    memcpy(packet, header, sizeof(*header));
+    memcpy(packet + sizeof(*header), payload, chunk);
+#else
+    /* Header from the stack, pixels straight from the PSRAM frame buffer. */
+    struct iovec iov[2] = {
+        {.iov_base = (void *)header, .iov_len = sizeof(*header)},
+        {.iov_base = (void *)payload, .iov_len = chunk},
+    };
+    struct msghdr msg = {
+        .msg_namelen = sizeof(struct sockaddr_in),
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+#endif
+
+    int delivered = 0;
+    int skipped = 0;
+    for (int d = 0; d < dests->count; ++d) {
+        const struct sockaddr_in *dest = &dests->addr[d];
+        if (!(dests->owners[d] & s_active_mask)) {
+            skipped++;
+            continue;
+        }
         int sent = -1;
         int send_errno = 0;
+#if !UDP_SEND_COPY_PACKETS
+        msg.msg_name = (void *)dest;
+#endif
         for (int attempt = 0; attempt < UDP_SEND_RETRY_MAX; ++attempt) {
-            sent = sendto(sock, packet, sizeof(header) + chunk, 0,
+            udp_bucket_take(&s_udp_bucket, sizeof(*header) + chunk);
+#if UDP_SEND_COPY_PACKETS
+            sent = sendto(sock, packet, sizeof(*header) + chunk, 0,
                           (const struct sockaddr *)dest, sizeof(*dest));
+#else
+            sent = sendmsg(sock, &msg, 0);
+#endif
             if (sent >= 0) {
                 break;
             }
             send_errno = errno;
             if (send_errno == ENOMEM || send_errno == ENOBUFS || send_errno == EAGAIN) {
-                vTaskDelay(pdMS_TO_TICKS(UDP_SEND_RETRY_DELAY_MS));
+                s_udp_stats.retries++;
+                udp_bucket_backoff(&s_udp_bucket);
+                *backed_off = true;
                 continue;
             }
             break;
         }
         if (sent < 0) {
+            s_udp_stats.errors++;
             TickType_t now_tick = xTaskGetTickCount();
             if (now_tick - s_last_send_err_tick > pdMS_TO_TICKS(1000)) {
-                LOGW("UDP send failed: errno=%d", send_errno);
+                LOGW("UDP send to %s failed: errno=%d", inet_ntoa(dest->sin_addr), send_errno);
                 s_last_send_err_tick = now_tick;
             }
-            return ESP_FAIL;
+            continue;
+        }
+        s_udp_stats.packets++;
+        s_udp_stats.bytes += sent;
+        delivered++;
+        if (s_first_packet_us == 0 && !(header->flags & UDP_FLAG_RETRANSMIT)) {
+            s_first_packet_us = esp_timer_get_time();
         }
+    }
+    if (skipped == dests->count) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return delivered > 0 ? ESP_OK : ESP_FAIL;
+}
+
+/* Header fields shared by every packet of a frame. */
+static udp_frame_header_t udp_frame_header(uint32_t frame_id, uint16_t width, uint16_t height,
+                                           uint8_t format, uint8_t fec_group, int64_t capture_us)
+{
+    const size_t stride = (size_t)width * (format == UDP_FORMAT_GRAY8 ? 1 : 2);
+    return (udp_frame_header_t){
+        .version = UDP_HEADER_VERSION,
+        .header_len = sizeof(udp_frame_header_t),
+        .format = format,
+        .fec_group = fec_group,
+        .frame_id = frame_id,
+        .packet_count = (stride * height + UDP_DATA_CHUNK - 1) / UDP_DATA_CHUNK,
+        .width = width,
+        .height = height,
+        .stride = (uint16_t)stride,
+        .chunk_size = UDP_DATA_CHUNK,
+        .capture_us = capture_us,
+    };
+}
+
+/* Sends data packet idx of a frame. */
+static esp_err_t udp_send_packet(int sock, const udp_dest_list_t *dests,
+                                 const udp_frame_header_t *frame, const uint8_t *data,
+                                 size_t frame_len, uint16_t idx, uint16_t flags, bool *backed_off)
+{
+    udp_frame_header_t header = *frame;
+    header.packet_index = idx;
+    header.payload_len = (uint16_t)udp_chunk_len(frame_len, idx);
+    header.flags |= flags;
+    return udp_send_datagram(sock, dests, &header, data + (size_t)idx * UDP_DATA_CHUNK, backed_off);
+}
 
-        if ((idx % UDP_SEND_PACE_EVERY_N) == 0) {
-            vTaskDelay(pdMS_TO_TICKS(UDP_SEND_PACE_DELAY_MS));
+/* XORs one chunk into the parity. Chunks start at multiples of UDP_DATA_CHUNK
+ * in a word-aligned frame buffer, so all but a short last chunk go by words. */
+static void udp_fec_accumulate(const uint8_t *data, size_t len)
+{
+    const uint32_t *words = (const uint32_t *)data;
+    for (size_t i = 0; i < len / 4; ++i) {
+        s_fec_parity[i] ^= words[i];
+    }
+    uint8_t *parity = (uint8_t *)s_fec_parity;
+    for (size_t i = len & ~(size_t)3; i < len; ++i) {
+        parity[i] ^= data[i];
+    }
+}
+
+/*
+ * Parity packet for FEC group `group`: packet_index is the group number and
+ * the payload is the XOR of the group's data packets, zero-padded to the
+ * longest, so the receiver can rebuild any single lost packet of the group.
+ */
+static esp_err_t udp_send_parity(int sock, const udp_dest_list_t *dests,
+                                 const udp_frame_header_t *frame, uint16_t group,
+                                 size_t parity_len, bool *backed_off)
+{
+    udp_frame_header_t header = *frame;
+    header.packet_index = group;
+    header.payload_len = (uint16_t)parity_len;
+    header.flags |= UDP_FLAG_PARITY;
+    esp_err_t err = udp_send_datagram(sock, dests, &header, s_fec_parity, backed_off);
+    if (err == ESP_OK) {
+        s_udp_stats.parity++;
+    }
+    return err;
+}
+
+static void udp_serve_nacks(int sock);
+
+/*
+ * Sends frame_len bytes of data as one frame, with FEC parity if enabled.
+ * Queued NACKs are served between packets, and the frame is abandoned
+ * within a packet once the last subscriber stops.
+ */
+static esp_err_t udp_send_frame(int sock, const udp_dest_list_t *dests,
+                                const udp_frame_header_t *frame, const uint8_t *data,
+                                size_t frame_len)
+{
+    if (!dests || !frame || !data) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const uint16_t packet_count = frame->packet_count;
+    const uint16_t fec_group = frame->fec_group;
+    size_t parity_len = 0;
+    uint32_t crc = 0;
+    bool backed_off = false;
+    for (uint16_t idx = 0; idx < packet_count; ++idx) {
+        udp_serve_nacks(sock);
+        if (!s_stream_enabled) {
+            return ESP_OK;
+        }
+        esp_err_t err = udp_send_packet(sock, dests, frame, data, frame_len, idx, 0, &backed_off);
+        if (err != ESP_OK) {
+            return err;
+        }
+        /* The chunk was just copied into a pbuf, so it is still in cache. */
+        size_t chunk = udp_chunk_len(frame_len, idx);
+        crc = esp_crc32_le(crc, data + (size_t)idx * UDP_DATA_CHUNK, chunk);
+        if (fec_group == 0) {
+            continue;
+        }
+        if (idx % fec_group == 0) {
+            memset(s_fec_parity, 0, sizeof(s_fec_parity));
+            parity_len = chunk;
+        }
+        udp_fec_accumulate(data + (size_t)idx * UDP_DATA_CHUNK, chunk);
+        if (idx % fec_group == fec_group - 1 || idx == packet_count - 1) {
+            err = udp_send_parity(sock, dests, frame, idx / fec_group, parity_len, &backed_off);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+
+    udp_frame_header_t end = *frame;
+    end.packet_index = packet_count;
+    end.payload_len = sizeof(crc);
+    end.flags = UDP_FLAG_END;
+    esp_err_t err = udp_send_datagram(sock, dests, &end, &crc, &backed_off);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (!backed_off) {
+        udp_bucket_recover(&s_udp_bucket);
+    }
+    return ESP_OK;
+}
+
+/*
+ * Hashes every tile (FNV-1a over masked words) and marks the ones that differ
+ * from the last frame in s_tile_changed. Rows are walked in memory order with
+ * one running hash per tile column. Returns the number of changed tiles.
+ */
+static size_t udp_delta_scan(const uint8_t *frame)
+{
+    uint32_t hash[UDP_TILE_COLS];
+    size_t changed = 0;
+
+    memset(s_tile_changed, 0, sizeof(s_tile_changed));
+    for (int ty = 0; ty < UDP_TILE_ROWS; ++ty) {
+        for (int tx = 0; tx < UDP_TILE_COLS; ++tx) {
+            hash[tx] = 2166136261u;
+        }
+        for (int y = ty * UDP_TILE_H; y < (ty + 1) * UDP_TILE_H; ++y) {
+            const uint32_t *row = (const uint32_t *)(frame + (size_t)y * FRAME_WIDTH * 2);
+            for (int tx = 0; tx < UDP_TILE_COLS; ++tx) {
+                const uint32_t *words = row + tx * (UDP_TILE_W / 2);
+                uint32_t h = hash[tx];
+                for (int i = 0; i < UDP_TILE_W / 2; ++i) {
+                    h = (h ^ (words[i] & UDP_DELTA_PIXEL_MASK)) * 16777619u;
+                }
+                hash[tx] = h;
+            }
+        }
+        for (int tx = 0; tx < UDP_TILE_COLS; ++tx) {
+            int tile = ty * UDP_TILE_COLS + tx;
+            if (hash[tx] != s_tile_hash[tile]) {
+                s_tile_hash[tile] = hash[tx];
+                s_tile_changed[tile / 8] |= 1u << (tile % 8);
+                changed++;
+            }
+        }
+    }
+    return changed;
+}
+
+/* Appends tile `tile` of the frame to s_delta_packet at offset `used`. */
+static void udp_delta_pack_tile(const uint8_t *frame, int tile, size_t used)
+{
+    const uint16_t index = (uint16_t)tile;
+    const int x = (tile % UDP_TILE_COLS) * UDP_TILE_W;
+    const int y = (tile / UDP_TILE_COLS) * UDP_TILE_H;
+    uint8_t *entry = s_delta_packet + used;
+
+    memcpy(entry, &index, sizeof(index));
+    entry += sizeof(index);
+    for (int row = 0; row < UDP_TILE_H; ++row) {
+        memcpy(entry, frame + ((size_t)(y + row) * FRAME_WIDTH + x) * 2, UDP_TILE_W * 2);
+        entry += UDP_TILE_W * 2;
+    }
+}
+
+/* Sends the tiles marked in s_tile_changed, UDP_TILES_PER_PACKET per packet. */
+static esp_err_t udp_send_delta(int sock, const udp_dest_list_t *dests,
+                                const frame_item_t *item, size_t changed)
+{
+    const uint8_t *frame = item->fb->buf;
+    udp_frame_header_t header = udp_frame_header(item->frame_id, FRAME_WIDTH, FRAME_HEIGHT,
+                                                 UDP_CAMERA_FORMAT, 0, udp_fb_time_us(item->fb));
+    header.chunk_size = 0;
+    header.packet_count = (changed + UDP_TILES_PER_PACKET - 1) / UDP_TILES_PER_PACKET;
+    header.flags = UDP_FLAG_DELTA;
+    size_t used = 0;
+    size_t left = changed;
+    bool backed_off = false;
+
+    for (int tile = 0; tile < UDP_TILE_COUNT && left > 0; ++tile) {
+        if (!(s_tile_changed[tile / 8] & (1u << (tile % 8)))) {
+            continue;
+        }
+        udp_delta_pack_tile(frame, tile, used);
+        used += UDP_TILE_ENTRY_BYTES;
+        left--;
+        if (used + UDP_TILE_ENTRY_BYTES <= UDP_DATA_CHUNK && left > 0) {
+            continue;
+        }
+
+        udp_serve_nacks(sock);
+        if (!s_stream_enabled) {
+            return ESP_OK;
+        }
+        header.payload_len = (uint16_t)used;
+        esp_err_t err = udp_send_datagram(sock, dests, &header, s_delta_packet, &backed_off);
+        if (err != ESP_OK) {
+            return err;
         }
+        s_udp_stats.tiles += used / UDP_TILE_ENTRY_BYTES;
+        header.packet_index++;
+        used = 0;
     }
 
+    if (!backed_off) {
+        udp_bucket_recover(&s_udp_bucket);
+    }
     return ESP_OK;
 }
 
+/*
+ * Luma lookup tables: Y = 0.30 R + 0.59 G + 0.11 B is linear in the RGB565
+ * bits, so each byte of a pixel contributes independently and
+ * (lut_hi[hi] + lut_lo[lo]) >> 8 is the 8-bit luma: two loads and an add
+ * per pixel, no multiplies.
+ */
+static void udp_gray_init(void)
+{
+    const uint32_t kr = (77 * 255 + 15) / 31;   /* per step of R5, scaled by 256 */
+    const uint32_t kg = (150 * 255 + 31) / 63;  /* per step of G6 */
+    const uint32_t kb = (29 * 255 + 15) / 31;   /* per step of B5 */
+    for (uint32_t b = 0; b < 256; ++b) {
+        s_gray_lut_hi[b] = (uint16_t)((b >> 3) * kr + ((b & 0x07) << 3) * kg);
+        s_gray_lut_lo[b] = (uint16_t)((b >> 5) * kg + (b & 0x1F) * kb);
+    }
+}
+
+static bool udp_mode_is_full(const udp_stream_mode_t *mode)
+{
+    return !mode->gray && mode->decimate == 1 && mode->roi_w == FRAME_WIDTH &&
+           mode->roi_h == FRAME_HEIGHT;
+}
+
+/* Parses GRAY, DECIMATE=n and ROI=x,y,w,h from START; the ROI is clamped
+ * to the frame and trimmed to a multiple of the decimation. */
+static udp_stream_mode_t udp_mode_parse(const char *opts)
+{
+    udp_stream_mode_t mode = {.decimate = 1, .roi_w = FRAME_WIDTH, .roi_h = FRAME_HEIGHT};
+    mode.gray = strstr(opts, CMD_OPT_GRAY) != NULL;
+
+    const char *decimate = strstr(opts, CMD_OPT_DECIMATE);
+    if (decimate) {
+        long n = strtol(decimate + strlen(CMD_OPT_DECIMATE), NULL, 10);
+        mode.decimate = (n == 2 || n == 4) ? (uint8_t)n : 1;
+    }
+
+    const char *roi = strstr(opts, CMD_OPT_ROI);
+    int x = 0, y = 0, w = 0, h = 0;
+    if (roi && sscanf(roi + strlen(CMD_OPT_ROI), "%d,%d,%d,%d", &x, &y, &w, &h) == 4 &&
+        x >= 0 && y >= 0 && x <= FRAME_WIDTH - UDP_ROI_MIN && y <= FRAME_HEIGHT - UDP_ROI_MIN) {
+        w = MIN(MAX(w, UDP_ROI_MIN), FRAME_WIDTH - x);
+        h = MIN(MAX(h, UDP_ROI_MIN), FRAME_HEIGHT - y);
+        mode.roi_x = x;
+        mode.roi_y = y;
+        mode.roi_w = w;
+        mode.roi_h = h;
+    }
+    mode.roi_w -= mode.roi_w % mode.decimate;
+    mode.roi_h -= mode.roi_h % mode.decimate;
+    return mode;
+}
+
+/* Crops, decimates and optionally converts the camera frame into out;
+ * returns the number of bytes written. */
+static size_t udp_mode_convert(const udp_stream_mode_t *mode, const uint8_t *frame, uint8_t *out)
+{
+    const int step = mode->decimate;
+    const int out_w = mode->roi_w / step;
+    const int out_h = mode->roi_h / step;
+    uint8_t *dst = out;
+
+    for (int oy = 0; oy < out_h; ++oy) {
+        const uint8_t *src = frame + ((size_t)(mode->roi_y + oy * step) * FRAME_WIDTH + mode->roi_x) * 2;
+        if (mode->gray) {
+            for (int ox = 0; ox < out_w; ++ox, src += step * 2) {
+                *dst++ = (uint8_t)((s_gray_lut_hi[src[UDP_PIXEL_HI]] +
+                                    s_gray_lut_lo[src[UDP_PIXEL_LO]]) >> 8);
+            }
+        } else if (step == 1) {
+            memcpy(dst, src, (size_t)out_w * 2);
+            dst += out_w * 2;
+        } else {
+            for (int ox = 0; ox < out_w; ++ox, src += step * 2) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst += 2;
+            }
+        }
+    }
+    return dst - out;
+}
+
+static bool udp_mode_equal(const udp_stream_mode_t *a, const udp_stream_mode_t *b)
+{
+    return a->gray == b->gray && a->decimate == b->decimate && a->roi_x == b->roi_x &&
+           a->roi_y == b->roi_y && a->roi_w == b->roi_w && a->roi_h == b->roi_h;
+}
+
+static bool udp_addr_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*
+ * RATE= admission: credit accrues at the subscriber's rate, capped at a
+ * quarter second's worth, and a frame goes to it while the credit is not
+ * negative. The bytes actually sent are charged afterwards.
+ */
+static bool udp_subscriber_admit(udp_subscriber_t *sub, int64_t now_us)
+{
+    const uint32_t rate_kbps = sub->profile.rate_kbps;
+    if (rate_kbps == 0) {
+        return true;
+    }
+    if (sub->credit_us != 0) {
+        sub->credit_bytes += (now_us - sub->credit_us) * rate_kbps / 8000;
+        sub->credit_bytes = MIN(sub->credit_bytes, (int64_t)rate_kbps * 1000 / 8 / 4);
+    }
+    sub->credit_us = now_us;
+    return sub->credit_bytes >= 0;
+}
+
+/* Puts a subscriber into the group sending the same bytes, or opens one. */
+static void udp_group_add(udp_send_group_t *groups, int *group_count, const udp_send_group_t *key,
+                          int sub_index, const struct sockaddr_in *dest)
+{
+    udp_send_group_t *group = NULL;
+    for (int g = 0; g < *group_count && !group; ++g) {
+        if (groups[g].kind == key->kind && groups[g].fec_group == key->fec_group &&
+            udp_mode_equal(&groups[g].mode, &key->mode)) {
+            group = &groups[g];
+        }
+    }
+    if (!group) {
+        group = &groups[(*group_count)++];
+        *group = *key;
+        group->nack = false;
+        group->members = 0;
+        group->dests.count = 0;
+    }
+    group->nack |= key->nack;
+    group->members |= 1u << sub_index;
+    for (int d = 0; d < group->dests.count; ++d) {
+        if (udp_addr_equal(&group->dests.addr[d], dest)) {
+            group->dests.owners[d] |= 1u << sub_index;  /* multicast subscribers share one address */
+            return;
+        }
+    }
+    group->dests.addr[group->dests.count] = *dest;
+    group->dests.owners[group->dests.count++] = 1u << sub_index;
+}
+
+/*
+ * Picks what each subscriber gets for this frame. Reduced modes get their
+ * converted frame. Delta subscribers get the changed tiles if they were sent
+ * the frame the tile hashes were last taken from, else a keyframe, which
+ * they also get every UDP_DELTA_KEYFRAME_EVERY frames. Everyone else gets the
+ * camera buffer. Subscribers over their RATE= are skipped.
+ */
+static int udp_group_subscribers(const frame_item_t *item, int64_t now_us,
+                                 udp_send_group_t *groups, size_t *changed)
+{
+    bool admitted[UDP_MAX_SUBSCRIBERS] = {0};
+    bool any_delta = false;
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+        udp_subscriber_t *sub = &s_subscribers[i];
+        admitted[i] = sub->active && udp_subscriber_admit(sub, now_us);
+        any_delta |= admitted[i] && sub->profile.delta;
+    }
+
+    const bool had_scan = s_delta_scanned;
+    const uint32_t prev_scan_id = s_delta_scan_id;
+    if (any_delta) {
+        *changed = udp_delta_scan(item->fb->buf);
+        s_delta_scanned = true;
+        s_delta_scan_id = item->frame_id;
+    }
+
+    int group_count = 0;
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+        udp_subscriber_t *sub = &s_subscribers[i];
+        if (!admitted[i]) {
+            continue;
+        }
+        const udp_profile_t *profile = &sub->profile;
+        udp_send_group_t key = {
+            .kind = UDP_SEND_FULL,
+            .mode = {.decimate = 1, .roi_w = FRAME_WIDTH, .roi_h = FRAME_HEIGHT},
+            .fec_group = profile->fec_group,
+        };
+        if (!udp_mode_is_full(&profile->mode) && s_mode_buf) {
+            key.kind = UDP_SEND_REDUCED;
+            key.mode = profile->mode;
+        } else if (profile->delta && had_scan && sub->has_frame &&
+                   sub->last_frame_id == prev_scan_id && sub->delta_frames_left > 0) {
+            key.kind = UDP_SEND_DELTA;
+            key.fec_group = 0;
+            sub->delta_frames_left--;
+        } else {
+            key.nack = profile->nack;
+            sub->delta_frames_left = UDP_DELTA_KEYFRAME_EVERY - 1;
+        }
+        udp_group_add(groups, &group_count, &key, i,
+                      profile->multicast ? &s_multicast_addr : &sub->data_addr);
+    }
+    return group_count;
+}
+
+static esp_err_t udp_send_group(int sock, const udp_send_group_t *group,
+                                const frame_item_t *item, size_t changed)
+{
+    const int64_t capture_us = udp_fb_time_us(item->fb);
+    if (group->kind == UDP_SEND_DELTA) {
+        return udp_send_delta(sock, &group->dests, item, changed);
+    }
+    if (group->kind == UDP_SEND_REDUCED) {
+        const udp_stream_mode_t *mode = &group->mode;
+        size_t len = udp_mode_convert(mode, item->fb->buf, s_mode_buf);
+        const udp_frame_header_t frame =
+            udp_frame_header(item->frame_id, mode->roi_w / mode->decimate,
+                             mode->roi_h / mode->decimate,
+                             mode->gray ? UDP_FORMAT_GRAY8 : UDP_CAMERA_FORMAT,
+                             group->fec_group, capture_us);
+        return udp_send_frame(sock, &group->dests, &frame, s_mode_buf, len);
+    }
+    const udp_frame_header_t frame = udp_frame_header(item->frame_id, FRAME_WIDTH, FRAME_HEIGHT,
+                                                      UDP_CAMERA_FORMAT, group->fec_group,
+                                                      capture_us);
+    return udp_send_frame(sock, &group->dests, &frame, item->fb->buf,
+                          FRAME_SIZE_BYTES);
+}
+
+/*
+ * Sends one camera frame to every subscriber, one pass over the frame per
+ * group of subscribers that get the same bytes. *keep is set to the
+ * subscribers that were sent the full frame when one of them has NACK on,
+ * and the buffer should go to the history; it stays 0 otherwise.
+ * ESP_ERR_NOT_FOUND: every subscriber was over its RATE=.
+ */
+static esp_err_t udp_send_subscribers(int sock, const frame_item_t *item, uint32_t *keep)
+{
+    *keep = 0;
+    if (item->fb->len < FRAME_SIZE_BYTES) {
+        LOGW("Frame too small: %u bytes", (unsigned)item->fb->len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    udp_send_group_t groups[UDP_MAX_SUBSCRIBERS];
+    size_t changed = 0;
+    xSemaphoreTake(s_udp_lock, portMAX_DELAY);
+    int group_count = udp_group_subscribers(item, esp_timer_get_time(), groups, &changed);
+    s_subscribers_changed = 0;
+    xSemaphoreGive(s_udp_lock);
+
+    esp_err_t result = ESP_ERR_NOT_FOUND;
+    for (int g = 0; g < group_count && s_stream_enabled; ++g) {
+        const udp_send_group_t *group = &groups[g];
+        const uint64_t bytes_before = s_udp_stats.bytes;
+        esp_err_t err = udp_send_group(sock, group, item, changed);
+        const int64_t bytes = s_udp_stats.bytes > bytes_before
+                                  ? (int64_t)(s_udp_stats.bytes - bytes_before) / group->dests.count
+                                  : 0;
+        uint32_t sent_to = 0;
+        xSemaphoreTake(s_udp_lock, portMAX_DELAY);
+        for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+            udp_subscriber_t *sub = &s_subscribers[i];
+            /* Skip slots a START or STOP handled mid-frame has reset. */
+            if (!(group->members & (1u << i)) || (s_subscribers_changed & (1u << i))) {
+                continue;
+            }
+            sub->has_frame = err == ESP_OK;
+            sub->last_frame_id = item->frame_id;
+            sub->credit_bytes -= bytes;
+            sent_to |= 1u << i;
+        }
+        xSemaphoreGive(s_udp_lock);
+        if (err == ESP_OK && group->kind == UDP_SEND_FULL && group->nack) {
+            *keep |= sent_to;
+        }
+        if (result != ESP_OK) {
+            result = err;
+        }
+    }
+    return result;
+}
+
+static void udp_history_release(udp_history_t *entry)
+{
+    if (entry->fb) {
+        esp_camera_fb_return(entry->fb);
+    }
+    memset(entry, 0, sizeof(*entry));
+}
+
+static void udp_history_release_all(void)
+{
+    for (int i = 0; i < UDP_NACK_HISTORY; ++i) {
+        udp_history_release(&s_udp_history[i]);
+    }
+}
+
+/* Hands the frame buffers of frames past UDP_NACK_DEADLINE_MS back to the camera. */
+static void udp_history_expire(int64_t now_us)
+{
+    for (int i = 0; i < UDP_NACK_HISTORY; ++i) {
+        udp_history_t *entry = &s_udp_history[i];
+        if (entry->fb && now_us - entry->sent_us > (int64_t)UDP_NACK_DEADLINE_MS * 1000) {
+            udp_history_release(entry);
+        }
+    }
+}
+
+/* Keeps a sent frame for retransmission, evicting the oldest one if needed. */
+static void udp_history_push(const frame_item_t *item, uint32_t members)
+{
+    udp_history_t *slot = &s_udp_history[0];
+    for (int i = 0; i < UDP_NACK_HISTORY; ++i) {
+        udp_history_t *entry = &s_udp_history[i];
+        if (!entry->fb) {
+            slot = entry;
+            break;
+        }
+        if (entry->sent_us < slot->sent_us) {
+            slot = entry;
+        }
+    }
+    udp_history_release(slot);
+    slot->fb = item->fb;
+    slot->frame_id = item->frame_id;
+    slot->members = members;
+    slot->sent_us = esp_timer_get_time();
+}
+
+/*
+ * Re-sends the packets a NACK asks for to the subscriber alone, if the frame
+ * is still held and that subscriber was sent it in full. A subscriber that got
+ * a reduced or delta version of the frame must not get full-frame packets.
+ */
+static void udp_handle_nack(int sock, const udp_nack_item_t *item)
+{
+    const uint8_t *buf = item->buf;
+    const size_t len = item->len;
+    udp_nack_header_t nack;
+    if (len < sizeof(nack)) {
+        return;
+    }
+    memcpy(&nack, buf, sizeof(nack));
+    const uint8_t *bitmap = buf + sizeof(nack);
+    size_t bit_count = MIN((size_t)nack.bit_count, (len - sizeof(nack)) * 8);
+    s_udp_stats.nacks++;
+
+    udp_history_t *entry = NULL;
+    for (int i = 0; i < UDP_NACK_HISTORY && !entry; ++i) {
+        if (s_udp_history[i].fb && s_udp_history[i].frame_id == nack.frame_id &&
+            (s_udp_history[i].members & (1u << item->subscriber))) {
+            entry = &s_udp_history[i];
+        }
+    }
+    if (!entry) {
+        s_udp_stats.nack_late++;
+        return;
+    }
+
+    const udp_dest_list_t dest = {
+        .addr = {item->data_addr},
+        .owners = {1u << item->subscriber},
+        .count = 1,
+    };
+    const udp_frame_header_t frame =
+        udp_frame_header(entry->frame_id, FRAME_WIDTH, FRAME_HEIGHT, UDP_CAMERA_FORMAT,
+                         item->fec_group, udp_fb_time_us(entry->fb));
+    const uint16_t packet_count = frame.packet_count;
+    bool backed_off = false;
+    for (size_t bit = 0; bit < bit_count; ++bit) {
+        size_t idx = nack.first_index + bit;
+        if (!(bitmap[bit / 8] & (1u << (bit % 8))) || idx >= packet_count) {
+            continue;
+        }
+        if (udp_send_packet(sock, &dest, &frame, entry->fb->buf, FRAME_SIZE_BYTES, (uint16_t)idx,
+                            UDP_FLAG_RETRANSMIT, &backed_off) != ESP_OK) {
+            return;
+        }
+        s_udp_stats.retransmits++;
+    }
+}
+
+/* Handles the NACKs the control task has queued; called between packets. */
+static void udp_serve_nacks(int sock)
+{
+    udp_nack_item_t item;
+    while (xQueueReceive(s_nack_queue, &item, 0) == pdTRUE) {
+        udp_handle_nack(sock, &item);
+    }
+}
+
+/* Accounts one sent frame and logs the window once UDP_STATS_INTERVAL_MS is up. */
+static void udp_stats_frame_done(int64_t send_us, int64_t queue_us)
+{
+    udp_stats_t *stats = &s_udp_stats;
+    int64_t now_us = esp_timer_get_time();
+    if (stats->window_start_us == 0) {
+        stats->window_start_us = now_us;
+    }
+    stats->frames++;
+    stats->send_us_total += send_us;
+    if (send_us > stats->send_us_max) {
+        stats->send_us_max = send_us;
+    }
+    stats->queue_us_total += queue_us;
+    if (queue_us > stats->queue_us_max) {
+        stats->queue_us_max = queue_us;
+    }
+    int64_t window_us = now_us - stats->window_start_us;
+    if (window_us < (int64_t)UDP_STATS_INTERVAL_MS * 1000) {
+        return;
+    }
+    xSemaphoreTake(s_udp_lock, portMAX_DELAY);
+    udp_stats_summary_t *sum = &s_udp_summary;
+    sum->fps_x100 = (uint32_t)(stats->frames * 100000000LL / window_us);
+    sum->kbps = (uint32_t)(stats->bytes * 8000 / window_us);
+    sum->rate_kbps = s_udp_bucket.rate_kbps;
+    sum->us_per_frame = stats->send_us_total / stats->frames;
+    sum->us_max = stats->send_us_max;
+    sum->queue_us = stats->queue_us_total / stats->frames;
+    sum->queue_us_max = stats->queue_us_max;
+    sum->packets = stats->packets;
+    sum->retries = stats->retries;
+    sum->errors = stats->errors;
+    sum->nacks = stats->nacks;
+    sum->retransmits = stats->retransmits;
+    sum->nack_late = stats->nack_late;
+    sum->parity = stats->parity;
+    sum->tiles = stats->tiles;
+    xSemaphoreGive(s_udp_lock);
+    LOGI("TX %s: %" PRIu32 ".%02" PRIu32 " fps, %" PRIu32 " kbps (rate %" PRIu32 "), %lld us/frame"
+         " (max %lld), queued %lld us (max %lld), %" PRIu32 " packets, %" PRIu32 " retries, %"
+         PRIu32 " errors, %" PRIu32 " nacks, %" PRIu32 " retransmits, %" PRIu32 " late, %" PRIu32
+         " parity, %" PRIu32 " tiles",
+         UDP_SEND_COPY_PACKETS ? "copy+sendto" : "sendmsg", sum->fps_x100 / 100, sum->fps_x100 % 100,
+         sum->kbps, sum->rate_kbps, (long long)sum->us_per_frame, (long long)sum->us_max,
+         (long long)sum->queue_us, (long long)sum->queue_us_max, sum->packets, sum->retries,
+         sum->errors, sum->nacks, sum->retransmits, sum->nack_late, sum->parity, sum->tiles);
+    memset(stats, 0, sizeof(*stats));
+    stats->window_start_us = now_us;
+}
+
+/*
+ * STATS reply: key=value pairs of the last complete window. queue_us is the
+ * time from the capture task queueing a frame to its first packet leaving.
+ * Called with s_udp_lock held.
+ */
+static int udp_stats_format(char *buf, size_t len)
+{
+    const udp_stats_summary_t *sum = &s_udp_summary;
+    int subscribers = 0;
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+        subscribers += s_subscribers[i].active;
+    }
+    int used = snprintf(buf, len,
+                        "fps=%" PRIu32 ".%02" PRIu32 " kbps=%" PRIu32 " rate_kbps=%" PRIu32
+                        " target_kbps=%d us_per_frame=%lld us_max=%lld queue_us=%lld"
+                        " queue_us_max=%lld packets=%" PRIu32
+                        " retries=%" PRIu32 " errors=%" PRIu32 " nacks=%" PRIu32
+                        " retransmits=%" PRIu32 " nack_late=%" PRIu32 " parity=%" PRIu32
+                        " tiles=%" PRIu32 " subscribers=%d",
+                        sum->fps_x100 / 100, sum->fps_x100 % 100, sum->kbps, sum->rate_kbps,
+                        CONFIG_UDP_STREAM_TARGET_KBPS, (long long)sum->us_per_frame,
+                        (long long)sum->us_max, (long long)sum->queue_us,
+                        (long long)sum->queue_us_max, sum->packets, sum->retries, sum->errors,
+                        sum->nacks, sum->retransmits, sum->nack_late, sum->parity, sum->tiles,
+                        subscribers);
+    return MIN(used, (int)len - 1);
+}
+
 static void capture_task(void *arg)
 {
     (void)arg;
@@ -327,15 +1396,216 @@ static void capture_task(void *arg)
         frame_item_t item = {
             .fb = fb,
             .frame_id = frame_id++,
+            .queued_us = esp_timer_get_time(),
         };
 
         if (xQueueSend(s_frame_queue, &item, 0) != pdTRUE) {
             esp_camera_fb_return(fb);
+        } else if (s_udp_task) {
+            xTaskNotifyGive(s_udp_task);
         }
     }
 }
 
-static void udp_stream_task(void *arg)
+static int udp_subscriber_find(const struct sockaddr_in *ctrl_addr)
+{
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+        if (s_subscribers[i].active && udp_addr_equal(&s_subscribers[i].ctrl_addr, ctrl_addr)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Drops subscriber i. Its packets stop with the next one the stream task
+ * sends; the last one to go stops the capture, and the stream task returns
+ * the queued and held frames when it wakes.
+ */
+static void udp_subscriber_remove(int i)
+{
+    memset(&s_subscribers[i], 0, sizeof(s_subscribers[i]));
+    s_subscribers_changed |= 1u << i;
+    s_active_mask &= ~(1u << i);
+    if (s_active_mask == 0) {
+        s_stream_enabled = false;
+        xTaskNotifyGive(s_udp_task);
+        LOGI("Streaming disabled");
+    }
+}
+
+static void udp_subscribers_expire(int64_t now_us)
+{
+    for (int i = 0; i < UDP_MAX_SUBSCRIBERS; ++i) {
+        udp_subscriber_t *sub = &s_subscribers[i];
+        if (sub->active &&
+            now_us - sub->last_seen_us > (int64_t)UDP_SUBSCRIBER_TIMEOUT_MS * 1000) {
+            LOGI("Subscriber %s:%u timed out", inet_ntoa(sub->ctrl_addr.sin_addr),
+                 (unsigned)ntohs(sub->ctrl_addr.sin_port));
+            udp_subscriber_remove(i);
+        }
+    }
+}
+
+/* Parses the START options into a subscriber profile. */
+static udp_profile_t udp_profile_parse(const char *opts)
+{
+    udp_profile_t profile = {0};
+    profile.mode = udp_mode_parse(opts);
+    profile.nack = strstr(opts, CMD_OPT_NACK) != NULL;
+    profile.delta = strstr(opts, CMD_OPT_DELTA) != NULL;
+    profile.multicast = strstr(opts, CMD_OPT_MCAST) != NULL;
+    const char *fec = strstr(opts, CMD_OPT_FEC);
+    long group = fec ? strtol(fec + strlen(CMD_OPT_FEC), NULL, 10) : CONFIG_UDP_STREAM_FEC_GROUP;
+    profile.fec_group = (group >= 2 && group <= UDP_FEC_GROUP_MAX) ? (uint8_t)group : 0;
+    const char *rate = strstr(opts, CMD_OPT_RATE);
+    long kbps = rate ? strtol(rate + strlen(CMD_OPT_RATE), NULL, 10) : 0;
+    profile.rate_kbps = kbps > 0 ? (uint32_t)kbps : 0;
+    return profile;
+}
+
+/*
+ * START from a new control address adds a subscriber, from a known one
+ * updates it. Frames go to the sender's IP at PORT= (default
+ * STREAM_DATA_PORT), or to the multicast group with MCAST. Multicast
+ * subscribers all receive the same datagrams, so the latest START MCAST
+ * sets the profile for all of them. Returns false when the table is full.
+ */
+static bool udp_subscriber_start(const struct sockaddr_in *source, const char *opts)
+{
+    int i = udp_subscriber_find(source);
+    for (int j = 0; j < UDP_MAX_SUBSCRIBERS && i < 0; ++j) {
+        if (!s_subscribers[j].active) {
+            i = j;
+        }
+    }
+    if (i < 0) {
+        return false;
+    }
+
+    const udp_profile_t profile = udp_profile_parse(opts);
+    const char *port = strstr(opts, CMD_OPT_PORT);
+    long data_port = port ? strtol(port + strlen(CMD_OPT_PORT), NULL, 10) : 0;
+    udp_subscriber_t *sub = &s_subscribers[i];
+    memset(sub, 0, sizeof(*sub));
+    sub->active = true;
+    sub->ctrl_addr = *source;
+    sub->data_addr = *source;
+    sub->data_addr.sin_port = htons(data_port > 0 && data_port <= 65535 ? (uint16_t)data_port
+                                                                       : STREAM_DATA_PORT);
+    sub->profile = profile;
+    sub->last_seen_us = esp_timer_get_time();
+    s_subscribers_changed |= 1u << i;
+    if (profile.multicast) {
+        for (int j = 0; j < UDP_MAX_SUBSCRIBERS; ++j) {
+            udp_subscriber_t *other = &s_subscribers[j];
+            if (j != i && other->active && other->profile.multicast) {
+                other->profile = profile;
+                other->has_frame = false;
+                s_subscribers_changed |= 1u << j;
+            }
+        }
+    }
+    if (!udp_mode_is_full(&profile.mode) && !s_mode_buf) {
+        s_mode_buf = heap_caps_malloc(FRAME_SIZE_BYTES, MALLOC_CAP_SPIRAM);
+        if (!s_mode_buf) {
+            LOGE("No memory for reduced stream modes, sending full frames");
+        }
+    }
+
+    s_active_mask |= 1u << i;
+    if (!s_stream_enabled) {
+        s_stream_restart = true;
+        s_stream_enabled = true;
+    }
+    const struct sockaddr_in *dest = profile.multicast ? &s_multicast_addr : &sub->data_addr;
+    LOGI("Subscriber %d streaming to %s:%u%s%s, FEC group %u, %s %ux%u at %u,%u /%u, %" PRIu32
+         " kbps",
+         i, inet_ntoa(dest->sin_addr), (unsigned)ntohs(dest->sin_port),
+         profile.nack ? " (NACK)" : "", profile.delta ? " (delta)" : "",
+         (unsigned)profile.fec_group, profile.mode.gray ? "gray" : "rgb565",
+         (unsigned)profile.mode.roi_w, (unsigned)profile.mode.roi_h,
+         (unsigned)profile.mode.roi_x, (unsigned)profile.mode.roi_y,
+         (unsigned)profile.mode.decimate, profile.rate_kbps);
+    return true;
+}
+
+/*
+ * Reads and handles one control datagram: START, STOP, KEEPALIVE, TIME,
+ * STATS or a binary NACK, which is queued for the stream task since only
+ * it sends frames. Anything from a subscriber counts as a keepalive.
+ */
+static void udp_handle_control(int ctrl_sock)
+{
+    char rx_buf[256];
+    struct sockaddr_storage source_addr;
+    socklen_t socklen = sizeof(source_addr);
+    int len = recvfrom(ctrl_sock, rx_buf, sizeof(rx_buf) - 1, 0,
+                       (struct sockaddr *)&source_addr, &socklen);
+    if (len <= 0) {
+        return;
+    }
+    rx_buf[len] = '\0';
+    const struct sockaddr_in *source = (const struct sockaddr_in *)&source_addr;
+
+    xSemaphoreTake(s_udp_lock, portMAX_DELAY);
+    int sub_index = source_addr.ss_family == AF_INET ? udp_subscriber_find(source) : -1;
+    if (sub_index >= 0) {
+        s_subscribers[sub_index].last_seen_us = esp_timer_get_time();
+    }
+
+    char resp[384];
+    int resp_len = -1;
+    if (strncmp(rx_buf, CMD_NACK, strlen(CMD_NACK)) == 0) {
+        if (sub_index >= 0 && s_subscribers[sub_index].profile.nack) {
+            udp_nack_item_t item = {
+                .subscriber = sub_index,
+                .data_addr = s_subscribers[sub_index].data_addr,
+                .fec_group = s_subscribers[sub_index].profile.fec_group,
+                .len = (uint16_t)len,
+            };
+            memcpy(item.buf, rx_buf, len);
+            if (xQueueSend(s_nack_queue, &item, 0) == pdTRUE) {
+                xTaskNotifyGive(s_udp_task);
+            }
+        }
+    } else if (strncmp(rx_buf, CMD_KEEPALIVE, strlen(CMD_KEEPALIVE)) == 0) {
+        /* last_seen_us was refreshed above */
+    } else if (strncmp(rx_buf, CMD_START, strlen(CMD_START)) == 0) {
+        if (source_addr.ss_family == AF_INET) {
+            if (udp_subscriber_start(source, rx_buf + strlen(CMD_START))) {
+                resp_len = snprintf(resp, sizeof(resp), "OK");
+            } else {
+                LOGW("START from %s refused: %d subscribers", inet_ntoa(source->sin_addr),
+                     UDP_MAX_SUBSCRIBERS);
+                resp_len = snprintf(resp, sizeof(resp), "ERR full");
+            }
+        }
+    } else if (strncmp(rx_buf, CMD_STOP, strlen(CMD_STOP)) == 0) {
+        if (sub_index >= 0) {
+            udp_subscriber_remove(sub_index);
+        }
+        resp_len = snprintf(resp, sizeof(resp), "OK");
+    } else if (strncmp(rx_buf, CMD_TIME, strlen(CMD_TIME)) == 0) {
+        resp_len = snprintf(resp, sizeof(resp), "time_us=%lld", (long long)esp_timer_get_time());
+    } else if (strncmp(rx_buf, CMD_STATS, strlen(CMD_STATS)) == 0) {
+        resp_len = udp_stats_format(resp, sizeof(resp));
+    } else {
+        resp_len = snprintf(resp, sizeof(resp), "ERR");
+    }
+    xSemaphoreGive(s_udp_lock);
+
+    if (resp_len >= 0) {
+        sendto(ctrl_sock, resp, resp_len, 0, (struct sockaddr *)&source_addr, socklen);
+    }
+}
+
+/*
+ * Owns the control port. It blocks in recvfrom() and runs above the stream
+ * task, so commands are handled as they arrive, between two packets of a
+ * frame, rather than when the stream task gets round to polling.
+ */
+static void udp_control_task(void *arg)
 {
     (void)arg;
 
@@ -359,10 +1629,33 @@ static void udp_stream_task(void *arg)
         return;
     }
 
+    struct timeval timeout = {
+        .tv_sec = 0,
+        .tv_usec = UDP_IDLE_WAKE_MS * 1000,
+    };
+    setsockopt(ctrl_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    for (;;) {
+        udp_handle_control(ctrl_sock);
+
+        xSemaphoreTake(s_udp_lock, portMAX_DELAY);
+        udp_subscribers_expire(esp_timer_get_time());
+        xSemaphoreGive(s_udp_lock);
+    }
+}
+
+/*
+ * Sends the frames the capture task queues. It sleeps on its task
+ * notification, which the capture task gives with every frame and the
+ * control task with every NACK and with the last STOP.
+ */
+static void udp_stream_task(void *arg)
+{
+    (void)arg;
+
     int stream_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
     if (stream_sock < 0) {
         LOGE("Stream socket create failed: errno=%d", errno);
-        close(ctrl_sock);
         vTaskDelete(NULL);
         return;
     }
@@ -377,80 +1670,94 @@ static void udp_stream_task(void *arg)
     if (bind(stream_sock, (struct sockaddr *)&stream_bind, sizeof(stream_bind)) < 0) {
         LOGE("Stream socket bind failed: errno=%d", errno);
         close(stream_sock);
-        close(ctrl_sock);
         vTaskDelete(NULL);
         return;
     }
 
-    struct timeval timeout = {
-        .tv_sec = 0,
-        .tv_usec = 100 * 1000,
-    };
-    setsockopt(ctrl_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint8_t mcast_ttl = UDP_MULTICAST_TTL;
+    setsockopt(stream_sock, IPPROTO_IP, IP_MULTICAST_TTL, &mcast_ttl, sizeof(mcast_ttl));
 
-    char rx_buf[64];
     for (;;) {
-        struct sockaddr_storage source_addr;
-        socklen_t socklen = sizeof(source_addr);
-        int len = recvfrom(ctrl_sock, rx_buf, sizeof(rx_buf) - 1, 0,
-                           (struct sockaddr *)&source_addr, &socklen);
-        if (len > 0) {
-            rx_buf[len] = '\0';
-            if (strncmp(rx_buf, CMD_START, strlen(CMD_START)) == 0) {
-                if (source_addr.ss_family == AF_INET) {
-                    memcpy(&s_stream_client, &source_addr, sizeof(struct sockaddr_in));
-                    s_stream_client.sin_port = htons(STREAM_DATA_PORT);
-                    s_stream_enabled = true;
-                    s_client_valid = true;
-                    drain_frame_queue();
-                    LOGI("Streaming enabled to %s:%u",
-                         inet_ntoa(s_stream_client.sin_addr), STREAM_DATA_PORT);
-                    const char *resp = "OK";
-                    sendto(ctrl_sock, resp, strlen(resp), 0,
-                           (struct sockaddr *)&source_addr, socklen);
-                }
-            } else if (strncmp(rx_buf, CMD_STOP, strlen(CMD_STOP)) == 0) {
-                s_stream_enabled = false;
-                s_client_valid = false;
-                drain_frame_queue();
-                const char *resp = "OK";
-                sendto(ctrl_sock, resp, strlen(resp), 0,
-                       (struct sockaddr *)&source_addr, socklen);
-                LOGI("Streaming disabled");
-            } else {
-                const char *resp = "ERR";
-                sendto(ctrl_sock, resp, strlen(resp), 0,
-                       (struct sockaddr *)&source_addr, socklen);
-            }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UDP_IDLE_WAKE_MS));
+
+        if (s_stream_restart) {
+            s_stream_restart = false;
+            drain_frame_queue();
+            udp_history_release_all();
+            memset(&s_udp_stats, 0, sizeof(s_udp_stats));
+            s_udp_bucket.last_us = 0;
+            s_udp_bucket.rate_kbps = CONFIG_UDP_STREAM_TARGET_KBPS;
         }
+        udp_serve_nacks(stream_sock);
+        udp_history_expire(esp_timer_get_time());
 
-        if (s_stream_enabled && s_client_valid) {
-            frame_item_t item;
-            if (xQueueReceive(s_frame_queue, &item, 0) == pdTRUE) {
-                udp_send_frame(stream_sock, &s_stream_client, &item);
-                if (item.fb) {
-                    esp_camera_fb_return(item.fb);
-                }
+        frame_item_t item;
+        while (xQueueReceive(s_frame_queue, &item, 0) == pdTRUE) {
+            if (!s_stream_enabled) {
+                esp_camera_fb_return(item.fb);
+                continue;
+            }
+            int64_t send_start_us = esp_timer_get_time();
+            uint32_t keep = 0;
+            s_first_packet_us = 0;
+            esp_err_t err = udp_send_subscribers(stream_sock, &item, &keep);
+            if (err == ESP_OK) {
+                int64_t now_us = esp_timer_get_time();
+                /* A still scene can make a delta frame with no packets at all. */
+                int64_t first_us = s_first_packet_us ? s_first_packet_us : now_us;
+                udp_stats_frame_done(now_us - send_start_us, first_us - item.queued_us);
+            }
+            if (keep && s_stream_enabled) {
+                udp_history_push(&item, keep);
+            } else {
+                esp_camera_fb_return(item.fb);
             }
+            udp_serve_nacks(stream_sock);
+        }
+        if (!s_stream_enabled) {
+            udp_history_release_all();
         }
     }
 }
 
 static esp_err_t init_tasks(void)
 {
-    s_frame_queue = xQueueCreate(2, sizeof(frame_item_t));
-    if (!s_frame_queue) {
+    udp_gray_init();
+    s_multicast_addr.sin_family = AF_INET;
+    s_multicast_addr.sin_port = htons(STREAM_DATA_PORT);
+    inet_aton(UDP_MULTICAST_GROUP, &s_multicast_addr.sin_addr);
+
+    s_frame_queue = xQueueCreate(FRAME_QUEUE_LEN, sizeof(frame_item_t));
+    s_nack_queue = xQueueCreate(UDP_NACK_QUEUE_LEN, sizeof(udp_nack_item_t));
+    s_udp_lock = xSemaphoreCreateMutex();
+    s_wait_done = xSemaphoreCreateBinary();
+    if (!s_frame_queue || !s_nack_queue || !s_udp_lock || !s_wait_done) {
         return ESP_ERR_NO_MEM;
     }
 
-    BaseType_t ok = xTaskCreatePinnedToCore(capture_task, "capture", CAPTURE_TASK_STACK_SIZE,
-                                            NULL, CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE);
+    const esp_timer_create_args_t wait_timer_args = {
+        .callback = udp_wait_timer_cb,
+        .name = "udp_wait",
+    };
+    esp_err_t err = esp_timer_create(&wait_timer_args, &s_wait_timer);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    BaseType_t ok = xTaskCreatePinnedToCore(udp_stream_task, "udp_stream", UDP_TASK_STACK_SIZE,
+                                            NULL, UDP_TASK_PRIORITY, &s_udp_task, UDP_TASK_CORE);
+    if (ok != pdPASS) {
+        return ESP_FAIL;
+    }
+
+    ok = xTaskCreatePinnedToCore(udp_control_task, "udp_control", UDP_CONTROL_TASK_STACK_SIZE,
+                                 NULL, UDP_CONTROL_TASK_PRIORITY, NULL, UDP_TASK_CORE);
     if (ok != pdPASS) {
         return ESP_FAIL;
     }
 
-    ok = xTaskCreatePinnedToCore(udp_stream_task, "udp_stream", UDP_TASK_STACK_SIZE,
-                                 NULL, UDP_TASK_PRIORITY, NULL, UDP_TASK_CORE);
+    ok = xTaskCreatePinnedToCore(capture_task, "capture", CAPTURE_TASK_STACK_SIZE,
+                                 NULL, CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE);
     if (ok != pdPASS) {
         return ESP_FAIL;
     }
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Capture file naming shared by the master and slave roles, so the session a
+ * file belongs to is decided the same way on both.
+ *
+ * A session's frames are <session>-<timestamp_ms>.<ext>, its metadata is
+ * <session>.csv and <session>.pairs.csv. "run-2-<ts>.jpg" and "run-2.csv"
+ * belong to session "run-2", not "run".
+ */
+
+static inline bool capseq_frame_ext(const char *ext)
+{
+    static const char *const exts[] = {".jpg", ".rgb565", ".gray", ".yuv", ".session"};
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); ++i) {
+        if (strcmp(ext, exts[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool capseq_session_file(const char *session, const char *name)
+{
+    size_t len = strlen(session);
+    if (strncmp(name, session, len) != 0) {
+        return false;
+    }
+    if (name[len] == '-') {
+        if (!isdigit((unsigned char)name[len + 1])) {
+            return false;
+        }
+        char *end = NULL;
+        strtoll(name + len + 1, &end, 10);
+        return capseq_frame_ext(end);
+    }
+    return strcmp(name + len, ".csv") == 0 || strcmp(name + len, ".pairs.csv") == 0;
+}
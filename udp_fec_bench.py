@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Loopback benchmark for the UDP RGB565 stream's XOR parity (FEC).
+
+Packetizes frames the way app_main_udp_rgb565.c does, drops datagrams at
+random before sending them over 127.0.0.1, and reassembles them with the
+viewer's FrameAssembler. Prints, per loss rate and FEC group size, the
+bandwidth overhead and the share of frames that arrive complete.
+"""
+import argparse
+import os
+import random
+import socket
+import struct
+import zlib
+
+from udp_rgb565_viewer import (CHUNK_SIZE, DEFAULT_HEIGHT, DEFAULT_WIDTH, FLAG_END, FLAG_PARITY,
+                               FORMAT_GRAY8, FORMAT_RGB565_BE, HEADER_SIZE, HEADER_STRUCT,
+                               HEADER_VERSION, FrameAssembler, parse_packet)
+
+
+def xor_bytes(a: bytes, b: bytes) -> bytes:
+    length = max(len(a), len(b))
+    value = int.from_bytes(a, "little") ^ int.from_bytes(b, "little")
+    return value.to_bytes(length, "little")
+
+
+def packetize(frame_id: int, frame: bytes, fec_group: int, width: int, height: int,
+              fmt: int = FORMAT_RGB565_BE, capture_us: int = 0):
+    """Datagrams for one frame, in the firmware's send order."""
+    packet_count = (len(frame) + CHUNK_SIZE - 1) // CHUNK_SIZE
+    stride = width * (1 if fmt == FORMAT_GRAY8 else 2)
+
+    def header(idx: int, payload_len: int, flags: int) -> bytes:
+        return HEADER_STRUCT.pack(HEADER_VERSION, HEADER_SIZE, fmt, fec_group, frame_id, idx,
+                                  packet_count, payload_len, flags, width, height, stride,
+                                  CHUNK_SIZE, capture_us)
+
+    parity = b""
+    for idx in range(packet_count):
+        chunk = frame[idx * CHUNK_SIZE:(idx + 1) * CHUNK_SIZE]
+        yield header(idx, len(chunk), 0) + chunk
+        if not fec_group:
+            continue
+        parity = chunk if idx % fec_group == 0 else xor_bytes(parity, chunk)
+        if idx % fec_group == fec_group - 1 or idx == packet_count - 1:
+            yield header(idx // fec_group, len(parity), FLAG_PARITY) + parity
+    yield header(packet_count, 4, FLAG_END) + struct.pack("<I", zlib.crc32(frame))
+
+
+def run(frames, fec_group: int, loss: float, width: int, height: int, rng: random.Random):
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rx.bind(("127.0.0.1", 0))
+    rx.settimeout(1.0)
+    target = rx.getsockname()
+
+    assembler = FrameAssembler()
+    data_bytes = 0
+    sent_bytes = 0
+    finished = []
+    for frame_id, frame in enumerate(frames):
+        for packet in packetize(frame_id, frame, fec_group, width, height):
+            sent_bytes += len(packet)
+            if not parse_packet(packet)[0].flags & FLAG_PARITY:
+                data_bytes += len(packet)
+            if rng.random() < loss:
+                continue
+            # One datagram in flight at a time, so the socket itself never drops.
+            tx.sendto(packet, target)
+            finished += assembler.add_packet(*parse_packet(rx.recv(2048)))
+    for frame_id in sorted(assembler.frames):
+        finished.append(assembler.finalize(frame_id))
+    tx.close()
+    rx.close()
+
+    complete = sum(1 for frame in finished if frame.data == frames[frame.frame_id])
+    overhead = (sent_bytes - data_bytes) / data_bytes * 100.0
+    return overhead, complete / len(frames) * 100.0, assembler.recovered
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Benchmark UDP RGB565 FEC over loopback.")
+    parser.add_argument("--frames", type=int, default=30, help="Frames per run")
+    parser.add_argument("--loss", type=float, nargs="+", default=[1.0, 2.0, 3.0],
+                        metavar="PCT", help="Random packet loss rates to simulate")
+    parser.add_argument("--groups", type=int, nargs="+", default=[0, 4, 8, 16, 32],
+                        metavar="N", help="FEC group sizes (0 = no parity)")
+    parser.add_argument("--width", type=int, default=DEFAULT_WIDTH)
+    parser.add_argument("--height", type=int, default=DEFAULT_HEIGHT)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    frame_size = args.width * args.height * 2
+    frames = [os.urandom(frame_size) for _ in range(args.frames)]
+
+    print(f"{'loss %':>7} {'group':>6} {'overhead %':>11} {'complete %':>11} {'rebuilt':>8}")
+    for loss in args.loss:
+        for group in args.groups:
+            rng = random.Random(args.seed)
+            overhead, complete, rebuilt = run(frames, group, loss / 100.0,
+                                              args.width, args.height, rng)
+            print(f"{loss:7.1f} {group:6d} {overhead:11.1f} {complete:11.1f} {rebuilt:8d}")
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Host benchmark for the UDP RGB565 stream's reduced modes.
+
+A simulated camera produces VGA RGB565 frames (a moving checkerboard) at
+--camera-fps. Each mode converts them the way app_main_udp_rgb565.c does
+(crop, decimation, table-driven luma), packetizes them, paces the packets
+with a token bucket at --kbps over loopback and reassembles them with the
+viewer's FrameAssembler. Prints the delivered fps per mode and its gain
+over full VGA RGB565.
+"""
+import argparse
+import socket
+import time
+
+import numpy as np
+
+from udp_fec_bench import packetize
+from udp_rgb565_viewer import (DEFAULT_HEIGHT, DEFAULT_WIDTH, FORMAT_GRAY8, FORMAT_RGB565_BE,
+                               FrameAssembler, parse_packet)
+
+MODES = [
+    ("full", {}),
+    ("gray", {"gray": True}),
+    ("decimate=2", {"decimate": 2}),
+    ("decimate=4", {"decimate": 4}),
+    ("gray decimate=2", {"gray": True, "decimate": 2}),
+    ("roi=240,180,160,120", {"roi": (240, 180, 160, 120)}),
+    ("gray roi=240,180,160,120", {"gray": True, "roi": (240, 180, 160, 120)}),
+]
+
+
+def gray_luts():
+    """Same tables as udp_gray_init(): luma * 256 per byte of an RGB565 pixel."""
+    kr = (77 * 255 + 15) // 31
+    kg = (150 * 255 + 31) // 63
+    kb = (29 * 255 + 15) // 31
+    b = np.arange(256, dtype=np.uint32)
+    hi = (b >> 3) * kr + ((b & 0x07) << 3) * kg
+    lo = (b >> 5) * kg + (b & 0x1F) * kb
+    return hi, lo
+
+
+LUT_HI, LUT_LO = gray_luts()
+
+
+def simulated_frame(index: int, width: int, height: int) -> np.ndarray:
+    """RGB565 checkerboard drifting one pixel per frame, high byte first like the camera."""
+    y, x = np.mgrid[0:height, 0:width]
+    squares = (((x + index) // 40) + (y // 40)) % 2
+    return np.where(squares, 0xFFFF, 0x4208).astype(">u2")
+
+
+def convert(pixels: np.ndarray, gray: bool = False, decimate: int = 1, roi=None):
+    """Mirror of udp_mode_convert(): returns (bytes, width, height, format)."""
+    height, width = pixels.shape
+    x, y, w, h = roi or (0, 0, width, height)
+    w -= w % decimate
+    h -= h % decimate
+    view = pixels[y:y + h:decimate, x:x + w:decimate]
+    if gray:
+        luma = (LUT_HI[view >> 8] + LUT_LO[view & 0xFF]) >> 8
+        return luma.astype(np.uint8).tobytes(), view.shape[1], view.shape[0], FORMAT_GRAY8
+    return view.tobytes(), view.shape[1], view.shape[0], FORMAT_RGB565_BE
+
+
+def run(mode: dict, args) -> tuple:
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rx.bind(("127.0.0.1", 0))
+    rx.settimeout(1.0)
+    target = rx.getsockname()
+    assembler = FrameAssembler()
+
+    camera = [simulated_frame(i, args.width, args.height) for i in range(8)]
+    bytes_per_us = args.kbps / 8000.0
+    tokens = 0.0
+    delivered = 0
+    sent_bytes = 0
+    frame_id = 0
+    start = time.monotonic()
+    last = start
+    next_frame = start
+    while time.monotonic() - start < args.seconds:
+        # The camera cannot deliver faster than --camera-fps.
+        now = time.monotonic()
+        if now < next_frame:
+            time.sleep(next_frame - now)
+        next_frame = max(next_frame + 1.0 / args.camera_fps, time.monotonic())
+
+        data, width, height, fmt = convert(camera[frame_id % len(camera)], **mode)
+        for packet in packetize(frame_id, data, 0, width, height, fmt):
+            now = time.monotonic()
+            tokens = min(tokens + (now - last) * 1e6 * bytes_per_us, 4 * len(packet))
+            last = now
+            if tokens < len(packet):
+                time.sleep((len(packet) - tokens) / bytes_per_us / 1e6)
+                tokens = len(packet)
+                last = time.monotonic()
+            tokens -= len(packet)
+            tx.sendto(packet, target)
+            sent_bytes += len(packet)
+            finished = assembler.add_packet(*parse_packet(rx.recv(2048)))
+            delivered += sum(1 for frame in finished if frame.crc_ok)
+        frame_id += 1
+
+    elapsed = time.monotonic() - start
+    tx.close()
+    rx.close()
+    return delivered / elapsed, sent_bytes * 8 / 1000.0 / elapsed, len(data), width, height
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Benchmark UDP stream modes with a simulated camera.")
+    parser.add_argument("--kbps", type=int, default=12000, help="Link rate (UDP_STREAM_TARGET_KBPS)")
+    parser.add_argument("--camera-fps", type=float, default=25.0, help="Simulated camera frame rate")
+    parser.add_argument("--seconds", type=float, default=3.0, help="Run time per mode")
+    parser.add_argument("--width", type=int, default=DEFAULT_WIDTH)
+    parser.add_argument("--height", type=int, default=DEFAULT_HEIGHT)
+    args = parser.parse_args()
+
+    print(f"{'mode':<26} {'size':>9} {'bytes':>8} {'fps':>7} {'kbps':>7} {'gain':>6}")
+    base_fps = None
+    for name, mode in MODES:
+        fps, kbps, frame_bytes, width, height = run(mode, args)
+        base_fps = base_fps or fps
+        print(f"{name:<26} {f'{width}x{height}':>9} {frame_bytes:8d} {fps:7.2f} {kbps:7.0f} "
+              f"{fps / base_fps:5.1f}x")
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
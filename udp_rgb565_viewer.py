@@ -1,87 +1,313 @@
 #!/usr/bin/env python3
 import argparse
-import math
+import collections
 import signal
 import socket
 import struct
 import sys
+import time
+import zlib
 
-try:
-    import numpy as np
-except Exception as exc:  # pragma: no cover
-    print(f"numpy is required: {exc}")
-    sys.exit(2)
-
-try:
-    import cv2
-except Exception as exc:  # pragma: no cover
-    print(f"opencv-python is required: {exc}")
-    sys.exit(2)
+# Only needed to show frames; loaded in main() so udp_fec_bench.py can reuse
+# the reassembly code without them.
+np = None
+cv2 = None
 
 UDP_PAYLOAD_MAX = 1472
-HEADER_STRUCT = struct.Struct("<IHHHH")
+HEADER_VERSION = 2
+# version, header_len, format, fec_group, frame_id, packet_index, packet_count,
+# payload_len, flags, width, height, stride, chunk_size, capture_us
+HEADER_STRUCT = struct.Struct("<BBBBIHHHHHHHHq")
 HEADER_SIZE = HEADER_STRUCT.size
 CHUNK_SIZE = UDP_PAYLOAD_MAX - HEADER_SIZE
+PacketHeader = collections.namedtuple("PacketHeader", [
+    "version", "header_len", "format", "fec_group", "frame_id", "packet_index", "packet_count",
+    "payload_len", "flags", "width", "height", "stride", "chunk_size", "capture_us"])
 
-DEFAULT_WIDTH = 640
-DEFAULT_HEIGHT = 480
+FORMAT_RGB565_BE = 1
+FORMAT_RGB565_LE = 2
+FORMAT_GRAY8 = 3
 
+FLAG_RETRANSMIT = 0x0001
+FLAG_PARITY = 0x0002
+FLAG_DELTA = 0x0004
+FLAG_END = 0x0008       # payload: u32 CRC-32 of the frame
 
-class FrameAssembler:
-    def __init__(self, width: int, height: int):
-        self.width = width
-        self.height = height
-        self.frame_size = width * height * 2
-        self.expected_packets = math.ceil(self.frame_size / CHUNK_SIZE)
-        self.current_frame_id = None
-        self.last_complete_id = None
-        self.buffer = bytearray(self.frame_size)
-        self.received = set()
-        self.packet_count = self.expected_packets
+# NACK: b"NACK", frame_id, first_index, bit_count, then a bitmap (bit i = first_index + i).
+NACK_STRUCT = struct.Struct("<4sIHH")
+NACK_MAX_BITS = (255 - NACK_STRUCT.size) * 8
 
-    def reset(self, frame_id: int, packet_count: int):
-        self.current_frame_id = frame_id
-        self.packet_count = packet_count or self.expected_packets
-        self.received.clear()
-        self.buffer[:] = b"\x00" * self.frame_size
+DEFAULT_WIDTH = 640
+DEFAULT_HEIGHT = 480
 
-    def add_packet(self, frame_id: int, packet_index: int, packet_count: int, payload: bytes):
-        if self.last_complete_id is not None and frame_id <= self.last_complete_id:
-            return None
+# Delta frames: entries of a u16 tile index followed by a 16x10 RGB565 tile.
+TILE_W = 16
+TILE_H = 10
+TILE_INDEX_STRUCT = struct.Struct("<H")
+TILE_ENTRY_SIZE = TILE_INDEX_STRUCT.size + TILE_W * TILE_H * 2
+
+CLOCK_SYNC_INTERVAL = 30.0
+# The device drops subscribers it has not heard from for 5 s.
+KEEPALIVE_INTERVAL = 1.0
+DEFAULT_STREAM_PORT = 12501
+MULTICAST_GROUP = "239.255.0.50"
+
+Frame = collections.namedtuple("Frame", [
+    "frame_id", "loss_pct", "data", "width", "height", "format", "capture_us", "crc_ok"])
+
+
+def parse_packet(packet: bytes):
+    """(PacketHeader, payload), or None for short packets and unknown versions."""
+    if len(packet) < HEADER_SIZE:
+        return None
+    header = PacketHeader(*HEADER_STRUCT.unpack_from(packet))
+    if header.version != HEADER_VERSION or header.header_len < HEADER_SIZE:
+        return None
+    payload = packet[header.header_len:header.header_len + header.payload_len]
+    if not header.payload_len or len(payload) != header.payload_len:
+        return None
+    return header, payload
+
+
+class PartialFrame:
+    def __init__(self, header: PacketHeader, now: float):
+        self.frame_id = header.frame_id
+        self.packet_count = header.packet_count
+        self.width = header.width
+        self.height = header.height
+        self.format = header.format
+        self.chunk_size = header.chunk_size
+        self.capture_us = header.capture_us
+        self.fec_group = header.fec_group
+        self.delta = bool(header.flags & FLAG_DELTA)
+        self.buffer = bytearray(header.stride * header.height)
+        self.received = set()
+        self.parity = {}
+        self.tile_payloads = []
+        self.crc = None
+        self.first_seen = now
+        self.last_packet = now
+        self.last_nack = 0.0
+        self.nacks_sent = 0
 
-        finished = None
-        if self.current_frame_id is None or frame_id != self.current_frame_id:
-            finished = self.finalize()
-            self.reset(frame_id, packet_count)
+    def missing(self):
+        return [idx for idx in range(self.packet_count) if idx not in self.received]
 
-        if packet_index in self.received:
-            return finished
+    def complete(self) -> bool:
+        return len(self.received) >= self.packet_count and (self.delta or self.crc is not None)
 
-        offset = packet_index * CHUNK_SIZE
-        if offset >= self.frame_size:
-            return finished
 
-        end = min(offset + len(payload), self.frame_size)
-        self.buffer[offset:end] = payload[: end - offset]
-        self.received.add(packet_index)
+class FrameAssembler:
+    """Reassembles frames from packets, using the size and format each packet carries.
+
+    Without NACK (nack_deadline 0) a frame is finished, zero-filled where
+    packets are missing, as soon as a newer frame starts. With NACK, frames
+    stay open until complete or nack_deadline seconds old, and nack_requests()
+    lists the missing packets to ask the device for again. With FEC, a group
+    with one lost data packet is rebuilt from its parity packet. Delta frames
+    keep their tiles until they are finished, then patch them over the last
+    finished frame; a complete delta frame waits for older open frames, such
+    as a keyframe still waiting for retransmits. A frame is complete once its
+    end packet (CRC) is in too.
+    """
+
+    def __init__(self, nack_deadline: float = 0.0, nack_gap: float = 0.03,
+                 nack_interval: float = 0.06, nack_max: int = 3):
+        self.nack_deadline = nack_deadline
+        self.nack_gap = nack_gap
+        self.nack_interval = nack_interval
+        self.nack_max = nack_max
+        self.frames = {}
+        self.newest_id = None
+        self.finished_ids = set()
+        self.retransmitted = 0
+        self.recovered = 0
+        self.tiles = 0
+        self.crc_errors = 0
+        self.last_id = -1
+        self.last_frame = None
+
+    def add_packet(self, header: PacketHeader, payload: bytes, now: float = 0.0):
+        """Returns the frames this packet finished, oldest first."""
+        frame_id = header.frame_id
+        if frame_id in self.finished_ids:
+            return []
+        if header.flags & FLAG_RETRANSMIT:
+            self.retransmitted += 1
+
+        finished = []
+        if self.newest_id is None or frame_id > self.newest_id:
+            self.newest_id = frame_id
+            if not self.nack_deadline:
+                for older in sorted(self.frames):
+                    finished.append(self.finalize(older))
+
+        frame = self.frames.get(frame_id)
+        if frame is None:
+            if frame_id < self.newest_id and not self.nack_deadline:
+                return finished
+            frame = PartialFrame(header, now)
+            self.frames[frame_id] = frame
+        frame.last_packet = now
+
+        idx = header.packet_index
+        if header.flags & FLAG_END:
+            (frame.crc,) = struct.unpack_from("<I", payload)
+        elif frame.delta:
+            if idx not in frame.received:
+                frame.tile_payloads.append(payload)
+                frame.received.add(idx)
+        elif header.flags & FLAG_PARITY:
+            frame.parity[idx] = payload
+            self.recover(frame, idx)
+        else:
+            offset = idx * frame.chunk_size
+            if idx not in frame.received and offset < len(frame.buffer):
+                end = min(offset + len(payload), len(frame.buffer))
+                frame.buffer[offset:end] = payload[: end - offset]
+                frame.received.add(idx)
+                if frame.fec_group:
+                    self.recover(frame, idx // frame.fec_group)
+
+        if frame.complete() and not (frame.delta and self.waits_on_older(frame_id)):
+            finished.append(self.finalize(frame_id))
+            finished.extend(self.release_deltas())
+        return finished
 
-        if len(self.received) >= self.packet_count:
-            return self.finalize()
+    def waits_on_older(self, frame_id: int) -> bool:
+        return any(fid < frame_id for fid in self.frames)
+
+    def release_deltas(self):
+        """Finishes the complete delta frames that were waiting on an older frame."""
+        finished = []
+        while self.frames:
+            oldest = min(self.frames)
+            frame = self.frames[oldest]
+            if not (frame.delta and frame.complete()):
+                break
+            finished.append(self.finalize(oldest))
         return finished
 
-    def finalize(self):
-        if self.current_frame_id is None:
-            return None
-        loss_packets = max(self.packet_count - len(self.received), 0)
-        loss_pct = (loss_packets / self.packet_count) * 100.0 if self.packet_count else 0.0
-        frame_id = self.current_frame_id
-        self.last_complete_id = frame_id
-        self.current_frame_id = None
-        return frame_id, loss_pct, bytes(self.buffer)
+    def patch_tiles(self, frame: PartialFrame, payload: bytes) -> None:
+        cols = frame.width // TILE_W
+        row_bytes = TILE_W * 2
+        for entry in range(0, len(payload) - TILE_ENTRY_SIZE + 1, TILE_ENTRY_SIZE):
+            (tile,) = TILE_INDEX_STRUCT.unpack_from(payload, entry)
+            x = (tile % cols) * TILE_W
+            y = (tile // cols) * TILE_H
+            src = entry + TILE_INDEX_STRUCT.size
+            for row in range(TILE_H):
+                dst = ((y + row) * frame.width + x) * 2
+                frame.buffer[dst:dst + row_bytes] = payload[src:src + row_bytes]
+                src += row_bytes
+            self.tiles += 1
+
+    def recover(self, frame: PartialFrame, group: int) -> None:
+        """Rebuilds the one missing data packet of an FEC group from its parity."""
+        parity = frame.parity.get(group)
+        if parity is None or not frame.fec_group:
+            return
+        first = group * frame.fec_group
+        last = min(first + frame.fec_group, frame.packet_count)
+        missing = [idx for idx in range(first, last) if idx not in frame.received]
+        if len(missing) != 1:
+            return
+        # Little-endian ints zero-pad short slices at the end, like the sender does.
+        acc = int.from_bytes(parity, "little")
+        for idx in range(first, last):
+            if idx != missing[0]:
+                offset = idx * frame.chunk_size
+                acc ^= int.from_bytes(frame.buffer[offset:offset + len(parity)], "little")
+        offset = missing[0] * frame.chunk_size
+        end = min(offset + len(parity), len(frame.buffer))
+        frame.buffer[offset:end] = acc.to_bytes(len(parity), "little")[: end - offset]
+        frame.received.add(missing[0])
+        self.recovered += 1
+
+    def nack_requests(self, now: float):
+        """(frame_id, first_index, bitmap) for frames whose missing packets are due a NACK."""
+        requests = []
+        if not self.nack_deadline:
+            return requests
+        for frame in self.frames.values():
+            settled = frame.frame_id < self.newest_id or now - frame.last_packet >= self.nack_gap
+            if (frame.delta or not settled or frame.nacks_sent >= self.nack_max
+                    or now - frame.last_nack < self.nack_interval):
+                continue
+            missing = frame.missing()
+            if not missing:
+                continue
+            first = missing[0]
+            bits = [idx - first for idx in missing if idx - first < NACK_MAX_BITS]
+            bitmap = bytearray((bits[-1] // 8) + 1)
+            for bit in bits:
+                bitmap[bit // 8] |= 1 << (bit % 8)
+            requests.append((frame.frame_id, first, bits[-1] + 1, bytes(bitmap)))
+            frame.last_nack = now
+            frame.nacks_sent += 1
+        return requests
+
+    def expire(self, now: float):
+        """Gives up on frames older than the NACK deadline, and finishes frames
+        whose data is all in but whose end packet was lost, oldest first."""
+        if not self.nack_deadline:
+            return []
+        finished = []
+        for fid in sorted(self.frames):
+            frame = self.frames[fid]
+            if (now - frame.first_seen > self.nack_deadline
+                    or (not frame.missing() and now - frame.last_packet >= self.nack_gap
+                        and not (frame.delta and self.waits_on_older(fid)))):
+                finished.append(self.finalize(fid))
+        return finished + self.release_deltas()
+
+    def finalize(self, frame_id: int) -> Frame:
+        frame = self.frames.pop(frame_id)
+        if frame.delta:
+            if self.last_frame is not None and len(self.last_frame) == len(frame.buffer):
+                frame.buffer[:] = self.last_frame
+            for payload in frame.tile_payloads:
+                self.patch_tiles(frame, payload)
+        self.finished_ids.add(frame_id)
+        if len(self.finished_ids) > 64:
+            self.finished_ids = {fid for fid in self.finished_ids if fid > frame_id - 64}
+        if frame_id > self.last_id:
+            self.last_id = frame_id
+            self.last_frame = frame.buffer
+        loss_packets = max(frame.packet_count - len(frame.received), 0)
+        loss_pct = (loss_packets / frame.packet_count) * 100.0 if frame.packet_count else 0.0
+        crc_ok = None
+        if frame.crc is not None and not loss_packets:
+            crc_ok = zlib.crc32(frame.buffer) == frame.crc
+            if not crc_ok:
+                self.crc_errors += 1
+        return Frame(frame_id, loss_pct, bytes(frame.buffer), frame.width, frame.height,
+                     frame.format, frame.capture_us, crc_ok)
+
+
+def send_nack(sock: socket.socket, target: tuple, frame_id: int, first: int, bit_count: int,
+              bitmap: bytes) -> None:
+    sock.sendto(NACK_STRUCT.pack(b"NACK", frame_id, first, bit_count) + bitmap, target)
+
+
+def load_display_modules() -> None:
+    global np, cv2
+    try:
+        import numpy as np
+    except Exception as exc:  # pragma: no cover
+        print(f"numpy is required: {exc}")
+        sys.exit(2)
 
+    try:
+        import cv2
+    except Exception as exc:  # pragma: no cover
+        print(f"opencv-python is required: {exc}")
+        sys.exit(2)
 
-def rgb565_to_bgr(frame_bytes: bytes, width: int, height: int) -> np.ndarray:
-    arr = np.frombuffer(frame_bytes, dtype="<u2", count=width * height)
+
+def rgb565_to_bgr(frame_bytes: bytes, width: int, height: int,
+                  big_endian: bool = True) -> "np.ndarray":
+    arr = np.frombuffer(frame_bytes, dtype=">u2" if big_endian else "<u2", count=width * height)
     r = (arr >> 11) & 0x1F
     g = (arr >> 5) & 0x3F
     b = arr & 0x1F
@@ -92,18 +318,74 @@ def rgb565_to_bgr(frame_bytes: bytes, width: int, height: int) -> np.ndarray:
     return bgr.reshape((height, width, 3))
 
 
+def gray_to_bgr(frame_bytes: bytes, width: int, height: int) -> "np.ndarray":
+    gray = np.frombuffer(frame_bytes, dtype=np.uint8, count=width * height).reshape((height, width))
+    return cv2.cvtColor(gray, cv2.COLOR_GRAY2BGR)
+
+
+def frame_to_bgr(frame: Frame) -> "np.ndarray":
+    if frame.format == FORMAT_GRAY8:
+        return gray_to_bgr(frame.data, frame.width, frame.height)
+    return rgb565_to_bgr(frame.data, frame.width, frame.height,
+                         frame.format == FORMAT_RGB565_BE)
+
+
 def send_command(sock: socket.socket, target: tuple, cmd: str) -> None:
     sock.sendto(cmd.encode("ascii"), target)
 
 
+def sync_device_clock(sock: socket.socket, target: tuple, rounds: int = 8):
+    """Offset to add to time.monotonic() in us to get the device's esp_timer
+    clock, from the TIME exchange with the shortest round trip; None if the
+    device does not answer."""
+    best = None
+    for _ in range(rounds):
+        sent_us = time.monotonic_ns() // 1000
+        send_command(sock, target, "TIME")
+        try:
+            data, _ = sock.recvfrom(64)
+        except socket.timeout:
+            continue
+        received_us = time.monotonic_ns() // 1000
+        text = data.decode("ascii", "replace")
+        if not text.startswith("time_us="):
+            continue
+        rtt = received_us - sent_us
+        offset = int(text[len("time_us="):]) - (sent_us + received_us) // 2
+        if best is None or rtt < best[0]:
+            best = (rtt, offset)
+    return best[1] if best else None
+
+
 def main() -> int:
     parser = argparse.ArgumentParser(description="View RGB565 VGA frames streamed over UDP.")
     parser.add_argument("--host", default="cam-calib.local", help="Device hostname/IP")
     parser.add_argument("--cmd-port", type=int, default=12500, help="Command port (default: 55)")
-    parser.add_argument("--stream-port", type=int, default=12501, help="Stream port (default: 81)")
-    parser.add_argument("--width", type=int, default=DEFAULT_WIDTH)
-    parser.add_argument("--height", type=int, default=DEFAULT_HEIGHT)
+    parser.add_argument("--stream-port", type=int, default=DEFAULT_STREAM_PORT,
+                        help="Port to receive frames on (START PORT=N if not 12501)")
+    parser.add_argument("--stats", type=float, default=0.0, metavar="SECONDS",
+                        help="Print device send stats (STATS command) every SECONDS")
+    parser.add_argument("--nack", action="store_true",
+                        help="Ask the device to re-send lost packets (START NACK)")
+    parser.add_argument("--fec", type=int, default=0, metavar="N",
+                        help="Ask for one XOR parity packet per N data packets (START FEC=N)")
+    parser.add_argument("--delta", action="store_true",
+                        help="Only receive changed tiles between keyframes (START DELTA)")
+    parser.add_argument("--gray", action="store_true",
+                        help="Receive 8-bit luma instead of RGB565 (START GRAY)")
+    parser.add_argument("--decimate", type=int, default=1, choices=(1, 2, 4),
+                        help="Keep every Nth pixel and row (START DECIMATE=N)")
+    parser.add_argument("--roi", metavar="X,Y,W,H",
+                        help="Crop to a rectangle in full-frame pixels (START ROI=X,Y,W,H)")
+    parser.add_argument("--rate", type=int, default=0, metavar="KBPS",
+                        help="Cap the frames sent to this viewer (START RATE=KBPS)")
+    parser.add_argument("--multicast", action="store_true",
+                        help=f"Receive frames on {MULTICAST_GROUP}, shared with other "
+                             "multicast viewers (START MCAST)")
+    parser.add_argument("--nack-deadline", type=float, default=0.3, metavar="SECONDS",
+                        help="How long to wait for re-sent packets before giving up on a frame")
     args = parser.parse_args()
+    load_display_modules()
 
     device_ip = socket.gethostbyname(args.host)
     target = (device_ip, args.cmd_port)
@@ -115,7 +397,10 @@ def main() -> int:
     recv_sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 2 * 1024 * 1024)
     recv_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     recv_sock.bind(("", args.stream_port))
-    recv_sock.settimeout(0.5)
+    if args.multicast:
+        membership = socket.inet_aton(MULTICAST_GROUP) + socket.inet_aton("0.0.0.0")
+        recv_sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    recv_sock.settimeout(0.02 if args.nack else 0.5)
 
     running = True
 
@@ -126,41 +411,92 @@ def main() -> int:
     signal.signal(signal.SIGINT, handle_signal)
     signal.signal(signal.SIGTERM, handle_signal)
 
-    send_command(ctrl_sock, target, "START")
+    start = "START"
+    if args.nack:
+        start += " NACK"
+    if args.fec:
+        start += f" FEC={args.fec}"
+    if args.delta:
+        start += " DELTA"
+    if args.gray:
+        start += " GRAY"
+    if args.decimate > 1:
+        start += f" DECIMATE={args.decimate}"
+    if args.roi:
+        start += f" ROI={args.roi}"
+    if args.rate:
+        start += f" RATE={args.rate}"
+    if args.multicast:
+        start += " MCAST"
+    elif args.stream_port != DEFAULT_STREAM_PORT:
+        start += f" PORT={args.stream_port}"
+    send_command(ctrl_sock, target, start)
     try:
         data, _ = ctrl_sock.recvfrom(64)
+        if data.startswith(b"ERR"):
+            print("Device refused START:", data.decode("ascii", "replace"))
+            return 1
         if data.strip() != b"OK":
             print("Unexpected response:", data)
     except socket.timeout:
         pass
 
-    assembler = FrameAssembler(args.width, args.height)
+    assembler = FrameAssembler(args.nack_deadline if args.nack else 0.0)
     window_name = "RGB565 UDP"
     cv2.namedWindow(window_name, cv2.WINDOW_NORMAL)
+    next_stats = time.monotonic() + args.stats
+    clock_offset = None
+    next_sync = 0.0
+    next_keepalive = time.monotonic() + KEEPALIVE_INTERVAL
 
     while running:
+        if args.stats > 0 and time.monotonic() >= next_stats:
+            next_stats += args.stats
+            send_command(ctrl_sock, target, "STATS")
+            try:
+                data, _ = ctrl_sock.recvfrom(512)
+                print("device:", data.decode("ascii", "replace"))
+            except socket.timeout:
+                print("device: no STATS reply")
+
+        if time.monotonic() >= next_keepalive:
+            next_keepalive = time.monotonic() + KEEPALIVE_INTERVAL
+            send_command(ctrl_sock, target, "KEEPALIVE")
+
+        if time.monotonic() >= next_sync:
+            next_sync = time.monotonic() + CLOCK_SYNC_INTERVAL
+            clock_offset = sync_device_clock(ctrl_sock, target)
+
+        results = []
         try:
             packet, _ = recv_sock.recvfrom(2048)
         except socket.timeout:
+            packet = b""
+        now = time.monotonic()
+        parsed = parse_packet(packet)
+        if parsed:
+            results = assembler.add_packet(*parsed, now)
+        for request in assembler.nack_requests(now):
+            send_nack(ctrl_sock, target, *request)
+        results += assembler.expire(now)
+        if not results:
             continue
-        if len(packet) < HEADER_SIZE:
-            continue
-
-        frame_id, packet_index, packet_count, payload_len, _reserved = HEADER_STRUCT.unpack_from(packet)
-        if payload_len == 0:
-            continue
-        payload = packet[HEADER_SIZE:HEADER_SIZE + payload_len]
-        if len(payload) < payload_len:
-            continue
-
-        result = assembler.add_packet(frame_id, packet_index, packet_count, payload)
-        if result is None:
-            continue
-
-        frame_id, loss_pct, frame_bytes = result
-        bgr = rgb565_to_bgr(frame_bytes, args.width, args.height)
 
-        text = f"frame {frame_id} loss {loss_pct:.1f}%"
+        frame = results[-1]
+        bgr = frame_to_bgr(frame)
+
+        text = f"frame {frame.frame_id} loss {frame.loss_pct:.1f}%"
+        if clock_offset is not None:
+            latency_ms = (time.monotonic_ns() // 1000 + clock_offset - frame.capture_us) / 1000.0
+            text += f" latency {latency_ms:.0f} ms"
+        if assembler.crc_errors:
+            text += f" crc errors {assembler.crc_errors}"
+        if args.nack:
+            text += f" resent {assembler.retransmitted}"
+        if args.fec:
+            text += f" fec {assembler.recovered}"
+        if args.delta:
+            text += f" tiles {assembler.tiles}"
         cv2.putText(bgr, text, (10, 25), cv2.FONT_HERSHEY_SIMPLEX,
                     0.7, (0, 255, 0), 2, cv2.LINE_AA)
         cv2.imshow(window_name, bgr)